@@ -0,0 +1,177 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+#include "Common.hpp"
+
+// 申请/释放记录(trace)，编译时加 -DHC_TRACE 才会在 ConcurrentAlloc/ConcurrentFree 里记录
+// 运行时用 AllocTrace::GetInstance()->Start(path) / Stop() 开关
+//
+// 每个线程把记录写进自己的缓冲区，写记录本身不加锁；缓冲区满了才加锁写文件
+// 文件格式：TraceHeader 后面跟着若干 TraceRecord，不同线程的记录按刷盘的顺序交错，
+// 回放工具(tracereplay)读进来以后按时间戳排序
+
+enum TraceOp
+{
+    TRACE_ALLOC = 0,
+    TRACE_FREE = 1,
+};
+
+struct TraceHeader
+{
+    char _magic[8];         // "HCTRACE1"
+    uint32_t _recordSize;   // sizeof(TraceRecord)，读的时候校验
+    uint32_t _reserved;
+};
+
+struct TraceRecord
+{
+    uint64_t _time;     // 从Start开始的纳秒数
+    uint64_t _obj;      // 对象的地址，同一个地址释放后可能被再次申请，回放时按时间顺序区分
+    uint64_t _size;     // 申请的大小，释放时为0
+    uint32_t _tid;      // 线程编号，从0开始
+    uint32_t _op;       // TraceOp
+};
+
+static const size_t TRACE_BUFFER_RECORDS = 4096;   // 每个线程缓冲4096条(128KB)
+
+// 一个线程的缓冲区
+// 只有所属线程往里追加记录，追加时先写记录再用CAS把_size加一，
+// Stop时别的线程刷盘只读[0, _size)，不会读到写了一半的记录
+struct TraceBuffer
+{
+    TraceRecord _records[TRACE_BUFFER_RECORDS];
+    std::atomic<size_t> _size{ 0 };
+    std::mutex _flushMtx;           // 刷盘时加锁，所属线程和Stop可能同时刷
+    uint32_t _tid = 0;
+    TraceBuffer* _next = nullptr;   // 所有缓冲区串成链表，Stop时统一刷盘
+};
+
+class AllocTrace
+{
+private:
+    std::atomic<bool> _enabled{ false };
+    FILE* _file = nullptr;
+    std::mutex _fileMtx;                    // 保护_file
+    std::mutex _buffersMtx;                 // 保护_buffers链表
+    TraceBuffer* _buffers = nullptr;
+    std::atomic<uint32_t> _nextTid{ 0 };
+    std::chrono::steady_clock::time_point _start;
+
+    static AllocTrace _sInst;       // 定义在HcMalloc.cc
+
+    constexpr AllocTrace()
+    {}
+    AllocTrace(const AllocTrace&) = delete;
+public:
+    static AllocTrace* GetInstance()
+    {
+        return &_sInst;
+    }
+
+    bool Enabled() const
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    // 开始记录，写到path
+    bool Start(const char* path)
+    {
+        std::lock_guard<std::mutex> lock(_fileMtx);
+        if (_file)
+            return false;
+
+        _file = fopen(path, "wb");
+        if (_file == nullptr)
+            return false;
+
+        TraceHeader header = { { 'H', 'C', 'T', 'R', 'A', 'C', 'E', '1' }, sizeof(TraceRecord), 0 };
+        fwrite(&header, sizeof(header), 1, _file);
+
+        _start = std::chrono::steady_clock::now();
+        _enabled.store(true);
+        return true;
+    }
+
+    // 停止记录，把所有线程缓冲区里剩下的记录写完并关闭文件
+    void Stop()
+    {
+        _enabled.store(false);
+
+        {
+            std::lock_guard<std::mutex> lock(_buffersMtx);
+            for (TraceBuffer* buf = _buffers; buf; buf = buf->_next)
+            {
+                Flush(buf);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(_fileMtx);
+        if (_file)
+        {
+            fclose(_file);
+            _file = nullptr;
+        }
+    }
+
+    void Record(TraceOp op, void* obj, size_t size)
+    {
+        TraceBuffer* buf = GetBuffer();
+
+        size_t n = buf->_size.load(std::memory_order_relaxed);
+        if (n == TRACE_BUFFER_RECORDS)
+        {
+            Flush(buf);
+            n = buf->_size.load(std::memory_order_relaxed);
+        }
+
+        TraceRecord& rec = buf->_records[n];
+        rec._time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - _start).count();
+        rec._obj = (uint64_t)(uintptr_t)obj;
+        rec._size = size;
+        rec._tid = buf->_tid;
+        rec._op = op;
+        // Stop可能刚把这个缓冲区刷完清零，这时CAS失败，这条记录本来就发生在Stop之后，丢掉即可
+        buf->_size.compare_exchange_strong(n, n + 1, std::memory_order_release, std::memory_order_relaxed);
+    }
+
+private:
+    void Flush(TraceBuffer* buf)
+    {
+        std::lock_guard<std::mutex> bufLock(buf->_flushMtx);
+        size_t n = buf->_size.load(std::memory_order_acquire);
+        if (n == 0)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(_fileMtx);
+            if (_file)
+                fwrite(buf->_records, sizeof(TraceRecord), n, _file);
+        }
+        buf->_size.store(0, std::memory_order_release);
+    }
+
+    // 缓冲区用malloc申请，不走内存池，避免记录的时候又触发记录
+    // 线程退出时缓冲区不释放（还挂在链表上），里面的记录在下一次Stop时写出去
+    TraceBuffer* GetBuffer()
+    {
+        static thread_local TraceBuffer* tlsBuffer = nullptr;
+        if (tlsBuffer == nullptr)
+        {
+            void* mem = malloc(sizeof(TraceBuffer));
+            if (mem == nullptr)
+                throw std::bad_alloc();
+            tlsBuffer = new (mem) TraceBuffer;
+            tlsBuffer->_tid = _nextTid++;
+
+            std::lock_guard<std::mutex> lock(_buffersMtx);
+            tlsBuffer->_next = _buffers;
+            _buffers = tlsBuffer;
+        }
+        return tlsBuffer;
+    }
+};
+
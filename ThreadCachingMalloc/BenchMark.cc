@@ -1,5 +1,26 @@
+#include <iostream>
+#include <map>
+#include <list>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <condition_variable>
+#include <barrier>
+#include <set>
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include "ConcurrentAlloc.hpp"
 #include "PageCache.hpp"
+#include "HcAllocator.hpp"
+#include "ConcurrentArena.hpp"
+#include "HcHeap.hpp"
+#include "ShmPool.hpp"
+#include "Warmup.hpp"
+#include "HcBuffer.hpp"
+
+using std::cout;
+using std::endl;
 
 // ntimes 一轮申请和释放内存的次数
 // rounds 轮次
@@ -113,15 +134,1496 @@ void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
 		nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
 }
 
-int main()
+// 节点型容器的插入/删除抖动：每轮插入ntimes个节点，再按插入顺序删掉一半，然后清空
+// Map是容器类型，分别用std::allocator和HcAllocator实例化后对比
+template <class Map>
+size_t MapChurn(size_t ntimes, size_t rounds)
+{
+	size_t begin = clock();
+	for (size_t j = 0; j < rounds; ++j)
+	{
+		Map m;
+		for (size_t i = 0; i < ntimes; ++i)
+		{
+			m.emplace((int)(i * 2654435761u % ntimes), (int)i);
+		}
+		for (size_t i = 0; i < ntimes; i += 2)
+		{
+			m.erase((int)(i * 2654435761u % ntimes));
+		}
+		for (size_t i = 0; i < ntimes; ++i)
+		{
+			m.emplace((int)(i * 40503u % ntimes), (int)i);
+		}
+	}
+	return clock() - begin;
+}
+
+template <class Map>
+void BenchmarkMapChurn(const char* name, size_t ntimes, size_t nworks, size_t rounds)
+{
+	std::vector<std::thread> vthread(nworks);
+	std::atomic<size_t> costtime(0);
+
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&]() {
+			costtime += MapChurn<Map>(ntimes, rounds);
+			});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	printf("%-40s %zu个线程并发执行%zu轮次，每轮次插入%zu个节点: 花费：%zu ms\n",
+		name, nworks, rounds, ntimes, costtime.load());
+}
+
+void BenchmarkNodeContainers(size_t ntimes, size_t nworks, size_t rounds)
+{
+	typedef std::pair<const int, int> Node;
+
+	BenchmarkMapChurn<std::map<int, int>>("std::map<std::allocator>", ntimes, nworks, rounds);
+	BenchmarkMapChurn<std::map<int, int, std::less<int>, HcAllocator<Node>>>(
+		"std::map<HcAllocator>", ntimes, nworks, rounds);
+
+	BenchmarkMapChurn<std::unordered_map<int, int>>("std::unordered_map<std::allocator>", ntimes, nworks, rounds);
+	BenchmarkMapChurn<std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, HcAllocator<Node>>>(
+		"std::unordered_map<HcAllocator>", ntimes, nworks, rounds);
+
+	// pmr容器默认用 get_default_resource()，这里把默认资源换成内存池
+	std::pmr::memory_resource* old = std::pmr::set_default_resource(HcMemoryResource::GetInstance());
+	BenchmarkMapChurn<std::pmr::map<int, int>>("std::pmr::map<HcMemoryResource>", ntimes, nworks, rounds);
+	std::pmr::set_default_resource(old);
+	BenchmarkMapChurn<std::pmr::map<int, int>>("std::pmr::map<new_delete_resource>", ntimes, nworks, rounds);
+}
+
+// 模拟一次请求：申请nobjs个大小在[16, 528)之间的对象，请求结束时全部释放
+// 对比逐个ConcurrentAlloc/ConcurrentFree 和 ConcurrentArena 一次性Reset
+void BenchmarkArena(size_t nobjs, size_t nworks, size_t nrequests)
+{
+	std::vector<std::thread> vthread(nworks);
+	std::atomic<size_t> pool_costtime(0);
+	std::atomic<size_t> arena_costtime(0);
+
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&]() {
+			std::vector<void*> v;
+			v.reserve(nobjs);
+
+			size_t begin1 = clock();
+			for (size_t j = 0; j < nrequests; ++j)
+			{
+				for (size_t i = 0; i < nobjs; ++i)
+				{
+					v.push_back(ConcurrentAlloc(16 + (i * 37) % 512));
+				}
+				for (size_t i = 0; i < nobjs; ++i)
+				{
+					ConcurrentFree(v[i]);
+				}
+				v.clear();
+			}
+			size_t end1 = clock();
+
+			size_t begin2 = clock();
+			for (size_t j = 0; j < nrequests; ++j)
+			{
+				ConcurrentArena arena;
+				for (size_t i = 0; i < nobjs; ++i)
+				{
+					arena.Allocate(16 + (i * 37) % 512);
+				}
+			}
+			size_t end2 = clock();
+
+			pool_costtime += (end1 - begin1);
+			arena_costtime += (end2 - begin2);
+			});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	printf("%zu个线程并发处理%zu个请求，每个请求%zu个对象，逐个alloc/free: 花费：%zu ms\n",
+		nworks, nrequests, nobjs, pool_costtime.load());
+	printf("%zu个线程并发处理%zu个请求，每个请求%zu个对象，arena批量释放: 花费：%zu ms\n",
+		nworks, nrequests, nobjs, arena_costtime.load());
+}
+
+// 采样保护对快路径的影响：关闭、每10万次抽一次、每1000次抽一次
+// 关闭时快路径只多一次计数器减一；和完全去掉的版本对比用 make CXXFLAGS=-DHC_NO_GUARDED_SAMPLING
+void BenchmarkGuarded(size_t ntimes, size_t nworks, size_t rounds)
+{
+	long rates[] = { 0, 100000, 1000 };
+	for (long rate : rates)
+	{
+#ifdef HC_GUARDED_SAMPLING
+		GuardedPool::GetInstance()->SetSampleRate(rate);
+#else
+		if (rate != 0)
+			continue;
+#endif
+		std::vector<std::thread> vthread(nworks);
+		std::atomic<size_t> costtime(0);
+		for (size_t k = 0; k < nworks; ++k)
+		{
+			vthread[k] = std::thread([&]() {
+				std::vector<void*> v;
+				v.reserve(ntimes);
+
+				size_t begin = clock();
+				for (size_t j = 0; j < rounds; ++j)
+				{
+					for (size_t i = 0; i < ntimes; i++)
+					{
+						v.push_back(ConcurrentAlloc(16));
+					}
+					for (size_t i = 0; i < ntimes; i++)
+					{
+						ConcurrentFree(v[i]);
+					}
+					v.clear();
+				}
+				costtime += clock() - begin;
+				});
+		}
+		for (auto& t : vthread)
+		{
+			t.join();
+		}
+
+		printf("%zu个线程并发执行%zu轮次，每轮次alloc&free %zu次，抽样间隔%ld: 花费：%zu ms\n",
+			nworks, rounds, ntimes, rate, costtime.load());
+	}
+#ifdef HC_GUARDED_SAMPLING
+	GuardedPool::GetInstance()->SetSampleRate(0);
+#endif
+}
+
+// 当前进程的RSS，单位字节
+static size_t CurrentRSS()
+{
+	size_t pages = 0, rss = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp)
+	{
+		if (fscanf(fp, "%zu %zu", &pages, &rss) != 2)
+			rss = 0;
+		fclose(fp);
+	}
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+// 长时间运行的碎片测试：每个线程先申请到highObjs个对象，再随机释放到lowObjs个，
+// 之后每一轮随机释放一半存活对象再申请回来（量要大过ThreadCache能攒住的，才会落到CentralCache上）
+// 每一轮打印 存活字节数 / CentralCache持有的span字节数 / RSS：
+// span字节数远大于存活字节数，说明存活对象分散在很多span上，span还不回PageCache；
+// 申请优先填满的span时，稀疏的span会一轮轮被掏空还回去，span字节数应该逐渐往存活字节数靠拢
+void BenchmarkFragmentation(size_t nworks, size_t epochs)
+{
+	static const size_t sizes[] = { 16, 48, 64, 128, 200, 512, 1024, 4096 };
+	const size_t highObjs = 200000 / nworks;
+	const size_t lowObjs = highObjs / 8;
+
+	std::atomic<size_t> liveBytes(0);
+	std::vector<size_t> epochDone(epochs, 0);
+	std::mutex printMtx;
+	std::condition_variable cond;
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			std::mt19937_64 rng(k + 1);
+			std::vector<std::pair<void*, size_t>> live;
+
+			auto alloc = [&](size_t n) {
+				while (live.size() < n)
+				{
+					size_t size = sizes[rng() % (sizeof(sizes) / sizeof(sizes[0]))];
+					live.emplace_back(ConcurrentAlloc(size), size);
+					liveBytes += size;
+				}
+			};
+			auto release = [&](size_t n) {
+				while (live.size() > n)
+				{
+					size_t j = rng() % live.size();
+					ConcurrentFree(live[j].first);
+					liveBytes -= live[j].second;
+					live[j] = live.back();
+					live.pop_back();
+				}
+			};
+
+			for (size_t e = 0; e < epochs; ++e)
+			{
+				if (e == 0)
+				{
+					alloc(highObjs);
+				}
+				else if (e == 1)
+				{
+					release(lowObjs);
+				}
+				else
+				{
+					release(lowObjs / 2);
+					alloc(lowObjs);
+				}
+
+				std::unique_lock<std::mutex> lock(printMtx);
+				if (++epochDone[e] == nworks)
+				{
+					double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+					printf("第%3zu轮 %6.2fs  存活: %8.2f MB  CentralCache span: %8.2f MB  RSS: %8.2f MB\n",
+						e, secs, liveBytes.load() / 1048576.0,
+						CentralCache::GetInstance()->SpanBytes() / 1048576.0, CurrentRSS() / 1048576.0);
+					cond.notify_all();
+				}
+				else
+				{
+					cond.wait(lock, [&]() { return epochDone[e] == nworks; });
+				}
+			}
+
+			release(0);
+			});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+}
+
+// 突发负载之后的稳态内存：每个线程先突发申请burst个各种大小的对象再全部释放，
+// 然后进入稳态，每轮只申请释放16个64字节的对象；打印突发后和稳态中各线程ThreadCache缓存的字节数
+// 另有nworks个线程突发之后就闲着，等稳态结束再看它们的ThreadCache（由稳态线程的定期回收替它们还掉）
+void BenchmarkBurst(size_t nworks, size_t burst, size_t steadyRounds)
+{
+	std::vector<std::thread> vthread(2 * nworks);
+	std::atomic<size_t> afterBurst(0);
+	std::atomic<size_t> afterSteady(0);
+	std::atomic<size_t> afterIdle(0);
+	std::atomic<size_t> steadyCost(0);
+	std::atomic<size_t> steadyLeft(nworks);
+
+	for (size_t k = 0; k < 2 * nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			std::vector<void*> v;
+			v.reserve(burst);
+			for (size_t i = 0; i < burst; ++i)
+			{
+				v.push_back(ConcurrentAlloc((16 + i * 37) % 4096 + 1));
+			}
+			for (size_t i = 0; i < burst; ++i)
+			{
+				ConcurrentFree(v[i]);
+			}
+			v.clear();
+			afterBurst += GetThreadCache()->CachedBytes();
+
+			if (k >= nworks)
+			{
+				while (steadyLeft > 0)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				}
+				afterIdle += GetThreadCache()->CachedBytes();
+				return;
+			}
+
+			size_t begin = clock();
+			for (size_t j = 0; j < steadyRounds; ++j)
+			{
+				for (size_t i = 0; i < 16; ++i)
+				{
+					v.push_back(ConcurrentAlloc(64));
+				}
+				for (size_t i = 0; i < 16; ++i)
+				{
+					ConcurrentFree(v[i]);
+				}
+				v.clear();
+			}
+			steadyCost += clock() - begin;
+			afterSteady += GetThreadCache()->CachedBytes();
+			--steadyLeft;
+			});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	printf("%zu个线程，每个线程突发申请释放%zu次后，ThreadCache共缓存: %8.2f KB\n",
+		2 * nworks, burst, afterBurst.load() / 1024.0);
+	printf("%zu个线程，稳态申请释放%zu轮后，ThreadCache共缓存:   %8.2f KB  稳态花费：%zu ms\n",
+		nworks, steadyRounds, afterSteady.load() / 1024.0, steadyCost.load());
+	printf("%zu个线程，突发后一直闲着，稳态结束时ThreadCache共缓存: %8.2f KB\n",
+		nworks, afterIdle.load() / 1024.0);
+	printf("线程退出后CentralCache持有的span: %8.2f KB\n",
+		CentralCache::GetInstance()->SpanBytes() / 1024.0);
+}
+
+#ifdef HC_TRACE
+// 用不同大小的申请释放生成一份trace，同时对比开关记录时的耗时
+// 需要用 make CXXFLAGS=-DHC_TRACE 编译，生成的文件用 tracereplay 回放
+void BenchmarkTrace(const char* path, size_t ntimes, size_t nworks, size_t rounds)
+{
+	auto run = [&]() {
+		std::vector<std::thread> vthread(nworks);
+		std::atomic<size_t> costtime(0);
+		for (size_t k = 0; k < nworks; ++k)
+		{
+			vthread[k] = std::thread([&, k]() {
+				std::vector<void*> v;
+				v.reserve(ntimes);
+
+				size_t begin = clock();
+				for (size_t j = 0; j < rounds; ++j)
+				{
+					for (size_t i = 0; i < ntimes; i++)
+					{
+						v.push_back(ConcurrentAlloc((16 + i * (k + 1)) % 8192 + 1));
+					}
+					for (size_t i = 0; i < ntimes; i++)
+					{
+						ConcurrentFree(v[i]);
+					}
+					v.clear();
+				}
+				costtime += clock() - begin;
+				});
+		}
+		for (auto& t : vthread)
+		{
+			t.join();
+		}
+		return costtime.load();
+	};
+
+	size_t untraced = run();
+	AllocTrace::GetInstance()->Start(path);
+	size_t traced = run();
+	AllocTrace::GetInstance()->Stop();
+
+	printf("%zu个线程并发执行%zu轮次，每轮次alloc&free %zu次，不记录: 花费：%zu ms\n",
+		nworks, rounds, ntimes, untraced);
+	printf("%zu个线程并发执行%zu轮次，每轮次alloc&free %zu次，记录trace: 花费：%zu ms\n",
+		nworks, rounds, ntimes, traced);
+	printf("trace已写入 %s\n", path);
+}
+#endif
+
+// CentralCache桶锁的扩展性：每个线程反复从CentralCache拿一小批再还回去，临界区很短
+// 线程k用第k % nclasses个大小类（8、16、24...字节，相邻的桶），线程数不超过nclasses时每个线程一个桶，
+// 只有相邻桶之间的伪共享；超过以后多个线程抢同一个桶
+// make CXXFLAGS='-O2 -DHC_SPIN_LOCK' 换成自旋锁再跑一次对比
+void BenchmarkBucketLocks(size_t nclasses, size_t batch, size_t opsPerThread)
+{
+#ifdef HC_SPIN_LOCK
+	printf("桶锁: SpinMutex，每次拿%zu个，%zu个相邻的大小类\n", batch, nclasses);
+#else
+	printf("桶锁: std::mutex，每次拿%zu个，%zu个相邻的大小类\n", batch, nclasses);
+#endif
+	for (size_t nworks = 1; nworks <= 64; nworks *= 2)
+	{
+		std::vector<std::thread> vthread(nworks);
+		std::atomic<bool> go{ false };
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t k = 0; k < nworks; ++k)
+		{
+			vthread[k] = std::thread([&, k]() {
+				size_t size = SizeClass::ClassSize(k % nclasses);
+				while (!go.load())
+					std::this_thread::yield();
+				for (size_t i = 0; i < opsPerThread; ++i)
+				{
+					void* start = nullptr;
+					void* end = nullptr;
+					CentralCache::GetInstance()->FetchRangeObj(start, end, batch, size);
+					CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+				}
+				});
+		}
+		begin = std::chrono::steady_clock::now();
+		go = true;
+		for (auto& t : vthread)
+		{
+			t.join();
+		}
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		printf("%3zu个线程: %8.2f 百万次/秒（一次是拿一批加还一批）\n", nworks, nworks * opsPerThread / secs / 1e6);
+	}
+}
+
+// 存活对象很多时的释放：每个线程先申请nobjs个随机大小的对象，打乱顺序后逐个用不带大小的ConcurrentFree释放
+// 每次释放都要按地址找到所在的span，存活对象多、顺序随机时这次查找基本都不在缓存里
+void BenchmarkFreeHeavy(size_t nobjs, size_t nworks, size_t rounds)
+{
+	std::vector<std::thread> vthread(nworks);
+	std::atomic<size_t> alloctime{ 0 };
+	std::atomic<size_t> freetime{ 0 };
+
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			std::mt19937_64 rng(k);
+			std::vector<void*> v(nobjs);
+			for (size_t j = 0; j < rounds; ++j)
+			{
+				auto begin1 = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < nobjs; i++)
+				{
+					v[i] = ConcurrentAlloc(16 + rng() % 497);
+				}
+				auto end1 = std::chrono::steady_clock::now();
+
+				std::shuffle(v.begin(), v.end(), rng);
+
+				auto begin2 = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < nobjs; i++)
+				{
+					ConcurrentFree(v[i]);
+				}
+				auto end2 = std::chrono::steady_clock::now();
+
+				alloctime += std::chrono::duration_cast<std::chrono::microseconds>(end1 - begin1).count();
+				freetime += std::chrono::duration_cast<std::chrono::microseconds>(end2 - begin2).count();
+			}
+			});
+	}
+
+	for (auto& t : vthread)
+	{
+		t.join();
+	}
+
+	printf("%zu个线程各%zu轮，每轮申请%zu个对象: 花费：%zu us\n", nworks, rounds, nobjs, alloctime.load());
+	printf("%zu个线程各%zu轮，每轮乱序释放%zu个对象: 花费：%zu us，平均每次%.1f ns\n", nworks, rounds, nobjs,
+		freetime.load(), freetime.load() * 1000.0 / (nworks * rounds * nobjs));
+}
+
+// 每个大小类第一次申请的耗时和RSS：第一次申请要从PageCache拿一个新的span
+// 在fork出来的子进程里跑，保证每个大小类都是第一次
+void BenchmarkFirstAlloc()
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		size_t baseRSS = CurrentRSS();
+		double worst = 0, total = 0;
+		size_t worstSize = 0;
+		for (size_t i = 0; i < NFREELIST; ++i)
+		{
+			size_t size = SizeClass::ClassSize(i);
+			auto begin = std::chrono::steady_clock::now();
+			void* ptr = ConcurrentAlloc(size);
+			double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+			memset(ptr, 0, size);
+
+			total += us;
+			if (us > worst)
+			{
+				worst = us;
+				worstSize = size;
+			}
+		}
+		printf("%zu个大小类第一次申请: 共%.1f us, 最慢%.1f us (%zu字节), RSS增加%.2f MB\n",
+			NFREELIST, total, worst, worstSize, (double)(CurrentRSS() - baseRSS) / (1024 * 1024));
+		fflush(stdout);
+		_exit(0);
+	}
+	waitpid(pid, nullptr, 0);
+}
+
+// 编译期大小 ConcurrentAlloc<N>() 和运行期大小 ConcurrentAlloc(size) 的快路径对比
+// 每次申请一批再释放一批，批次不超过链表的长度上限，基本都命中ThreadCache；结果是每对申请+释放的平均纳秒数
+// 要看展开后的代码：make CXXFLAGS=-O2 以后 objdump -d --no-show-raw-insn tcmalloc | c++filt，
+// 找 FixedLoop<16ul>，循环体里只有TLS读和链表的头删头插，Index/RoundUp 已经变成常量
+template <size_t N>
+__attribute__((noinline)) void FixedLoop(void** ptrs, size_t batch, size_t rounds)
+{
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < batch; ++i)
+			ptrs[i] = ConcurrentAlloc<N>();
+		for (size_t i = 0; i < batch; ++i)
+			ConcurrentFree<N>(ptrs[i]);
+	}
+}
+
+__attribute__((noinline)) void RuntimeLoop(void** ptrs, size_t size, size_t batch, size_t rounds)
+{
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (size_t i = 0; i < batch; ++i)
+			ptrs[i] = ConcurrentAlloc(size);
+		for (size_t i = 0; i < batch; ++i)
+			ConcurrentFree(ptrs[i], size);
+	}
+}
+
+template <size_t N>
+void BenchmarkFixedSize(size_t batch, size_t rounds)
+{
+	std::vector<void*> ptrs(batch);
+	// 大小从volatile里读出来，编译器没法把运行期的版本也算成常量
+	volatile size_t runtimeSize = N;
+
+	// 先各跑一遍，让链表长度涨到位
+	FixedLoop<N>(ptrs.data(), batch, 10);
+	RuntimeLoop(ptrs.data(), runtimeSize, batch, 10);
+
+	auto begin = std::chrono::steady_clock::now();
+	FixedLoop<N>(ptrs.data(), batch, rounds);
+	auto mid = std::chrono::steady_clock::now();
+	RuntimeLoop(ptrs.data(), runtimeSize, batch, rounds);
+	auto end = std::chrono::steady_clock::now();
+
+	double ops = (double)batch * rounds;
+	printf("%6zu字节  ConcurrentAlloc<N>: %6.2f ns  ConcurrentAlloc(size): %6.2f ns\n", N,
+		std::chrono::duration<double, std::nano>(mid - begin).count() / ops,
+		std::chrono::duration<double, std::nano>(end - mid).count() / ops);
+}
+
+void BenchmarkFixed(size_t batch, size_t rounds)
+{
+	printf("每对申请+释放的平均耗时，每批%zu个，%zu轮\n", batch, rounds);
+	BenchmarkFixedSize<16>(batch, rounds);
+	BenchmarkFixedSize<64>(batch, rounds);
+	BenchmarkFixedSize<200>(batch, rounds);
+	BenchmarkFixedSize<1500>(batch, rounds);
+	BenchmarkFixedSize<4096>(batch, rounds);
+}
+
+// 销毁一个装了totalBytes字节对象的堆：一个个hc_heap_free再销毁 / 直接hc_heap_destroy / 默认堆上一个个ConcurrentFree
+// 对象大小在[16, 512]之间随机，按随机顺序释放（缓存之类的子系统里对象的释放顺序和申请顺序无关）
+void BenchmarkHeapDestroy(size_t totalBytes)
+{
+	std::mt19937_64 rng(1);
+	std::vector<size_t> sizes;
+	for (size_t bytes = 0; bytes < totalBytes;)
+	{
+		sizes.push_back(16 + rng() % 497);
+		bytes += sizes.back();
+	}
+	std::vector<size_t> order(sizes.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		order[i] = i;
+	}
+	std::shuffle(order.begin(), order.end(), rng);
+	std::vector<void*> v(sizes.size());
+
+	auto fill = [&](auto alloc) {
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < sizes.size(); ++i)
+		{
+			v[i] = alloc(sizes[i]);
+			*(size_t*)v[i] = i;
+		}
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	};
+	auto since = [](std::chrono::steady_clock::time_point begin) {
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	};
+
+	printf("%zu个对象，共%.0f MB\n", sizes.size(), totalBytes / 1048576.0);
+
+	{
+		HcHeap* heap = hc_heap_create();
+		double allocMs = fill([heap](size_t size) { return hc_heap_alloc(heap, size); });
+		size_t rss = CurrentRSS();
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t i : order)
+		{
+			hc_heap_free(heap, v[i]);
+		}
+		hc_heap_destroy(heap);
+		printf("%-34s 申请: %8.1f ms  销毁: %8.1f ms  RSS: %7.1f MB -> %7.1f MB\n", "hc_heap_free逐个释放+hc_heap_destroy",
+			allocMs, since(begin), rss / 1048576.0, CurrentRSS() / 1048576.0);
+	}
+
+	{
+		HcHeap* heap = hc_heap_create();
+		double allocMs = fill([heap](size_t size) { return hc_heap_alloc(heap, size); });
+		size_t rss = CurrentRSS();
+		auto begin = std::chrono::steady_clock::now();
+		hc_heap_destroy(heap);
+		printf("%-34s 申请: %8.1f ms  销毁: %8.1f ms  RSS: %7.1f MB -> %7.1f MB\n", "直接hc_heap_destroy",
+			allocMs, since(begin), rss / 1048576.0, CurrentRSS() / 1048576.0);
+	}
+
+	{
+		double allocMs = fill([](size_t size) { return ConcurrentAlloc(size); });
+		size_t rss = CurrentRSS();
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t i : order)
+		{
+			ConcurrentFree(v[i]);
+		}
+		printf("%-34s 申请: %8.1f ms  销毁: %8.1f ms  RSS: %7.1f MB -> %7.1f MB\n", "默认堆ConcurrentFree逐个释放",
+			allocMs, since(begin), rss / 1048576.0, CurrentRSS() / 1048576.0);
+	}
+}
+
+// 页从哪里来对申请吞吐的影响：匿名内存 / memfd / dir目录下的文件
+// 每个堆申请totalBytes字节[16, 512]随机大小的对象，每个对象写第一个字（第一次碰到新页要缺页，文件做后备时还要分配文件的块）；
+// 文件做后备的再量一次整个堆写回文件(hc_heap_sync)的时间
+void BenchmarkFileHeap(size_t totalBytes, const char* dir)
+{
+	struct Backing
+	{
+		const char* _name;
+		bool _fileBacked;
+		const char* _dir;
+	};
+	const Backing backings[] = {
+		{ "匿名内存", false, nullptr },
+		{ "memfd", true, nullptr },
+		{ dir, true, dir },
+	};
+
+	for (const Backing& backing : backings)
+	{
+		HcHeapOptions options;
+		options._fileBacked = backing._fileBacked;
+		options._dir = backing._dir;
+		HcHeap* heap = hc_heap_create(&options);
+		if (heap == nullptr)
+		{
+			printf("%-12s 创建失败\n", backing._name);
+			continue;
+		}
+
+		std::mt19937_64 rng(1);
+		size_t nobjs = 0;
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t bytes = 0; bytes < totalBytes; ++nobjs)
+		{
+			size_t size = 16 + rng() % 497;
+			size_t* p = (size_t*)hc_heap_alloc(heap, size);
+			*p = nobjs;
+			bytes += size;
+		}
+		double allocMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+		begin = std::chrono::steady_clock::now();
+		hc_heap_sync(heap, nullptr);
+		double syncMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+		printf("%-12s %zu个对象 %.0f MB: 申请 %8.1f ms (%6.1f 百万次/秒, %7.1f MB/s)  写回文件 %8.1f ms\n",
+			backing._name, nobjs, totalBytes / 1048576.0, allocMs, nobjs / allocMs / 1e3,
+			totalBytes / 1048576.0 / (allocMs / 1e3), syncMs);
+		hc_heap_destroy(heap);
+	}
+}
+
+// 两个进程之间传消息：共享内存池里申请好，把偏移放进池子里的环形队列，对方直接读完释放；
+// 对比把同样的内容写进管道、对方读到自己的缓冲区里（两次拷贝）
+struct ShmRing
+{
+	static const size_t CAPACITY = 1024;
+	std::atomic<uint64_t> _head;	// 生产者放了多少个
+	std::atomic<uint64_t> _tail;	// 消费者取了多少个
+	uint64_t _slots[CAPACITY];
+};
+
+static double ShmPipeline(const char* name, size_t msgBytes, size_t count)
+{
+	ShmPool* pool = hc_shm_create(name, (size_t)256 << 20);
+	if (pool == nullptr)
+		return 0;
+	ShmRing* ring = new (hc_shm_alloc(pool, sizeof(ShmRing))) ShmRing();
+	pool->SetRoot(hc_shm_offset(pool, ring));
+
+	auto begin = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		// 按名字重新打开，映射地址和父进程不一样
+		ShmPool* child = hc_shm_open(name);
+		if (child == nullptr)
+			_exit(1);
+		ShmRing* r = (ShmRing*)hc_shm_ptr(child, child->Root());
+		for (uint64_t i = 0; i < count; ++i)
+		{
+			while (r->_head.load(std::memory_order_acquire) == i)
+				sched_yield();
+			unsigned char* msg = (unsigned char*)hc_shm_ptr(child, r->_slots[i % ShmRing::CAPACITY]);
+			size_t sum = 0;
+			for (size_t j = 0; j < msgBytes; j += sizeof(size_t))
+				sum += *(size_t*)(msg + j);
+			if (msg[0] != (unsigned char)i || sum == 0)
+				_exit(2);
+			hc_shm_free(child, msg);
+			r->_tail.store(i + 1, std::memory_order_release);
+		}
+		hc_shm_close(child);
+		_exit(0);
+	}
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		void* msg = nullptr;
+		while (i - ring->_tail.load(std::memory_order_acquire) == ShmRing::CAPACITY
+			|| (msg = hc_shm_alloc(pool, msgBytes)) == nullptr)
+			sched_yield();
+		memset(msg, (unsigned char)i | 1, msgBytes);
+		*(unsigned char*)msg = (unsigned char)i;
+		ring->_slots[i % ShmRing::CAPACITY] = hc_shm_offset(pool, msg);
+		ring->_head.store(i + 1, std::memory_order_release);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+	hc_shm_free(pool, ring);
+	pool->ReleaseThreadCache();
+	size_t leaked = pool->UsedPages();
+	hc_shm_close(pool);
+	hc_shm_unlink(name);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || leaked != 0)
+		return 0;
+	return ms;
+}
+
+static double PipePipeline(size_t msgBytes, size_t count)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return 0;
+	fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+
+	auto begin = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		close(fds[1]);
+		std::vector<unsigned char> buf(msgBytes);
+		for (uint64_t i = 0; i < count; ++i)
+		{
+			for (size_t got = 0; got < msgBytes;)
+			{
+				ssize_t r = read(fds[0], buf.data() + got, msgBytes - got);
+				if (r <= 0)
+					_exit(1);
+				got += r;
+			}
+			size_t sum = 0;
+			for (size_t j = 0; j < msgBytes; j += sizeof(size_t))
+				sum += *(size_t*)(buf.data() + j);
+			if (buf[0] != (unsigned char)i || sum == 0)
+				_exit(2);
+		}
+		_exit(0);
+	}
+
+	close(fds[0]);
+	std::vector<unsigned char> buf(msgBytes);
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		memset(buf.data(), (unsigned char)i | 1, msgBytes);
+		buf[0] = (unsigned char)i;
+		for (size_t put = 0; put < msgBytes;)
+		{
+			ssize_t w = write(fds[1], buf.data() + put, msgBytes - put);
+			if (w <= 0)
+				break;
+			put += w;
+		}
+	}
+	close(fds[1]);
+	int status = 0;
+	waitpid(pid, &status, 0);
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? ms : 0;
+}
+
+void BenchmarkShmPipeline(size_t totalBytes)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/hcmalloc-bench-%d", (int)getpid());
+
+	const size_t sizes[] = { 256, 4096, 65536, 1 << 20 };
+	for (size_t msgBytes : sizes)
+	{
+		size_t count = std::max(totalBytes / msgBytes, (size_t)1000);
+		double shmMs = ShmPipeline(name, msgBytes, count);
+		double pipeMs = PipePipeline(msgBytes, count);
+		double mb = (double)msgBytes * count / 1048576.0;
+		if (shmMs == 0 || pipeMs == 0)
+		{
+			printf("%8zu B: 出错了\n", msgBytes);
+			continue;
+		}
+		printf("%8zu B x %8zu: 共享内存池 %8.1f ms (%6.2f 百万条/秒, %7.1f MB/s)  管道拷贝 %8.1f ms (%6.2f 百万条/秒, %7.1f MB/s)\n",
+			msgBytes, count, shmMs, count / shmMs / 1e3, mb / (shmMs / 1e3),
+			pipeMs, count / pipeMs / 1e3, mb / (pipeMs / 1e3));
+	}
+}
+
+// 追加写的缓冲区一直翻倍到maxBytes：每次变大以后把新的一半写满
+// hc_realloc（超过128页用mremap）、hc_malloc+memcpy+hc_free、glibc的realloc
+void BenchmarkRealloc(size_t maxBytes)
+{
+	struct Method
+	{
+		const char* _name;
+		void* (*_grow)(void* ptr, size_t oldSize, size_t newSize);
+		void (*_free)(void* ptr);
+	};
+	const Method methods[] = {
+		{ "hc_realloc", [](void* p, size_t, size_t n) { return hc_realloc(p, n); }, hc_free },
+		{ "申请+拷贝", [](void* p, size_t o, size_t n) {
+			void* q = hc_malloc(n);
+			memcpy(q, p, o);
+			hc_free(p);
+			return q;
+		}, hc_free },
+		{ "glibc realloc", [](void* p, size_t, size_t n) { return realloc(p, n); }, free },
+	};
+
+	// 每种方法在单独的子进程里跑，前面的方法摸过、还回去的内存不影响后面的
+	for (const Method& method : methods)
+	{
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid != 0)
+		{
+			waitpid(pid, nullptr, 0);
+			continue;
+		}
+
+		size_t size = 64 * 1024;
+		char* buf = (char*)hc_malloc(size);
+		if (method._free == free)
+		{
+			hc_free(buf);
+			buf = (char*)malloc(size);
+		}
+		memset(buf, 1, size);
+
+		double growMs = 0;
+		auto begin = std::chrono::steady_clock::now();
+		while (size < maxBytes)
+		{
+			auto growBegin = std::chrono::steady_clock::now();
+			buf = (char*)method._grow(buf, size, size * 2);
+			growMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - growBegin).count();
+			if (buf == nullptr)
+				break;
+			memset(buf + size, 1, size);
+			size *= 2;
+		}
+		double totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		if (buf == nullptr)
+		{
+			printf("%-14s 申请失败\n", method._name);
+			_exit(1);
+		}
+
+		printf("%-14s 翻倍到 %5zu MB: 变大花费 %9.2f ms  总共 %9.2f ms (包括写新的一半)\n",
+			method._name, size >> 20, growMs, totalMs);
+		method._free(buf);
+		fflush(stdout);
+		_exit(0);
+	}
+}
+
+// 伪共享（cache-scratch / cache-thrash）：每个线程申请一些16字节的计数器，然后各自反复写自己的计数器
+// 两个线程的计数器落在同一个缓存行上时，每次写都要把这一行从别的核抢过来
+// 除了写的时间，还直接数有多少个缓存行上有不止一个线程的计数器（和有几个核无关）
+//   主动：各线程同时一个一个地申请，一批批从CentralCache拿，批和批之间挨着
+//   被动：主线程先连续申请好交给各线程，各线程释放以后再申请，拿回来的还是主线程切的那些挨着的块
+void BenchmarkCacheScratch(size_t nworks, size_t nobjs, size_t iters)
+{
+	enum Mode { MODE_DEFAULT, MODE_AFFINE, MODE_ISOLATED };
+	const char* modeNames[] = { "默认", "hc_set_thread_affine", "ConcurrentAllocIsolated" };
+
+	for (int passive = 0; passive < 2; ++passive)
+	{
+		for (int mode = MODE_DEFAULT; mode <= MODE_ISOLATED; ++mode)
+		{
+			// 每种情况在单独的子进程里跑，CentralCache里没有上一种情况留下的块
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid != 0)
+			{
+				waitpid(pid, nullptr, 0);
+				continue;
+			}
+
+			hc_set_thread_affine(mode == MODE_AFFINE);
+			auto alloc = [mode]() {
+				return (size_t*)(mode == MODE_ISOLATED ? ConcurrentAllocIsolated(16) : ConcurrentAlloc(16));
+			};
+
+			std::vector<std::vector<size_t*>> counters(nworks, std::vector<size_t*>(nobjs));
+			if (passive)
+			{
+				for (size_t i = 0; i < nobjs; ++i)
+					for (size_t k = 0; k < nworks; ++k)
+						counters[k][i] = alloc();
+			}
+
+			std::barrier sync(nworks);
+			std::atomic<size_t> writeUs{ 0 };
+			std::vector<std::thread> vthread(nworks);
+			for (size_t k = 0; k < nworks; ++k)
+			{
+				vthread[k] = std::thread([&, k]() {
+					std::vector<size_t*>& mine = counters[k];
+					if (passive)
+					{
+						for (size_t* p : mine)
+							ConcurrentFree(p);
+					}
+					// 一起一个一个地申请，各线程向CentralCache要的批次交错在一起
+					for (size_t i = 0; i < nobjs; ++i)
+					{
+						mine[i] = alloc();
+						*mine[i] = 0;
+						sync.arrive_and_wait();
+					}
+
+					auto begin = std::chrono::steady_clock::now();
+					for (size_t j = 0; j < iters; ++j)
+					{
+						for (size_t* p : mine)
+						{
+							volatile size_t* v = p;
+							*v = *v + 1;
+						}
+					}
+					writeUs += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+				});
+			}
+			for (auto& t : vthread)
+				t.join();
+
+			// 每个缓存行上有哪些线程的计数器
+			std::map<uintptr_t, std::set<size_t>> lines;
+			for (size_t k = 0; k < nworks; ++k)
+				for (size_t* p : counters[k])
+					lines[(uintptr_t)p / CACHE_LINE_SIZE].insert(k);
+			size_t shared = 0;
+			for (auto& line : lines)
+				shared += line.second.size() > 1;
+
+			printf("%s %-24s %zu个缓存行里有 %4zu 个被几个线程共用, 写 %8zu us\n",
+				passive ? "被动" : "主动", modeNames[mode], lines.size(), shared, writeUs.load());
+			for (auto& v : counters)
+				for (size_t* p : v)
+					ConcurrentFree(p);
+			fflush(stdout);
+			_exit(0);
+		}
+	}
+}
+
+// 刚启动的进程开始接流量：每个线程随机申请、释放，活着的对象慢慢涨到nlive个，记下每次申请的耗时
+// 冷启动、以及用一个跑热了的进程取出来的profile预热以后，各在一个新的子进程里跑
+static void WarmupWorkload(size_t nworks, size_t nops, size_t nlive, const HcWarmupProfile* warm,
+	HcWarmupProfile* capture, std::vector<double>* latencies)
+{
+	std::mutex mtx;
+	std::vector<std::thread> vthread(nworks);
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			if (warm)
+				hc_warmup_thread(*warm);
+
+			std::mt19937_64 rng(k);
+			std::vector<void*> live;
+			std::vector<double> mine;
+			mine.reserve(nops);
+			for (size_t i = 0; i < nops; ++i)
+			{
+				if (live.size() < nlive && (live.empty() || rng() % 4 != 0))
+				{
+					size_t size = 16 + rng() % 1009;
+					auto begin = std::chrono::steady_clock::now();
+					void* p = ConcurrentAlloc(size);
+					mine.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count());
+					*(char*)p = 1;
+					live.push_back(p);
+				}
+				else
+				{
+					size_t j = rng() % live.size();
+					ConcurrentFree(live[j]);
+					live[j] = live.back();
+					live.pop_back();
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mtx);
+			if (capture)
+				hc_warmup_capture(capture);
+			if (latencies)
+				latencies->insert(latencies->end(), mine.begin(), mine.end());
+			for (void* p : live)
+				ConcurrentFree(p);
+		});
+	}
+	for (auto& t : vthread)
+		t.join();
+}
+
+void BenchmarkWarmup(size_t nworks, size_t nops, size_t nlive)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/hcmalloc-warmup-%d.txt", (int)getpid());
+
+	// 先在一个子进程里跑一遍，取profile存到文件里
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		HcWarmupProfile profile;
+		WarmupWorkload(nworks, nops, nlive, nullptr, &profile, nullptr);
+		_exit(hc_warmup_save(profile, path) ? 0 : 1);
+	}
+	waitpid(pid, nullptr, 0);
+
+	for (int warm = 0; warm < 2; ++warm)
+	{
+		fflush(stdout);
+		pid = fork();
+		if (pid != 0)
+		{
+			waitpid(pid, nullptr, 0);
+			continue;
+		}
+
+		HcWarmupProfile profile;
+		double warmupMs = 0;
+		if (warm)
+		{
+			if (!hc_warmup_load(&profile, path))
+			{
+				printf("读不到 %s\n", path);
+				_exit(1);
+			}
+			auto begin = std::chrono::steady_clock::now();
+			hc_warmup(profile);
+			warmupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+		}
+
+		std::vector<double> latencies;
+		WarmupWorkload(nworks, nops, nlive, warm ? &profile : nullptr, nullptr, &latencies);
+		std::sort(latencies.begin(), latencies.end());
+		auto pct = [&](double q) { return latencies[(size_t)(q * (latencies.size() - 1))]; };
+		double total = 0;
+		for (double ns : latencies)
+			total += ns;
+		printf("%s %zu次申请: 平均 %6.1f ns  p50 %5.0f ns  p99 %6.0f ns  p99.9 %7.0f ns  最大 %8.0f ns  共 %6.1f ms",
+			warm ? "预热" : "冷启动", latencies.size(), total / latencies.size(), pct(0.5), pct(0.99), pct(0.999),
+			latencies.back(), total / 1e6);
+		if (warm)
+			printf("  (hc_warmup %.1f ms)", warmupMs);
+		printf("\n");
+		fflush(stdout);
+		_exit(0);
+	}
+	unlink(path);
+}
+
+// 扫一遍运行时参数（见Tuning.hpp）：每个取值在单独的子进程里用hc_set_property改好，再跑同样的负载
+// 负载是几个线程各自随机申请、释放，活着的对象在nlive个上下，一部分对象交给下一个线程释放；
+// 记下吞吐、跑完时向系统申请了多少内存、全部释放以后PageCache里还留着多少空闲的页
+static void SweepWorkload(size_t nworks, size_t nops, size_t nlive, double* seconds, size_t* peakMapped)
+{
+	std::vector<std::vector<void*>> handoff(nworks);
+	std::vector<std::mutex> handoffMtx(nworks);
+	std::vector<std::thread> vthread(nworks);
+	std::barrier sync(nworks);
+	std::atomic<size_t> peak{ 0 };
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t k = 0; k < nworks; ++k)
+	{
+		vthread[k] = std::thread([&, k]() {
+			std::mt19937_64 rng(k);
+			std::vector<void*> live;
+			std::vector<void*> incoming;
+			for (size_t i = 0; i < nops; ++i)
+			{
+				if (live.size() < nlive && (live.empty() || rng() % 4 != 0))
+				{
+					// 大多是小对象，偶尔有几十KB的
+					size_t size = rng() % 64 == 0 ? 16384 + rng() % 49152 : 16 + rng() % 1009;
+					void* p = ConcurrentAlloc(size);
+					*(char*)p = 1;
+					live.push_back(p);
+				}
+				else
+				{
+					size_t j = rng() % live.size();
+					if (rng() % 8 == 0)
+					{
+						std::lock_guard<std::mutex> lock(handoffMtx[(k + 1) % nworks]);
+						handoff[(k + 1) % nworks].push_back(live[j]);
+					}
+					else
+					{
+						ConcurrentFree(live[j]);
+					}
+					live[j] = live.back();
+					live.pop_back();
+				}
+
+				if (i % 1024 == 0)
+				{
+					{
+						std::lock_guard<std::mutex> lock(handoffMtx[k]);
+						incoming.swap(handoff[k]);
+					}
+					for (void* p : incoming)
+						ConcurrentFree(p);
+					incoming.clear();
+
+					size_t mapped = 0;
+					hc_get_property("mapped_bytes", &mapped);
+					size_t old = peak.load();
+					while (mapped > old && !peak.compare_exchange_weak(old, mapped));
+				}
+			}
+			for (void* p : live)
+				ConcurrentFree(p);
+			// 大家都不再往别人那里放了以后再收最后一次
+			sync.arrive_and_wait();
+			std::lock_guard<std::mutex> lock(handoffMtx[k]);
+			for (void* p : handoff[k])
+				ConcurrentFree(p);
+			handoff[k].clear();
+		});
+	}
+	for (auto& t : vthread)
+		t.join();
+	*seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	*peakMapped = peak.load();
+}
+
+// name为nullptr时扫下面每个参数的几个典型取值，否则只扫name的values
+void BenchmarkSweep(size_t nworks, size_t nops, size_t nlive, const char* name, const std::vector<size_t>& values)
+{
+	std::vector<std::pair<const char*, std::vector<size_t>>> sweeps;
+	if (name)
+	{
+		sweeps.push_back({ name, values });
+	}
+	else
+	{
+		sweeps.push_back({ "batch_max", { 32, 128, 512, 2048 } });
+		sweeps.push_back({ "slow_start_step", { 1, 3, 16, 64 } });
+		sweeps.push_back({ "thread_cache_max_bytes", { 256 << 10, 1 << 20, 4 << 20, 16 << 20 } });
+		sweeps.push_back({ "scavenge_period", { 256, 4096, 65536 } });
+		sweeps.push_back({ "page_cache_max_free_bytes", { 0, 1 << 20, 16 << 20 } });
+	}
+
+	for (auto& sweep : sweeps)
+	{
+		for (size_t value : sweep.second)
+		{
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid != 0)
+			{
+				waitpid(pid, nullptr, 0);
+				continue;
+			}
+
+			if (hc_set_property(sweep.first, value) != 0)
+			{
+				printf("%-26s = %-10zu 参数名或者取值不对\n", sweep.first, value);
+				fflush(stdout);
+				_exit(1);
+			}
+			double seconds = 0;
+			size_t peakMapped = 0;
+			SweepWorkload(nworks, nops, nlive, &seconds, &peakMapped);
+			// 主线程没有缓存，各线程退出时也都还掉了，剩下的是CentralCache和PageCache里的
+			size_t freeBytes = 0;
+			hc_get_property("page_cache_free_bytes", &freeBytes);
+			printf("%-26s = %-10zu %7.2f Mops/s  申请内存峰值 %6zu KB  释放后PageCache空闲 %6zu KB\n",
+				sweep.first, value, nworks * nops / seconds / 1e6, peakMapped >> 10, freeBytes >> 10);
+			fflush(stdout);
+			_exit(0);
+		}
+	}
+}
+
+// 可以增长的缓冲区：nbufs个缓冲区，每个追加随机长度的小段，直到随机的总长度（最长maxBytes）
+// 只按要的大小记容量（看不到大小类多给的部分）和HcBuffer（容量是hc_nallocx）比，两种增长方式：
+//   按需：每次追加前把容量调到正好够（很多C代码就是这样realloc的）
+//   翻倍：不够时至少翻倍（HcBuffer::Append自己就是这样）
+// 数有几次要变大（调hc_realloc）、其中几次真的搬了家（换了地址）
+struct ExactBuffer
 {
+	char* _data = nullptr;
+	size_t _size = 0;
+	size_t _capacity = 0;
+
+	void Reserve(size_t capacity, size_t* grows, size_t* moves)
+	{
+		if (capacity <= _capacity)
+			return;
+		char* data = (char*)hc_realloc(_data, capacity);
+		++*grows;
+		*moves += data != _data;
+		_data = data;
+		_capacity = capacity;
+	}
+
+	~ExactBuffer()
+	{
+		hc_free(_data);
+	}
+};
+
+void BenchmarkUsableSize(size_t nbufs, size_t maxBytes, size_t rounds)
+{
+	std::mt19937_64 rng(1);
+	std::vector<size_t> targets(nbufs);
+	std::vector<size_t> chunks;
+	for (size_t& t : targets)
+		t = 1 + rng() % maxBytes;
+	for (size_t i = 0; i < 4096; ++i)
+		chunks.push_back(1 + rng() % 48);
+	char src[64] = {};
+
+	for (int doubling = 0; doubling < 2; ++doubling)
+	{
+		for (int useSlack = 0; useSlack < 2; ++useSlack)
+		{
+			size_t grows = 0, moves = 0, appends = 0;
+			auto begin = std::chrono::steady_clock::now();
+			for (size_t r = 0; r < rounds; ++r)
+			{
+				size_t c = 0;
+				for (size_t target : targets)
+				{
+					if (useSlack)
+					{
+						HcBuffer buf;
+						while (buf.Size() < target)
+						{
+							size_t n = chunks[c++ % chunks.size()];
+							size_t capacity = buf.Capacity();
+							char* data = buf.Data();
+							if (!doubling)
+								buf.Reserve(buf.Size() + n);
+							buf.Append(src, n);
+							if (buf.Capacity() != capacity)
+							{
+								++grows;
+								moves += buf.Data() != data;
+							}
+							++appends;
+						}
+					}
+					else
+					{
+						ExactBuffer buf;
+						while (buf._size < target)
+						{
+							size_t n = chunks[c++ % chunks.size()];
+							if (buf._size + n > buf._capacity)
+								buf.Reserve(doubling ? std::max(buf._size + n, 2 * buf._capacity) : buf._size + n, &grows, &moves);
+							memcpy(buf._data + buf._size, src, n);
+							buf._size += n;
+							++appends;
+						}
+					}
+				}
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+			printf("%s %-22s %zu个缓冲区: 变大 %8zu 次 (换地址 %8zu 次)  每次追加 %5.1f ns  共 %7.1f ms\n",
+				doubling ? "翻倍" : "按需", useSlack ? "HcBuffer" : "只按要的大小记容量", nbufs * rounds, grows, moves,
+				ms * 1e6 / appends, ms);
+		}
+	}
+}
+
+// 释放时怎么找到对象所在的span：默认按两层的页号映射查，-DHC_SEGMENTS 时按段头查（见Segment.hpp）
+// 两种布局要分别编译再比（make tcmalloc、make tcmalloc_segments）
+// 先申请nobjs个大小不一的对象散在很多页上，打乱顺序以后：
+//   只查：对每个对象查一次大小类（ConcurrentFree里查的那一下），一次接一次不重叠
+//   释放：按打乱的顺序全部释放，再原样申请回来，来回rounds轮
+void BenchmarkSegmentLookup(size_t nobjs, size_t rounds)
+{
+#ifdef HC_SEGMENTS
+	const char* layout = "段头(HC_SEGMENTS)";
+#else
+	const char* layout = "页号映射";
+#endif
+	std::mt19937_64 rng(7);
+	std::vector<size_t> sizes(nobjs);
+	std::vector<void*> objs(nobjs);
+	for (size_t i = 0; i < nobjs; ++i)
+	{
+		sizes[i] = 16 + rng() % 2033;
+		objs[i] = ConcurrentAlloc(sizes[i]);
+		*(char*)objs[i] = 1;
+	}
+	std::vector<size_t> order(nobjs);
+	for (size_t i = 0; i < nobjs; ++i)
+		order[i] = i;
+	std::shuffle(order.begin(), order.end(), rng);
+
+	// 下一次查的地址依赖上一次的结果（sum >> 62总是0，但是编译器和CPU不知道），量的是一次查找的延迟
+	size_t sum = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t r = 0; r < rounds; ++r)
+		for (size_t i : order)
+			sum += PageCache::GetInstance()->MapObjectToSizeClass(objs[i + (sum >> 62)]);
+	double lookupNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / (nobjs * rounds);
+
+	double freeNs = 0;
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		begin = std::chrono::steady_clock::now();
+		for (size_t i : order)
+			ConcurrentFree(objs[i]);
+		freeNs += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+		for (size_t i = 0; i < nobjs; ++i)
+			objs[i] = ConcurrentAlloc(sizes[i]);
+	}
+	freeNs /= nobjs * rounds;
+
+	printf("%-18s %zu个对象(%zu MB): 只查 %5.2f ns  释放 %6.2f ns  (校验 %zu)\n",
+		layout, nobjs, PageCache::GetInstance()->MappedBytes() >> 20, lookupNs, freeNs, sum % 1000);
+	for (void* p : objs)
+		ConcurrentFree(p);
+}
+
+int main(int argc, char* argv[])
+{
+	// 不带参数时跑原来的malloc对比；带参数时只跑指定的一组
+	std::string which = argc > 1 ? argv[1] : "malloc";
+
 	size_t n = 1000;
 	cout << "==========================================================" << endl;
-	BenchmarkConcurrentMalloc(n, 4, 10);
-	cout << endl << endl;
+	if (which == "malloc")
+	{
+		BenchmarkConcurrentMalloc(n, 4, 10);
+		cout << endl << endl;
 
-	BenchmarkMalloc(n, 4, 10);
+		BenchmarkMalloc(n, 4, 10);
+	}
+	else if (which == "containers")
+	{
+		BenchmarkNodeContainers(10000, 4, 10);
+	}
+	else if (which == "arena")
+	{
+		BenchmarkArena(2000, 4, 200);
+	}
+	else if (which == "fragmentation")
+	{
+		BenchmarkFragmentation(4, argc > 2 ? atoi(argv[2]) : 40);
+	}
+	else if (which == "burst")
+	{
+		BenchmarkBurst(4, 100000, 100000);
+	}
+	else if (which == "bucketlocks")
+	{
+		BenchmarkBucketLocks(8, 8, 200000);
+	}
+	else if (which == "freeheavy")
+	{
+		BenchmarkFreeHeavy(500000, 4, 3);
+	}
+	else if (which == "firstalloc")
+	{
+		BenchmarkFirstAlloc();
+	}
+	else if (which == "fixed")
+	{
+		BenchmarkFixed(64, 200000);
+	}
+	else if (which == "heapdestroy")
+	{
+		BenchmarkHeapDestroy((size_t)(argc > 2 ? atoi(argv[2]) : 1024) << 20);
+	}
+	else if (which == "fileheap")
+	{
+		BenchmarkFileHeap((size_t)(argc > 2 ? atoi(argv[2]) : 512) << 20, argc > 3 ? argv[3] : "/tmp");
+	}
+	else if (which == "shm")
+	{
+		BenchmarkShmPipeline((size_t)(argc > 2 ? atoi(argv[2]) : 1024) << 20);
+	}
+	else if (which == "realloc")
+	{
+		BenchmarkRealloc((size_t)(argc > 2 ? atoi(argv[2]) : 2048) << 20);
+	}
+	else if (which == "scratch")
+	{
+		BenchmarkCacheScratch(argc > 2 ? atoi(argv[2]) : 4, 64, 200000);
+	}
+	else if (which == "warmup")
+	{
+		BenchmarkWarmup(4, 200000, 20000);
+	}
+	else if (which == "sweep")
+	{
+		// ./tcmalloc sweep                           每个参数扫几个典型取值
+		// ./tcmalloc sweep batch_max 64 256 1024     只扫一个参数
+		std::vector<size_t> values;
+		for (int i = 3; i < argc; ++i)
+		{
+			size_t value = 0;
+			if (HcTuning::ParseSize(argv[i], &value))
+				values.push_back(value);
+		}
+		BenchmarkSweep(4, 400000, 20000, argc > 2 ? argv[2] : nullptr, values);
+	}
+	else if (which == "usable")
+	{
+		BenchmarkUsableSize(10000, argc > 2 ? atoi(argv[2]) : 4096, 20);
+	}
+	else if (which == "segment")
+	{
+		BenchmarkSegmentLookup((size_t)(argc > 2 ? atoi(argv[2]) : 200000), 5);
+	}
+	else if (which == "guarded")
+	{
+		BenchmarkGuarded(10000, 4, 20);
+	}
+#ifdef HC_TRACE
+	else if (which == "trace")
+	{
+		BenchmarkTrace(argc > 2 ? argv[2] : "bench.trace", 1000, 4, 10);
+	}
+#endif
+	else
+	{
+		printf("unknown benchmark: %s\n", which.c_str());
+		return 1;
+	}
+	cout << "==========================================================" << endl;
+#ifdef HC_LOCK_STATS
+	// make CXXFLAGS=-DHC_LOCK_STATS 以后，每组跑完打印锁的统计
+	DumpLockStats();
 	cout << "==========================================================" << endl;
+#endif
 
 	return 0;
 }
\ No newline at end of file
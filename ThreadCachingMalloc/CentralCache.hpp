@@ -3,111 +3,289 @@
 #include "Common.hpp"
 #include "PageCache.hpp"
 
-// 每个进程中只能有一个全局的CentralCache
-// 需要使用单例模式
+static const size_t SPAN_OCCUPANCY_BINS = 8;   // 按占用率把span分成8档
+
+// CentralCache的一个桶
+// 桶里的span按占用率(_useCount / Capacity())分档挂在不同的链表上，申请时优先从最满的、还有空闲块的span里拿。
+// 如果总是拿第一个有空闲块的span，存活的对象会稀稀拉拉地分散在很多span上，
+// 这些span的_useCount永远到不了0，也就永远还不回PageCache；
+// 优先填满的span，让接近空的span没人动，等它的块都还回来后整个还给PageCache
+// 每个桶按缓存行对齐，相邻大小类的桶锁不会落在同一个缓存行里互相干扰（伪共享）
+class alignas(CACHE_LINE_SIZE) CentralFreeList
+{
+public:
+    HcBucketMutex _mtx; // 桶锁
+private:
+    SpanList _bins[SPAN_OCCUPANCY_BINS];    // _bins[i]：还有空闲块、占用率在[i/8, (i+1)/8)的span
+    SpanList _full;                         // 没有空闲块的span，申请时不用看
+public:
+    // span里还有没有能分出去的块：还回来的，或者还没切过的
+    static bool HasFree(Span* span)
+    {
+        return span->_freeList != nullptr
+            || span->_bump + span->ObjSize() <= ((size_t)span->_n << PAGE_SHIFT);
+    }
+
+    // span按现在的状态应该挂在哪个链表上
+    SpanList& ListOf(Span* span)
+    {
+        if (!HasFree(span))
+            return _full;
+        return _bins[span->_useCount * SPAN_OCCUPANCY_BINS / span->Capacity()];
+    }
+
+    // 找一个有空闲块的span，从最满的一档往下找
+    Span* FindSpan()
+    {
+        for (size_t i = SPAN_OCCUPANCY_BINS; i-- > 0;)
+        {
+            if (!_bins[i].Empty())
+                return _bins[i].Begin();
+        }
+        return nullptr;
+    }
+
+    // 挂着的span还能分出去多少块、一共能分多少块，调用时持有桶锁
+    size_t FreeObjects()
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < SPAN_OCCUPANCY_BINS; ++i)
+        {
+            for (Span* span = _bins[i].Begin(); span != _bins[i].End(); span = span->_next)
+                n += span->Capacity() - span->_useCount;
+        }
+        return n;
+    }
+
+    size_t TotalObjects()
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < SPAN_OCCUPANCY_BINS; ++i)
+        {
+            for (Span* span = _bins[i].Begin(); span != _bins[i].End(); span = span->_next)
+                n += span->Capacity();
+        }
+        for (Span* span = _full.Begin(); span != _full.End(); span = span->_next)
+            n += span->Capacity();
+        return n;
+    }
+
+    void Insert(Span* span)
+    {
+        ListOf(span).PushFront(span);
+    }
+
+    // span的状态变了以后调用，from是变化之前它所在的链表
+    void Update(Span* span, SpanList& from)
+    {
+        SpanList& to = ListOf(span);
+        if (&to != &from)
+        {
+            from.Erase(span);
+            to.PushFront(span);
+        }
+    }
+};
+
+// 默认的堆用的CentralCache是单例，hc_heap_create创建的每个堆也各有一个，向自己的PageCache要span
 
 class CentralCache
 {
 private:
-    SpanList _spanLists[NFREELIST];
+    CentralFreeList _spanLists[NFREELIST];
+    std::atomic<size_t> _spanBytes{ 0 };   // 挂在CentralCache上的span一共多少字节，用来观察碎片
+    std::atomic<bool> _threadAffine{ false };
+    PageCache* _pageCache;
 private:
-    static CentralCache _sInt;      // 静态成员创建，在程序启动时创建
-
-    // 私有化构造函数和拷贝构造
-    CentralCache()
+    static CentralCache _sInt;      // 常量初始化，不需要在程序启动时构造，定义在HcMalloc.cc
+public:
+    constexpr explicit CentralCache(PageCache* pageCache)
+        : _pageCache(pageCache)
     {}
     CentralCache(const CentralCache&) = delete;
-public:
+
     static CentralCache* GetInstance()
     {
         return &_sInt;
     }
 
-    // 获取一个可用的Span; list是传入的链表，size是内存块的大小
-    Span* GetOneSpan(SpanList& list, size_t size)
+    PageCache* GetPageCache() const
+    {
+        return _pageCache;
+    }
+
+    size_t SpanBytes() const
+    {
+        return _spanBytes.load(std::memory_order_relaxed);
+    }
+
+    // 打开后每一批从没切过的部分切出来的块都从新的缓存行开始，这一批（也就是一个线程）独占这几行：
+    // 默认紧挨着切，上一批的最后一块和下一批的第一块可能在同一行上，两个线程各写各的也会互相让缓存行失效（伪共享）
+    // 每批最多浪费一个缓存行加一块。还回来再分出去的块还是可能和别的线程的块挨着，
+    // 一定不能和别人共用缓存行的对象用ConcurrentAllocIsolated
+    void SetThreadAffine(bool on)
+    {
+        _threadAffine.store(on, std::memory_order_relaxed);
+    }
+
+    bool ThreadAffine() const
+    {
+        return _threadAffine.load(std::memory_order_relaxed);
+    }
+
+#ifdef HC_LOCK_STATS
+    // 第index个桶的锁的统计
+    LockStats& BucketLockStats(size_t index)
+    {
+        return _spanLists[index]._mtx.Stats();
+    }
+#endif
+
+    // 向PageCache要一个新的span给size这个大小类，到了堆的硬上限时返回nullptr；调用时不持有桶锁
+    Span* NewSpanFromPageCache(size_t size)
     {
-        // 找现有的链表中是否有可用的Span
-        Span* it = list.Begin();
-        while (it != list.End())
+        // 向PageCache申请,需要加锁
+        // 向PageCache申请时也需要确定申请的Span是包含几页的。
+        HC_LOCK(_pageCache->_pageMtx, LOCK_SITE_NEW_SPAN);
+        Span* span = _pageCache->NewSpan(HcTuning::GetInstance()->NumMovePage(size));
+        if (span == nullptr)
         {
-            if (it->_freeList != nullptr)
-                return it;
-            else
-                it = it->_next;
+            _pageCache->_pageMtx.unlock();
+            return nullptr;
         }
+        span->_isUse = true;
+        _pageCache->SetSizeClass(span, SizeClass::Index(size));
+        _pageCache->_pageMtx.unlock();
+        HC_PROBE3(cc_refill, SizeClass::Index(size), size, span->_n);
+
+        // 新的span不提前切成小块串起来：8字节的块一个1MB的span要写128K次，还会把每一页都摸一遍
+        // 只记下还没切过的部分从哪里开始（页号是对应虚拟地址空间对应的位置计算出来的），FetchRangeObj按批切
+        span->_freeList = nullptr;
+        span->_bump = 0;
+        _spanBytes += (size_t)span->_n << PAGE_SHIFT;
+        return span;
+    }
+
+    // 获取一个可用的Span; list是传入的桶，size是内存块的大小
+    Span* GetOneSpan(CentralFreeList& list, size_t size)
+    {
+        // 找现有的span中是否有可用的，优先占用率高的
+        Span* it = list.FindSpan();
+        if (it != nullptr)
+            return it;
 
         // 因为接下来会进入到PageCache，所以在这里解锁。
         // 因此会有其他的申请内存的线程进入到这里来，它们接下来会被PageCache的锁阻塞。
         // 但是如果有其他进入该桶释放内存的线程则不会被阻塞了
         list._mtx.unlock();
 
-        // 走到这里说明没有现成的，因此需要向PageCache里申请,需要加锁
-        // 向PageCache申请时也需要确定申请的Span是包含几页的。
-        PageCache::GetInstance()->_pageMtx.lock();
-        Span* span = PageCache::GetInstance()->NewSpan(SizeClass::NumMovePage(size));
-        span->_isUse = true;
-        span->_objSize = size;
-        PageCache::GetInstance()->_pageMtx.unlock();
-
-        // 得到新的Span后需要将大的内存块切成小块并挂到自由链表上
-        // 1. 先计算这几页大块内存的起始地址
-        // 2. 再计算总共大小
-        // 3. 得到末尾位置
-        char* start = (char*)(span->_pageId << PAGE_SHIFT); // 页号是对应虚拟地址空间对应的位置计算出来的
-        size_t bytes = span->_n << PAGE_SHIFT;
-        char* end = start + bytes;
-
-        // 开始切
-        // 先切一块做头，方便尾插
-        span->_freeList = start;
-        start += size;
-        void* tail = span->_freeList;
-
-        while (start < end)
-        {
-            NextObj(tail) = start;
-            tail = NextObj(tail);
-            start += size;
-        }
-        NextObj(tail) = nullptr;
+        Span* span = NewSpanFromPageCache(size);
 
-        // 因为每次只有一个线程向PaegCache申请span，并且得到span之后还没有挂到Spanlist上，其他线程访问不到，因此切分时不需要加锁
-        // 但是多个线程将span挂到对应的Spanlist上时需要上锁
-        list._mtx.lock();
+        // 得到span之后还没有挂到Spanlist上，其他线程访问不到，但是挂到Spanlist上时需要上锁
+        // 到了堆的硬上限时也把桶锁加回来再返回，和正常返回时一致
+        HC_LOCK(list._mtx, LOCK_SITE_GET_ONE_SPAN);
+        if (span == nullptr)
+            return nullptr;
 
         // 将span插入list中
-        list.PushFront(span);
+        list.Insert(span);
 
         return span;
     }
 
+    // 预热：让size这个大小类的桶里挂着的span一共至少还能分出nobjs块，不够的向PageCache要新的span挂上
+    // 新span的页提前摸一遍（SystemPopulate），以后第一次分出去时不会再缺页；到了堆的硬上限时提前停下
+    void Reserve(size_t size, size_t nobjs)
+    {
+        size_t index = SizeClass::Index(size);
+        CentralFreeList& list = _spanLists[index];
+        HC_LOCK(list._mtx, LOCK_SITE_OTHER);
+        size_t avail = list.FreeObjects();
+        while (avail < nobjs)
+        {
+            list._mtx.unlock();
+            Span* span = NewSpanFromPageCache(size);
+            if (span)
+                SystemPopulate((void*)(span->_pageId << PAGE_SHIFT), span->_n);
+            HC_LOCK(list._mtx, LOCK_SITE_OTHER);
+            if (span == nullptr)
+                break;
+            list.Insert(span);
+            avail += span->Capacity();
+        }
+        list._mtx.unlock();
+    }
+
+    // size这个大小类的桶里挂着的span一共能分多少块（包括已经分出去的），hc_warmup_capture用
+    size_t Capacity(size_t size)
+    {
+        CentralFreeList& list = _spanLists[SizeClass::Index(size)];
+        std::lock_guard<HcBucketMutex> lock(list._mtx);
+        return list.TotalObjects();
+    }
+
     // 从中心缓存获取一定数量的对象给thread cache
     // start和end是多个内存块的头尾指针，batchNum是理想的需要的数量，返回值是实际返回的内存块的数量，size是内存块大小
+    // 到了堆的硬上限时返回0
     // CentralCache属于临界区，需要上锁
     size_t FetchRangeObj(void*& start, void*& end, size_t batchNum, size_t size)
     {
         size_t index = SizeClass::Index(size);
-        _spanLists[index]._mtx.lock();
+        HC_LOCK(_spanLists[index]._mtx, LOCK_SITE_FETCH_RANGE);
 
         Span* span = GetOneSpan(_spanLists[index], size);
-        assert(span);
-        assert(span->_freeList);
-
-        // 从span中切出小块内存
-        start = span->_freeList;
-        end = start;
-        size_t i = 0;
-        size_t actualNum = 1;
-        while (i < batchNum - 1 && NextObj(end) != nullptr)
+        if (span == nullptr)
         {
-            ++i;
+            _spanLists[index]._mtx.unlock();
+            return 0;
+        }
+        assert(CentralFreeList::HasFree(span));
+        SpanList& from = _spanLists[index].ListOf(span);
+
+        // 先拿还回来的块（可能还在缓存里，页也已经摸过了），不够的再从没切过的部分切，
+        // 这样没用到的页一直不会被访问，也就不占物理内存
+        size_t actualNum = 0;
+        start = nullptr;
+        end = nullptr;
+        while (actualNum < batchNum && span->_freeList != nullptr)
+        {
+            void* obj = span->_freeList;
+            span->_freeList = NextObj(obj);
+            if (end)
+                NextObj(end) = obj;
+            else
+                start = obj;
+            end = obj;
+            ++actualNum;
+        }
+
+        char* base = (char*)(span->_pageId << PAGE_SHIFT);
+        size_t spanBytes = (size_t)span->_n << PAGE_SHIFT;
+        if (actualNum < batchNum && ThreadAffine())
+        {
+            // 跳到下一个缓存行以后的第一个块：块的地址还是块大小的整数倍，对齐不变
+            size_t lineStart = SizeClass::_RoundUp(span->_bump, CACHE_LINE_SIZE);
+            size_t bump = (lineStart + size - 1) / size * size;
+            if (bump + size <= spanBytes)
+                span->_bump = (uint32_t)bump;
+        }
+        while (actualNum < batchNum && span->_bump + size <= spanBytes)
+        {
+            void* obj = base + span->_bump;
+            span->_bump += (uint32_t)size;
+            if (end)
+                NextObj(end) = obj;
+            else
+                start = obj;
+            end = obj;
             ++actualNum;
-            end = NextObj(end);
         }
-        span->_freeList = NextObj(end);
         NextObj(end) = nullptr;
         span->_useCount += actualNum;
 
+        // 占用率变了，可能要换一档
+        _spanLists[index].Update(span, from);
+
         _spanLists[index]._mtx.unlock();
 
         return actualNum;
@@ -115,50 +293,130 @@ public:
 
     // 将ThreadCache中的内存块拿回CentralCache
     // 第一个参数是自由链表，末尾指向nullptr， 第二个参数是内存块大小
+    // 一批块往往集中在少数几个span上：先在锁外查好每个块属于哪个span、按span分组串好，
+    // 加桶锁后每个span只接一次链表、改一次_useCount、换一次档；
+    // 空了的span等桶锁放掉以后一起还给PageCache，只加一次_pageMtx
     void ReleaseListToSpans(void* start, size_t size)
     {
         // 先计算是哪个桶下面的
         size_t index = SizeClass::Index(size);
 
-        // 桶锁上锁
-        _spanLists[index]._mtx.lock();
-
+        SpanGroup groups[RELEASE_GROUPS];
+        uint8_t slots[RELEASE_SLOTS] = {};     // 按span地址散列到组，存组的下标+1，0表示空
+        size_t ngroups = 0;
+        size_t last = 0;
         while (start)
         {
-            // 需要计算该内存块属于哪一个span,然后将start插入span中
             void* next = NextObj(start);
+            // 遍历链表要等上一块从内存读进来，提前把下一块要读的位置取进缓存
+            __builtin_prefetch(next);
+
+            // 需要计算该内存块属于哪一个span；ThreadCache里的块所在的span不会被释放，不用加锁
+            Span* span = _pageCache->MapObjectToSpan(start);
+            if (ngroups == 0 || groups[last]._span != span)
+            {
+                size_t slot = ReleaseSlot(span);
+                while (slots[slot] != 0 && groups[slots[slot] - 1]._span != span)
+                    slot = (slot + 1) & (RELEASE_SLOTS - 1);
 
-            Span* span = PageCache::GetInstance()->MapObjectToSpan(start);
-            NextObj(start) = span->_freeList;
-            span->_freeList = start;
-            span->_useCount--;
+                if (slots[slot] != 0)
+                {
+                    last = slots[slot] - 1;
+                }
+                else
+                {
+                    // 一批里的span太分散，先把已经分好的还掉
+                    if (ngroups == RELEASE_GROUPS)
+                    {
+                        ReleaseGroups(index, groups, ngroups);
+                        ngroups = 0;
+                        memset(slots, 0, sizeof(slots));
+                        slot = ReleaseSlot(span);
+                    }
+                    last = ngroups++;
+                    groups[last] = SpanGroup{ span, nullptr, start, 0 };
+                    slots[slot] = (uint8_t)(last + 1);
+                }
+            }
+
+            SpanGroup& group = groups[last];
+            NextObj(start) = group._head;
+            group._head = start;
+            ++group._n;
+            start = next;
+        }
+        ReleaseGroups(index, groups, ngroups);
+    }
+
+private:
+    static const size_t RELEASE_GROUPS = 64;           // 一次最多分多少组
+    static const size_t RELEASE_SLOT_BITS = 7;         // 散列表是组数的两倍，查找很少冲突
+    static const size_t RELEASE_SLOTS = (size_t)1 << RELEASE_SLOT_BITS;
+
+    // 同一个span上的块：_head到_tail已经串好
+    struct SpanGroup
+    {
+        Span* _span;
+        void* _head;
+        void* _tail;
+        uint32_t _n;
+    };
+
+    static size_t ReleaseSlot(Span* span)
+    {
+        return ((uintptr_t)span >> 4) * 0x9E3779B97F4A7C15ULL >> (64 - RELEASE_SLOT_BITS);
+    }
+
+    void ReleaseGroups(size_t index, SpanGroup* groups, size_t ngroups)
+    {
+        if (ngroups == 0)
+            return;
+
+        // 空了的span先放在这里，最后一起还给PageCache
+        Span* empty[RELEASE_GROUPS];
+        size_t nempty = 0;
+        size_t emptyBytes = 0;
+
+        HC_LOCK(_spanLists[index]._mtx, LOCK_SITE_RELEASE_LIST);
+        for (size_t i = 0; i < ngroups; ++i)
+        {
+            SpanGroup& group = groups[i];
+            Span* span = group._span;
+            SpanList& from = _spanLists[index].ListOf(span);
+            NextObj(group._tail) = span->_freeList;
+            span->_freeList = group._head;
+            span->_useCount -= group._n;
 
             // 如果span的_useCount为0，说明分配给ThreadCache的内存块已经全部还完了
             // 接下来可以尝试将span还给PageCache中并合并span了
             if (span->_useCount == 0)
             {
                 // 将span从CentralCache 取下
-                _spanLists[index].Erase(span);
+                from.Erase(span);
                 span->_next = nullptr;
                 span->_prev = nullptr;
                 span->_freeList = nullptr;
-
-                // 由于接下来又要进PageCache，所以解锁
-                _spanLists[index]._mtx.unlock();
-
-                // 还给PageCache, 进入PageCache，上锁
-                PageCache::GetInstance()->_pageMtx.lock();
-                PageCache::GetInstance()->ReleaseSpanToPageCache(span);
-                PageCache::GetInstance()->_pageMtx.unlock();
-
-                _spanLists[index]._mtx.lock();
+                span->_bump = 0;
+                emptyBytes += (size_t)span->_n << PAGE_SHIFT;
+                empty[nempty++] = span;
+            }
+            else
+            {
+                _spanLists[index].Update(span, from);
             }
-            start = next;
         }
-
         _spanLists[index]._mtx.unlock();
+
+        if (nempty == 0)
+            return;
+        _spanBytes -= emptyBytes;
+
+        // 还给PageCache, 进入PageCache，上锁
+        HC_LOCK(_pageCache->_pageMtx, LOCK_SITE_RELEASE_SPAN);
+        for (size_t i = 0; i < nempty; ++i)
+        {
+            _pageCache->ReleaseSpanToPageCache(empty[i]);
+        }
+        _pageCache->_pageMtx.unlock();
     }
 };
-
-// 在类外初始化静态成员
-CentralCache CentralCache::_sInt;
\ No newline at end of file
@@ -1,9 +1,10 @@
 #pragma once
 
-#include <iostream>
+#include <new>
 #include <assert.h>
 #include <algorithm>
 #include <cstring>
+#include <cstdint>
 
 #include <unordered_map>
 #include <vector>
@@ -12,8 +13,13 @@
 #include <mutex>
 #include <atomic>
 
-using std::cout;
-using std::endl;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "LockStats.hpp"
+#include "Probes.hpp"
+
 using std::min;
 
 #ifdef _WIN64
@@ -34,18 +40,42 @@ typedef unsigned long long PAGE_ID;
 
 
 static const size_t MAX_BYTES = 256 * 1024;
+#ifdef HC_SIZE_CLASS_TABLE
+// 使用 sizeclassgen 根据实际的申请大小分布生成的大小类表，例如
+// make CXXFLAGS='-DHC_SIZE_CLASS_TABLE=\"SizeClassTable.hpp\"'
+// 表里定义 constexpr size_t kSizeClassTable[]，升序，最后一个是MAX_BYTES
+#include HC_SIZE_CLASS_TABLE
+static const size_t NFREELIST = sizeof(kSizeClassTable) / sizeof(kSizeClassTable[0]);
+#else
 static const size_t NFREELIST = 208;
+#endif
 static const size_t NPAGES = 129;
+static const size_t CACHE_LINE_SIZE = 64;
 static const size_t PAGE_SHIFT = 13; // 8 * 1024 Byte = 8 KB = 2^13 Byte
 
 // 直接去堆上按页申请空间
+// 返回的地址必须按页(8KB)对齐，因为span是用 地址 >> PAGE_SHIFT 得到的页号来描述内存的，
+// 不对齐的话span会覆盖到申请到的内存之前的那部分
 inline static void* SystemAlloc(size_t kpage)
 {
 #if defined(_WIN32) || defined(_WIN64)
+    // VirtualAlloc 按64KB对齐
     void* ptr = VirtualAlloc(0, kpage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #elif defined(__i686__) || defined(__LP64__)
-    //void* ptr = mmap(NULL, kpage << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    void* ptr = malloc(kpage << PAGE_SHIFT);
+    // mmap只保证按系统页(4KB)对齐，多映射一页，再把首尾多出来的部分还回去
+    size_t bytes = kpage << PAGE_SHIFT;
+    size_t align = (size_t)1 << PAGE_SHIFT;
+    char* base = (char*)mmap(NULL, bytes + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* ptr = nullptr;
+    if (base != MAP_FAILED)
+    {
+        char* aligned = (char*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+        if (aligned != base)
+            munmap(base, aligned - base);
+        if (aligned + bytes != base + bytes + align)
+            munmap(aligned + bytes, base + align - aligned);
+        ptr = aligned;
+    }
 #endif
     if (ptr == nullptr)
         throw std::bad_alloc();
@@ -53,15 +83,74 @@ inline static void* SystemAlloc(size_t kpage)
     return ptr;
 }
 
-// 释放内存
-inline static void SystemFree(void* ptr)
+// 超过这么大的拷贝不经过缓存（hc_realloc搬大块时用）：拷完以后旧的马上释放，新的一般也不会马上全部读一遍，
+// 经过缓存只会把别的有用的数据挤出去
+static const size_t NT_COPY_MIN_BYTES = MAX_BYTES;
+
+// dst按16字节对齐时用不经过缓存的写（movntdq），否则就是memcpy
+inline static void NonTemporalCopy(void* dst, const void* src, size_t n)
+{
+#ifdef __SSE2__
+    if (n >= NT_COPY_MIN_BYTES && ((uintptr_t)dst & 15) == 0)
+    {
+        __m128i* d = (__m128i*)dst;
+        const __m128i* s = (const __m128i*)src;
+        size_t blocks = n / 64;
+        for (size_t i = 0; i < blocks; ++i, d += 4, s += 4)
+        {
+            __m128i a = _mm_loadu_si128(s);
+            __m128i b = _mm_loadu_si128(s + 1);
+            __m128i c = _mm_loadu_si128(s + 2);
+            __m128i e = _mm_loadu_si128(s + 3);
+            _mm_stream_si128(d, a);
+            _mm_stream_si128(d + 1, b);
+            _mm_stream_si128(d + 2, c);
+            _mm_stream_si128(d + 3, e);
+        }
+        // 不经过缓存的写是乱序的，后面释放旧内存、把新指针交给别的线程之前要排好序
+        _mm_sfence();
+        memcpy(d, s, n % 64);
+        return;
+    }
+#endif
+    memcpy(dst, src, n);
+}
+
+// 释放内存，kpage是申请时的页数
+inline static void SystemFree(void* ptr, size_t kpage)
 {
 #if defined(_WIN32) || defined(_WIN64)
     VirtualFree(ptr, 0, MEM_RELEASE);
 #elif defined(__i686__) || defined(__LP64__)
-    // sbrk unmmap等
-    free(ptr);
+    munmap(ptr, kpage << PAGE_SHIFT);
+#endif
+}
+
+// 把一次SystemAlloc得到的内存中的一部分还给系统（PageCache里空闲的span不一定是整块申请来的）
+// Windows上不能只释放一部分，只能解除提交，地址空间还占着
+inline static void SystemRelease(void* ptr, size_t kpage)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    VirtualFree(ptr, kpage << PAGE_SHIFT, MEM_DECOMMIT);
+#elif defined(__i686__) || defined(__LP64__)
+    munmap(ptr, kpage << PAGE_SHIFT);
+#endif
+}
+
+// 让这段内存的物理页现在就分配好，以后第一次写时不再缺页（预热用），内容不变
+inline static void SystemPopulate(void* ptr, size_t kpage)
+{
+    size_t bytes = kpage << PAGE_SHIFT;
+#if defined(MADV_POPULATE_WRITE)
+    if (madvise(ptr, bytes, MADV_POPULATE_WRITE) == 0)
+        return;
 #endif
+    // 老内核上一页一页地读了再写回去
+    for (size_t i = 0; i < bytes; i += 4096)
+    {
+        volatile char* p = (volatile char*)ptr + i;
+        *p = *p;
+    }
 }
 
 
@@ -76,6 +165,8 @@ private:
     void* _freeList = nullptr;
     size_t _maxSize = 1;           // 用于慢启动调节
     size_t _size = 0;              // 自由链表挂的内存块的数量
+    size_t _lowWater = 0;          // 上次回收以来链表长度的最小值，一直没降下来的部分就是闲置的
+    size_t _overages = 0;          // 链表超长的次数，超过一定次数就把_maxSize调小
 public:
     void Push(void* obj)
     {
@@ -107,6 +198,8 @@ public:
         _freeList = NextObj(end);
         NextObj(end) = nullptr;
         _size -= n;
+        if (_size < _lowWater)
+            _lowWater = _size;
     }
 
     void* Pop()
@@ -116,6 +209,8 @@ public:
         void* obj = _freeList;
         _freeList = NextObj(obj);
         --_size;
+        if (_size < _lowWater)
+            _lowWater = _size;
         return obj;
     }
 
@@ -133,9 +228,69 @@ public:
     {
         return _maxSize;
     }
+
+    size_t& Overages()
+    {
+        return _overages;
+    }
+
+    size_t LowWater()
+    {
+        return _lowWater;
+    }
+
+    void ClearLowWater()
+    {
+        _lowWater = _size;
+    }
+};
+
+#ifdef HC_SIZE_CLASS_TABLE
+// 按大小查大小类下标的查找表，和tcmalloc的做法一样分两段：
+// [0,1024] 按8字节一格，(1024, MAX_BYTES] 按128字节一格
+// 所以生成的表里 <=1024 的大小类必须是8的倍数，>1024 的必须是128的倍数
+static const size_t SIZE_CLASS_LOOKUP_LENGTH = ((MAX_BYTES + 127 + (120 << 7)) >> 7) + 1;
+
+struct SizeClassLookup
+{
+    unsigned short _index[SIZE_CLASS_LOOKUP_LENGTH];
 };
 
+constexpr SizeClassLookup MakeSizeClassLookup()
+{
+    SizeClassLookup lookup{};
+    size_t cls = 0;
+    for (size_t i = 0; i < SIZE_CLASS_LOOKUP_LENGTH; ++i)
+    {
+        // 这一格里最大的大小
+        size_t maxSize = i <= 128 ? i << 3 : (i - 120) << 7;
+        while (kSizeClassTable[cls] < maxSize)
+            ++cls;
+        lookup._index[i] = (unsigned short)cls;
+    }
+    return lookup;
+}
+
+constexpr bool CheckSizeClassTable()
+{
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        size_t align = kSizeClassTable[i] <= 1024 ? 8 : 128;
+        if (kSizeClassTable[i] % align != 0)
+            return false;
+        if (i > 0 && kSizeClassTable[i] <= kSizeClassTable[i - 1])
+            return false;
+    }
+    return kSizeClassTable[NFREELIST - 1] == MAX_BYTES;
+}
+
+static_assert(CheckSizeClassTable(), "kSizeClassTable must be ascending, aligned to 8/128 bytes and end at MAX_BYTES");
+
+static constexpr SizeClassLookup kSizeClassLookup = MakeSizeClassLookup();
+#endif
+
 // 计算对齐和计算映射
+// 都是constexpr，大小在编译期已知时（ConcurrentAlloc<N>）下标和对齐后的大小在编译期就算好了
 class SizeClass
 {
 public:
@@ -163,13 +318,20 @@ public:
     //     return alignSize;
     // }
 
-    static inline size_t _RoundUp(size_t bytes, size_t alignNum)
+    static constexpr size_t _RoundUp(size_t bytes, size_t alignNum)
     {
         return ((bytes + alignNum - 1) & ~(alignNum - 1));
     }
 
-    static inline size_t RoundUp(size_t size)
+    static constexpr size_t RoundUp(size_t size)
     {
+#ifdef HC_SIZE_CLASS_TABLE
+        if (size <= MAX_BYTES)
+        {
+            return kSizeClassTable[Index(size)];
+        }
+        return _RoundUp(size, 1 << PAGE_SHIFT);
+#endif
         if (size <= 128)
         {
             return _RoundUp(size, 8);
@@ -208,16 +370,23 @@ public:
     //     }
     // }
 
-    static inline size_t _Index(size_t bytes, size_t align_shift)
+    static constexpr size_t _Index(size_t bytes, size_t align_shift)
     {
         return ((bytes + ((size_t)1 << align_shift) - 1) >> align_shift) - 1;
     }
 
-    static inline size_t Index(size_t bytes)
+    static constexpr size_t Index(size_t bytes)
     {
         assert(bytes <= MAX_BYTES);
 
-        static int group_array[4] = { 16, 56, 56, 56 }; // 每个区间内桶的个数
+#ifdef HC_SIZE_CLASS_TABLE
+        if (bytes <= 1024)
+        {
+            return kSizeClassLookup._index[(bytes + 7) >> 3];
+        }
+        return kSizeClassLookup._index[(bytes + 127 + (120 << 7)) >> 7];
+#endif
+        const size_t group_array[4] = { 16, 56, 56, 56 }; // 每个区间内桶的个数
         if (bytes <= 128)
         {
             return _Index(bytes, 3);
@@ -245,18 +414,64 @@ public:
         return -1;
     }
 
+    // 下标为index的桶里内存块的大小，和Index互为反函数
+    static constexpr size_t ClassSize(size_t index)
+    {
+        assert(index < NFREELIST);
+#ifdef HC_SIZE_CLASS_TABLE
+        return kSizeClassTable[index];
+#endif
+        if (index < 16)
+        {
+            return (index + 1) << 3;
+        }
+        else if (index < 72)
+        {
+            return 128 + ((index - 15) << 4);
+        }
+        else if (index < 128)
+        {
+            return 1024 + ((index - 71) << 7);
+        }
+        else if (index < 184)
+        {
+            return 8 * 1024 + ((index - 127) << 10);
+        }
+        else
+        {
+            return 64 * 1024 + ((index - 183) << 13);
+        }
+    }
+
+    // 按对齐要求调整申请的大小，返回值>=size，并且它所在的大小类是align的整数倍
+    // span的起始地址是页对齐的，块的地址是块大小的整数倍，所以这样切出来的每一块都是对齐的
+    // 默认的大小类第一次就满足；生成的大小类表不一定，需要往后找
+    static constexpr size_t AlignedSize(size_t size, size_t align)
+    {
+        if (align <= 8)
+            return size;
+
+        size = _RoundUp(size, align);
+        while (size <= MAX_BYTES && RoundUp(size) % align != 0)
+        {
+            size = _RoundUp(RoundUp(size) + 1, align);
+        }
+        return size;
+    }
+
     // 用于慢启动反馈调节
     // size很大则少分配一些，size很小则多分配一些
-    static size_t NumMoveSize(size_t size)
+    // 上下限运行时可以调（见Tuning.hpp），minNum比maxNum大时以maxNum为准
+    static constexpr size_t NumMoveSize(size_t size, size_t minNum = 2, size_t maxNum = 512)
     {
         assert(size > 0);
 
         size_t num = MAX_BYTES / size;
-        if (num <= 2)
-            num = 2;
+        if (num <= minNum)
+            num = minNum;
 
-        if (num > 512)
-            num = 512;
+        if (num > maxNum)
+            num = maxNum;
 
         return num;
     }
@@ -266,66 +481,94 @@ public:
     // ...
     // 单个对象 256KB
     // size 是内存块大小，返回值是页数
-    static size_t NumMovePage(size_t size)
+    static constexpr size_t NumMovePage(size_t size, size_t minNum = 2, size_t maxNum = 512)
     {
         // 计算一批内存块的数量*size得到总共的大小
-        size_t num = NumMoveSize(size);
+        size_t num = NumMoveSize(size, minNum, maxNum);
         size_t npage = num * size;
         // 除以 8KB
         npage >>= PAGE_SHIFT;
         if (npage == 0)
             npage = 1;
+        // 批次调大以后也不能超过PageCache能管的128页
+        if (npage > NPAGES - 1)
+            npage = NPAGES - 1;
 
         return npage;
     }
 
 };
 
+// span的描述，48字节：页数、计数都用32位，小对象的大小记成大小类下标
+// 释放时先查PageMap里的大小类，小对象不需要读这里；描述符从ObjectPool里申请，不按地址排，要读的时候是另外一次不命中
 struct Span
 {
     // 需要注意的是，页号是直接根据系统给的实际的地址(虚拟地址)直接计算出来的，而不是从0开始的
     PAGE_ID _pageId = 0;     // 大块内存的起始页号
-    size_t _n = 0;           // 页的数量
 
     Span* _next = nullptr;  // 双向链表的前后指针
     Span* _prev = nullptr;
 
-    size_t _objSize = 0;    // 切好的小块内存的大小
-    size_t _useCount = 0;   // 切好的小块内存，被分配给threadcache的数量
+    void* _freeList = nullptr; // 自由链表，管理还回来的小块内存
 
-    void* _freeList = nullptr; // 自由链表，管理切好的小块内存
+    uint32_t _n = 0;           // 页的数量
+    uint32_t _useCount = 0;    // 切好的小块内存，被分配给threadcache的数量
+    uint32_t _bump = 0;        // 距离span起始地址_bump字节以后是还没分出去过的部分，按需切，不提前串成链表
+    uint16_t _sizeClass = 0;   // 小对象span是大小类下标+1；0表示整个span是一个对象（大块内存、arena、保护区）
+    bool _isUse = false;       // 判断该Span是否被使用
+    bool _isGuarded = false;   // 采样保护区
 
-    bool _isUse = false;    // 判断该Span是否被使用
+    // 切好的小块内存的大小
+    size_t ObjSize() const
+    {
+        return _sizeClass ? SizeClass::ClassSize(_sizeClass - 1) : (size_t)_n << PAGE_SHIFT;
+    }
+
+    // 一共能切多少块，用来算占用率
+    size_t Capacity() const
+    {
+        return ((size_t)_n << PAGE_SHIFT) / ObjSize();
+    }
 };
 
+static_assert(sizeof(Span) <= 48, "Span should stay compact");
+
 // 带头的双向链表，也就是一个“桶”
+// 头节点直接放在链表里而不是new出来：SpanList全是0，可以常量初始化，PageCache、CentralCache启动时什么都不用做
+// 头节点在第一次用到时才连成环，用到链表的地方都持有对应的锁
 class SpanList
 {
 private:
-    Span* _head;        // 头节点
-public:
-    std::mutex _mtx;    // 桶锁
-public:
-    SpanList()
+    Span _head;         // 头节点
+
+    Span* Head()
     {
-        _head = new Span;
-        _head->_next = _head;
-        _head->_prev = _head;
+        if (_head._next == nullptr)
+        {
+            _head._next = &_head;
+            _head._prev = &_head;
+        }
+        return &_head;
     }
+public:
+    constexpr SpanList() = default;
+    // 链表里的节点指向头节点，不能拷贝
+    SpanList(const SpanList&) = delete;
+    SpanList& operator=(const SpanList&) = delete;
 
     bool Empty()
     {
-        return _head->_next == _head;
+        return Head()->_next == &_head;
     }
 
     Span* Begin()
     {
-        return _head->_next;
+        return Head()->_next;
     }
 
     Span* End()
     {
-        return _head;
+        return Head();
     }
 
     void PushFront(Span* newspan)
@@ -355,7 +598,7 @@ public:
     void Erase(Span* pos)
     {
         assert(pos);
-        assert(pos != _head);
+        assert(pos != &_head);
 
         Span* prev = pos->_prev;
         Span* next = pos->_next;
@@ -3,13 +3,128 @@
 #include "Common.hpp"
 #include "ThreadCache.hpp"
 #include "ObjectPool.hpp"
+#ifdef HC_TRACE
+#include "AllocTrace.hpp"
+#endif
+
+// 采样保护默认在Linux这类POSIX系统上编进去（用到mprotect/sigaction），运行时默认关闭
+// 用 GuardedPool::GetInstance()->SetSampleRate(N) 打开，-DHC_NO_GUARDED_SAMPLING 可以整个去掉
+#if !defined(_WIN32) && !defined(_WIN64) && !defined(HC_NO_GUARDED_SAMPLING)
+#define HC_GUARDED_SAMPLING
+#include "GuardedPool.hpp"
+#endif
+
+// 分配器的全局状态（PageCache、CentralCache、下面这几个变量等）都定义在HcMalloc.cc里，
+// 并且都是常量初始化的：启动时不执行任何构造函数，和别的全局对象的初始化顺序无关，main之前就可以申请内存
+// 用到这些头文件的程序要一起编译HcMalloc.cc（见Makefile），头文件里的函数都是inline，多个.cc包含也不会重复定义
 
 // 为了确保每个线程都有一份ThreadCache，使用TLS（线程局部存储）保证了无锁申请内存
-static thread_local ThreadCache* pTLSThreadCache = nullptr;
+// 声明成constinit，编译器知道它不需要动态初始化，访问时不用先调用TLS的初始化函数
+extern constinit thread_local ThreadCache* pTLSThreadCache;
+
+// 定长内存池本身不是线程安全的，多个线程同时创建ThreadCache时需要加锁
+extern std::mutex tcMtx;
+extern ObjectPool<ThreadCache> tcPool;
+
+// 线程退出时把ThreadCache里的内存全部还给CentralCache，ThreadCache对象本身还给tcPool
+struct ThreadCacheReaper
+{
+    // 这个线程的ThreadCache；别的线程回收它的时候pTLSThreadCache会暂时是空的（见ThreadCache::ReclaimIdle），以这个为准
+    ThreadCache* _cache = nullptr;
+
+    ~ThreadCacheReaper()
+    {
+        if (_cache == nullptr)
+            return;
+
+        // 先注销，之后别的线程不会再来回收它
+        _cache->Unregister();
+        _cache->ReleaseAll();
+        std::lock_guard<std::mutex> lock(tcMtx);
+        tcPool.Delete(_cache);
+        _cache = nullptr;
+        pTLSThreadCache = nullptr;
+    }
+};
+
+// 获取当前线程的ThreadCache，没有就创建一个
+// 释放时也可能是第一次访问（例如容器在别的线程中被析构），所以申请和释放都走这里
+inline ThreadCache* GetThreadCache()
+{
+    if (pTLSThreadCache == nullptr)
+    {
+        // 第一次经过这里时构造，线程退出时析构
+        static thread_local ThreadCacheReaper reaper;
+        if (reaper._cache)
+        {
+            // 闲置时正被别的线程回收，等它做完装回来
+            ThreadCache::WaitReclaim();
+            return pTLSThreadCache;
+        }
+
+        // ThreadCache的上限取自参数，构造之前先读一下HCMALLOC_*环境变量
+        HcTuning::GetInstance()->LoadEnvironment();
+
+        {
+            std::lock_guard<std::mutex> lock(tcMtx);
+            // pTLSThreadCache = new ThreadCache;
+            pTLSThreadCache = tcPool.New();
+        }
+        reaper._cache = pTLSThreadCache;
+        pTLSThreadCache->Register(&pTLSThreadCache);
+    }
+    return pTLSThreadCache;
+}
+
+#ifdef HC_GUARDED_SAMPLING
+// 距离下一次抽样还有多少次申请，减到负数时进入ConcurrentAllocSampled
+extern constinit thread_local long tlsGuardedCountdown;
+
+// 抽样的慢路径，定义在HcMalloc.cc，保证快路径上只多一次减一和一次比较
+void* ConcurrentAllocSampled(size_t size);
+#endif
+
+inline void* ConcurrentAllocImpl(size_t size);
+inline void ConcurrentFreeImpl(void* ptr);
+
+// 到了堆的硬上限，申请失败后的慢路径，定义在HcMalloc.cc
+// 先把本线程缓存的、PageCache里空闲的内存都还给系统再试一次；还不行的话
+// newHandler为true时和operator new一样循环调用new_handler，否则返回nullptr
+void* ConcurrentAllocFailed(size_t size, bool newHandler);
+
+// 申请内存，和operator new一样：到了堆的硬上限时调用new_handler，没有new_handler就抛std::bad_alloc
+inline void* ConcurrentAlloc(size_t size)
+{
+    void* ptr = ConcurrentAllocImpl(size);
+    if (ptr == nullptr)
+        ptr = ConcurrentAllocFailed(size, true);
+#ifdef HC_TRACE
+    if (AllocTrace::GetInstance()->Enabled())
+        AllocTrace::GetInstance()->Record(TRACE_ALLOC, ptr, size);
+#endif
+    return ptr;
+}
 
-// 申请内存
-static void* ConcurrentAlloc(size_t size)
+inline void ConcurrentFree(void* ptr)
 {
+#ifdef HC_TRACE
+    if (AllocTrace::GetInstance()->Enabled())
+        AllocTrace::GetInstance()->Record(TRACE_FREE, ptr, 0);
+#endif
+    ConcurrentFreeImpl(ptr);
+}
+
+inline void* ConcurrentAllocImpl(size_t size)
+{
+#ifdef HC_GUARDED_SAMPLING
+    if (--tlsGuardedCountdown < 0)
+    {
+        void* ptr = ConcurrentAllocSampled(size);
+        if (ptr)
+            return ptr;
+    }
+#endif
+
     // 如果要申请大于256KB的内存，则不向ThreadCahce申请
     if (size > MAX_BYTES)
     {
@@ -18,42 +133,384 @@ static void* ConcurrentAlloc(size_t size)
         size_t kpage = alignSize >> PAGE_SHIFT;
 
         // 进入PageCache，上锁
-        PageCache::GetInstance()->_pageMtx.lock();
+        HC_LOCK(PageCache::GetInstance()->_pageMtx, LOCK_SITE_LARGE_ALLOC);
         Span* span = PageCache::GetInstance()->NewSpan(kpage);
-        span->_objSize = alignSize;
+        if (span == nullptr)
+        {
+            PageCache::GetInstance()->_pageMtx.unlock();
+            return nullptr;
+        }
+        // 标记为使用中，否则不超过128页的span在别的span归还时会被当作空闲的合并掉
+        span->_isUse = true;
         PageCache::GetInstance()->_pageMtx.unlock();
 
         void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
+        HC_PROBE3(large_alloc, size, kpage, ptr);
         return ptr;
     }
     else
     {
         // 每个线程都有自己的pTLSthreadcache
-        if (pTLSThreadCache == nullptr)
+        return GetThreadCache()->Allocate(size);
+    }
+}
+
+inline void ConcurrentFreeImpl(void* ptr)
+{
+    // 小对象只查一次PageMap的叶子就知道在哪个桶，不用读Span
+    size_t sizeClass = PageCache::GetInstance()->MapObjectToSizeClass(ptr);
+    if (sizeClass != 0)
+    {
+        GetThreadCache()->Deallocate(ptr, sizeClass - 1, SizeClass::ClassSize(sizeClass - 1));
+        return;
+    }
+
+    // 大于256KB的，整个span就是这一个对象
+    Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+#ifdef HC_GUARDED_SAMPLING
+    // 采样保护区的span
+    if (span->_isGuarded)
+    {
+        GuardedPool::GetInstance()->Free(ptr);
+        return;
+    }
+#endif
+    HC_PROBE2(large_free, span->_n, ptr);
+    HC_LOCK(PageCache::GetInstance()->_pageMtx, LOCK_SITE_LARGE_FREE);
+    PageCache::GetInstance()->ReleaseSpanToPageCache(span);
+    PageCache::GetInstance()->_pageMtx.unlock();
+}
+
+// 带大小的释放：调用方知道申请时的大小（STL分配器、pmr都会传回来）
+// 小对象可以直接算出桶的下标，省掉一次查页号映射
+inline void ConcurrentFree(void* ptr, size_t size)
+{
+#ifdef HC_TRACE
+    if (AllocTrace::GetInstance()->Enabled())
+        AllocTrace::GetInstance()->Record(TRACE_FREE, ptr, 0);
+#endif
+#ifdef HC_GUARDED_SAMPLING
+    // 带大小的释放不查页号映射，只能按地址范围认出采样保护区的对象
+    if (GuardedPool::GetInstance()->MaybeContains(ptr)) [[unlikely]]
+    {
+        GuardedPool::GetInstance()->Free(ptr);
+        return;
+    }
+#endif
+    if (size > MAX_BYTES)
+    {
+        ConcurrentFreeImpl(ptr);
+    }
+    else
+    {
+        GetThreadCache()->Deallocate(ptr, size);
+    }
+}
+
+// 大小在编译期已知的申请：ConcurrentAlloc<sizeof(Node)>()
+// 下标和对齐后的大小在编译期算好，快路径只有一次TLS读和一次链表头删，向CentralCache要内存的慢路径不内联
+template <size_t N>
+inline void* ConcurrentAlloc()
+{
+    if constexpr (N > MAX_BYTES)
+    {
+        return ConcurrentAlloc(N);
+    }
+    else
+    {
+#ifdef HC_GUARDED_SAMPLING
+        if (--tlsGuardedCountdown < 0)
         {
-            static ObjectPool<ThreadCache> tcPool;
-            // pTLSThreadCache = new ThreadCache;
-            pTLSThreadCache = tcPool.New();
+            void* ptr = ConcurrentAllocSampled(N);
+            if (ptr)
+                return ptr;
+        }
+#endif
+        void* ptr = GetThreadCache()->Allocate<N>();
+        if (ptr == nullptr)
+            ptr = ConcurrentAllocFailed(N, true);
+#ifdef HC_TRACE
+        if (AllocTrace::GetInstance()->Enabled())
+            AllocTrace::GetInstance()->Record(TRACE_ALLOC, ptr, N);
+#endif
+        return ptr;
+    }
+}
+
+// 与ConcurrentAlloc<N>配对，N要与申请时一致
+template <size_t N>
+inline void ConcurrentFree(void* ptr)
+{
+    if constexpr (N > MAX_BYTES)
+    {
+        ConcurrentFree(ptr, N);
+    }
+    else
+    {
+#ifdef HC_TRACE
+        if (AllocTrace::GetInstance()->Enabled())
+            AllocTrace::GetInstance()->Record(TRACE_FREE, ptr, 0);
+#endif
+#ifdef HC_GUARDED_SAMPLING
+        if (GuardedPool::GetInstance()->MaybeContains(ptr)) [[unlikely]]
+        {
+            GuardedPool::GetInstance()->Free(ptr);
+            return;
         }
+#endif
+        GetThreadCache()->Deallocate<N>(ptr);
+    }
+}
+
+// 按对齐要求申请内存，align必须是2的幂并且不超过一页
+inline void* ConcurrentAllocAligned(size_t size, size_t align)
+{
+    assert((align & (align - 1)) == 0);
+    assert(align <= ((size_t)1 << PAGE_SHIFT));
+
+    return ConcurrentAlloc(SizeClass::AlignedSize(size, align));
+}
+
+// 与ConcurrentAllocAligned配对的带大小释放，size和align要与申请时一致
+inline void ConcurrentFreeAligned(void* ptr, size_t size, size_t align)
+{
+    ConcurrentFree(ptr, SizeClass::AlignedSize(size, align));
+}
+
+// 不和任何别的对象共用缓存行的申请：大小按缓存行向上取整，放在缓存行大小整数倍的大小类里，
+// 每一块都从行首开始、占满整行，适合各线程自己频繁写的计数器之类
+inline void* ConcurrentAllocIsolated(size_t size)
+{
+    return ConcurrentAlloc(SizeClass::AlignedSize(size, CACHE_LINE_SIZE));
+}
+
+// 与ConcurrentAllocIsolated配对的带大小释放（也可以直接ConcurrentFree(ptr)）
+inline void ConcurrentFreeIsolated(void* ptr, size_t size)
+{
+    ConcurrentFree(ptr, SizeClass::AlignedSize(size, CACHE_LINE_SIZE));
+}
+
+// 默认的堆上每个线程一批批拿到的块不和别的线程共用缓存行，见CentralCache::SetThreadAffine
+inline void hc_set_thread_affine(bool on)
+{
+    CentralCache::GetInstance()->SetThreadAffine(on);
+}
 
-        return pTLSThreadCache->Allocate(size);
+// 运行时改参数，名字和范围见Tuning.hpp；成功返回0，名字不认识或者值超出范围返回-1
+// 空闲页的上限调小时，默认的PageCache里多出来的页马上还给系统
+inline int hc_set_property(const char* name, size_t value)
+{
+    HcTuning* tuning = HcTuning::GetInstance();
+    tuning->LoadEnvironment();
+    const HcTuning::Property* prop = HcTuning::Find(name);
+    if (prop == nullptr || !tuning->Set(*prop, value))
+        return -1;
+
+    if (prop->_field == &HcTuning::_pageCacheMaxFreeBytes && value != 0)
+    {
+        std::lock_guard<HcMutex> lock(PageCache::GetInstance()->_pageMtx);
+        PageCache::GetInstance()->ReleaseFreeSpans(value);
     }
+    return 0;
 }
 
-static void ConcurrentFree(void* ptr)
+// 除了能改的参数，还可以读这几个统计（只读）：
+//     mapped_bytes                默认的堆向系统申请了多少字节
+//     page_cache_free_bytes       默认的PageCache里空闲的页一共多少字节
+//     thread_cache_bytes          当前线程的ThreadCache缓存了多少字节
+inline int hc_get_property(const char* name, size_t* value)
 {
-    Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
-    size_t size = span->_objSize;
+    HcTuning* tuning = HcTuning::GetInstance();
+    tuning->LoadEnvironment();
+    if (const HcTuning::Property* prop = HcTuning::Find(name))
+        *value = tuning->Get(*prop);
+    else if (strcmp(name, "mapped_bytes") == 0)
+        *value = PageCache::GetInstance()->MappedBytes();
+    else if (strcmp(name, "page_cache_free_bytes") == 0)
+        *value = PageCache::GetInstance()->FreeBytes();
+    else if (strcmp(name, "thread_cache_bytes") == 0)
+        *value = GetThreadCache()->CachedBytes();
+    else
+        return -1;
+    return 0;
+}
 
-    // 如果大于256KB
-    if (size > MAX_BYTES)
+// malloc风格的接口：到了堆的硬上限时返回nullptr，不抛异常
+inline void* hc_malloc(size_t size)
+{
+    void* ptr = ConcurrentAllocImpl(size);
+    if (ptr == nullptr)
+        ptr = ConcurrentAllocFailed(size, false);
+#ifdef HC_TRACE
+    if (ptr && AllocTrace::GetInstance()->Enabled())
+        AllocTrace::GetInstance()->Record(TRACE_ALLOC, ptr, size);
+#endif
+    return ptr;
+}
+
+inline void hc_free(void* ptr)
+{
+    if (ptr)
+        ConcurrentFree(ptr);
+}
+
+// 和realloc一样：ptr为nullptr时就是hc_malloc，size为0时释放并返回nullptr；失败时返回nullptr，ptr不变
+// 直接向系统申请的大块（超过128页）变大变小都用mremap，内核只改页表，多大都不用拷贝内容；
+// 其他的还在同一个大小类（或者同样的页数）里就原地不动，否则重新申请再拷贝，大块的拷贝不经过缓存
+inline void* hc_realloc(void* ptr, size_t size)
+{
+    if (ptr == nullptr)
+        return hc_malloc(size);
+    if (size == 0)
+    {
+        hc_free(ptr);
+        return nullptr;
+    }
+
+    PageCache* pageCache = PageCache::GetInstance();
+    size_t oldSize = 0;
+    size_t sizeClass = pageCache->MapObjectToSizeClass(ptr);
+    if (sizeClass != 0)
     {
-        PageCache::GetInstance()->ReleaseSpanToPageCache(span);
+        oldSize = SizeClass::ClassSize(sizeClass - 1);
+        if (size <= MAX_BYTES && SizeClass::Index(size) == sizeClass - 1)
+            return ptr;
     }
     else
     {
-        assert(pTLSThreadCache);
-        pTLSThreadCache->Deallocate(ptr, size);
+        Span* span = pageCache->MapObjectToSpan(ptr);
+#ifdef HC_GUARDED_SAMPLING
+        if (span->_isGuarded)
+            oldSize = GuardedPool::GetInstance()->UsableSize(ptr);
+        else
+#endif
+        {
+            oldSize = (size_t)span->_n << PAGE_SHIFT;
+            size_t kpage = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+            if (size > MAX_BYTES && kpage == span->_n)
+                return ptr;
+
+            if (size > MAX_BYTES && kpage > NPAGES - 1 && span->_n > NPAGES - 1)
+            {
+                HC_LOCK(pageCache->_pageMtx, LOCK_SITE_LARGE_ALLOC);
+                bool remapped = pageCache->ResizeLargeSpan(span, kpage);
+                pageCache->_pageMtx.unlock();
+                if (remapped)
+                {
+                    void* newPtr = (void*)(span->_pageId << PAGE_SHIFT);
+#ifdef HC_TRACE
+                    if (AllocTrace::GetInstance()->Enabled())
+                    {
+                        AllocTrace::GetInstance()->Record(TRACE_FREE, ptr, 0);
+                        AllocTrace::GetInstance()->Record(TRACE_ALLOC, newPtr, size);
+                    }
+#endif
+                    return newPtr;
+                }
+            }
+        }
     }
 
-}
\ No newline at end of file
+    void* newPtr = hc_malloc(size);
+    if (newPtr == nullptr)
+        return nullptr;
+    NonTemporalCopy(newPtr, ptr, std::min(oldSize, size));
+    hc_free(ptr);
+    return newPtr;
+}
+
+// 申请时实际给的比要的多（按大小类向上取整），多出来的部分调用方可以直接用
+// flags和jemalloc的mallocx一样：低6位是对齐的log2，0表示不要求对齐；对齐最多到一页(8KB)
+#define HC_MALLOCX_LG_ALIGN(la) ((int)(la))
+#define HC_MALLOCX_ALIGN(a) ((int)__builtin_ctzll(a))
+
+inline size_t HcFlagsAlign(int flags)
+{
+    return (size_t)1 << (flags & 0x3f);
+}
+
+// 默认的堆上ptr这一块实际能用多少字节：小对象是大小类的大小，大块是整个span
+// 采样保护区的对象只有申请时的大小（后面紧挨着保护页）
+inline size_t hc_usable_size(void* ptr)
+{
+    if (ptr == nullptr)
+        return 0;
+
+    PageCache* pageCache = PageCache::GetInstance();
+    size_t sizeClass = pageCache->MapObjectToSizeClass(ptr);
+    if (sizeClass != 0)
+        return SizeClass::ClassSize(sizeClass - 1);
+
+    Span* span = pageCache->MapObjectToSpan(ptr);
+#ifdef HC_GUARDED_SAMPLING
+    if (span->_isGuarded)
+        return GuardedPool::GetInstance()->UsableSize(ptr);
+#endif
+    return span->ObjSize();
+}
+
+// 按flags申请size字节时hc_usable_size会是多少，只算大小类，不申请内存；对齐超过一页或者大小溢出时返回0
+// 用它的结果去申请，拿到的块正好用满（采样到保护区时也不会越界），释放时可以把它传给hc_sdallocx
+inline size_t hc_nallocx(size_t size, int flags)
+{
+    size_t align = HcFlagsAlign(flags);
+    if (align > ((size_t)1 << PAGE_SHIFT) || size > (size_t)PTRDIFF_MAX)
+        return 0;
+    if (size == 0)
+        size = 1;
+    return SizeClass::RoundUp(SizeClass::AlignedSize(size, align));
+}
+
+// 带大小的释放：size可以是申请时的大小，也可以是hc_nallocx/hc_usable_size给的大小，flags和申请时一致
+inline void hc_sdallocx(void* ptr, size_t size, int flags)
+{
+    if (ptr == nullptr)
+        return;
+    ConcurrentFreeAligned(ptr, size == 0 ? 1 : size, HcFlagsAlign(flags));
+}
+
+#ifdef HC_LOCK_STATS
+// 打印锁的统计：先按加锁的位置，再是PageCache的锁，最后是有过等待的桶锁（按等待总时间从多到少）
+inline void DumpLockStats(FILE* fp = stdout)
+{
+    fprintf(fp, "---- 按加锁位置 ----\n");
+    for (size_t i = 0; i < LOCK_SITE_COUNT; ++i)
+    {
+        LockSiteStats((LockSite)i).Dump(fp, kLockSiteNames[i]);
+    }
+
+    fprintf(fp, "---- PageCache ----\n");
+    PageCache::GetInstance()->_pageMtx.Stats().Dump(fp, "_pageMtx");
+
+    fprintf(fp, "---- CentralCache 桶锁 ----\n");
+    std::vector<size_t> buckets;
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        if (CentralCache::GetInstance()->BucketLockStats(i)._contended.load() > 0)
+            buckets.push_back(i);
+    }
+    std::sort(buckets.begin(), buckets.end(), [](size_t a, size_t b) {
+        return CentralCache::GetInstance()->BucketLockStats(a)._waitNs.load()
+            > CentralCache::GetInstance()->BucketLockStats(b)._waitNs.load();
+        });
+    for (size_t i : buckets)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "桶%zu(%zu字节)", i, SizeClass::ClassSize(i));
+        CentralCache::GetInstance()->BucketLockStats(i).Dump(fp, name);
+    }
+}
+
+inline void ResetLockStats()
+{
+    for (size_t i = 0; i < LOCK_SITE_COUNT; ++i)
+    {
+        LockSiteStats((LockSite)i).Reset();
+    }
+    PageCache::GetInstance()->_pageMtx.Stats().Reset();
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        CentralCache::GetInstance()->BucketLockStats(i).Reset();
+    }
+}
+#endif
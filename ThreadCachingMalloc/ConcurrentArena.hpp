@@ -0,0 +1,215 @@
+#pragma once
+
+#include "Common.hpp"
+#include "PageCache.hpp"
+
+// 区域(arena)分配器：一次请求里申请的内存生命周期相同，没必要一块一块地还
+// 从PageCache拿整个span，在span里用指针碰撞(bump)的方式切内存
+// 单个对象的释放什么都不做，Reset或析构时把所有span一次性还回去
+//
+// 一个arena同一时间只给一个线程用（一次请求一个arena），多个arena之间可以并发
+
+static const size_t ARENA_SPAN_PAGES = 16;      // 默认每次拿16页(128KB)
+static const size_t ARENA_CACHE_SPANS = 8;      // 每个线程最多缓存8个用过的span
+static const size_t ARENA_CACHE_BYTES = 1 << 20;    // 并且加起来不超过1MB，页数大的arena也只缓存几个
+
+// 每个线程缓存几个arena span，Reset之后下一个arena直接复用，不用拿PageCache的锁
+// 不同arena的_spanPages可以不一样，缓存里混着几种大小，取的时候按页数找
+// 和ThreadCache一样，堆碰到软上限以后（PressureEpoch变了）下一次用到缓存时整个还给PageCache
+class ArenaSpanCache
+{
+private:
+    Span* _spans[ARENA_CACHE_SPANS];
+    size_t _size = 0;
+    size_t _bytes = 0;          // 缓存的span一共多少字节
+    size_t _pressureEpoch = PageCache::GetInstance()->PressureEpoch();
+public:
+    static ArenaSpanCache* GetInstance()
+    {
+        static thread_local ArenaSpanCache sInst;
+        return &sInst;
+    }
+
+    // 取一个正好npage页的span，没有返回nullptr
+    Span* Pop(size_t npage)
+    {
+        CheckPressure();
+        for (size_t i = _size; i > 0; --i)
+        {
+            Span* span = _spans[i - 1];
+            if (span->_n == npage)
+            {
+                _spans[i - 1] = _spans[--_size];
+                _bytes -= (size_t)span->_n << PAGE_SHIFT;
+                return span;
+            }
+        }
+        return nullptr;
+    }
+
+    bool Push(Span* span)
+    {
+        CheckPressure();
+        size_t bytes = (size_t)span->_n << PAGE_SHIFT;
+        if (_size == ARENA_CACHE_SPANS || _bytes + bytes > ARENA_CACHE_BYTES)
+            return false;
+        _spans[_size++] = span;
+        _bytes += bytes;
+        return true;
+    }
+
+    size_t Bytes() const
+    {
+        return _bytes;
+    }
+
+    // 把缓存的span都还给PageCache
+    void Drain()
+    {
+        if (_size == 0)
+            return;
+
+        std::lock_guard<HcMutex> lock(PageCache::GetInstance()->_pageMtx);
+        while (_size > 0)
+        {
+            PageCache::GetInstance()->ReleaseSpanToPageCache(_spans[--_size]);
+        }
+        _bytes = 0;
+    }
+
+    // 线程退出时把缓存的span还给PageCache
+    ~ArenaSpanCache()
+    {
+        Drain();
+    }
+
+private:
+    void CheckPressure()
+    {
+        size_t epoch = PageCache::GetInstance()->PressureEpoch();
+        if (epoch != _pressureEpoch)
+        {
+            _pressureEpoch = epoch;
+            Drain();
+        }
+    }
+};
+
+class ConcurrentArena
+{
+private:
+    Span* _spans = nullptr;     // 用过的span，用_next串成单链表
+    char* _cur = nullptr;       // 当前span里还没用的部分 [_cur, _end)
+    char* _end = nullptr;
+    size_t _spanPages;          // 默认每次申请的页数
+    size_t _bytes = 0;          // 一共切出去了多少字节
+public:
+    explicit ConcurrentArena(size_t spanPages = ARENA_SPAN_PAGES)
+        : _spanPages(spanPages)
+    {}
+
+    ConcurrentArena(const ConcurrentArena&) = delete;
+    ConcurrentArena& operator=(const ConcurrentArena&) = delete;
+
+    ~ConcurrentArena()
+    {
+        Reset();
+    }
+
+    // align必须是2的幂，默认按8字节对齐，和内存池的小块内存一致
+    void* Allocate(size_t size, size_t align = 8)
+    {
+        assert((align & (align - 1)) == 0);
+
+        char* ptr = (char*)SizeClass::_RoundUp((size_t)_cur, align);
+        if (_cur == nullptr || ptr + size > _end)
+        {
+            ptr = (char*)SizeClass::_RoundUp((size_t)NewSpan(size + align), align);
+        }
+
+        _cur = ptr + size;
+        _bytes += size;
+        return ptr;
+    }
+
+    // 在arena上构造对象，Reset时不会调用析构函数，只适合放不需要析构的对象
+    template <class T, class... Args>
+    T* New(Args&&... args)
+    {
+        void* obj = Allocate(sizeof(T), alignof(T));
+        return new (obj) T(std::forward<Args>(args)...);
+    }
+
+    // 单个对象的释放是空操作，内存在Reset时统一回收
+    void Free(void*)
+    {}
+
+    // 把所有span一次还回去：默认大小的先放进线程缓存，剩下的在一次加锁里全部还给PageCache
+    void Reset()
+    {
+        ArenaSpanCache* cache = ArenaSpanCache::GetInstance();
+
+        Span* release = nullptr;
+        while (_spans)
+        {
+            Span* next = _spans->_next;
+            if (_spans->_n != _spanPages || !cache->Push(_spans))
+            {
+                _spans->_next = release;
+                release = _spans;
+            }
+            _spans = next;
+        }
+
+        if (release)
+        {
+            std::lock_guard<HcMutex> lock(PageCache::GetInstance()->_pageMtx);
+            while (release)
+            {
+                Span* next = release->_next;
+                release->_next = nullptr;
+                PageCache::GetInstance()->ReleaseSpanToPageCache(release);
+                release = next;
+            }
+        }
+
+        _cur = _end = nullptr;
+        _bytes = 0;
+    }
+
+    // 切出去的字节数
+    size_t BytesAllocated() const
+    {
+        return _bytes;
+    }
+
+private:
+    // 当前span不够用了，拿一个新的span，返回它的起始地址
+    // 超过默认大小的请求单独拿一个刚好够大的span
+    char* NewSpan(size_t bytes)
+    {
+        size_t kpage = SizeClass::_RoundUp(bytes, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+        if (kpage < _spanPages)
+            kpage = _spanPages;
+
+        Span* span = nullptr;
+        if (kpage == _spanPages)
+            span = ArenaSpanCache::GetInstance()->Pop(kpage);
+
+        if (span == nullptr)
+        {
+            std::lock_guard<HcMutex> lock(PageCache::GetInstance()->_pageMtx);
+            span = PageCache::GetInstance()->NewSpan(kpage);
+            if (span == nullptr)
+                throw std::bad_alloc();
+            span->_isUse = true;
+        }
+
+        span->_next = _spans;
+        _spans = span;
+
+        char* start = (char*)(span->_pageId << PAGE_SHIFT);
+        _end = start + ((size_t)span->_n << PAGE_SHIFT);
+        return start;
+    }
+};
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include "Common.hpp"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// 堆的页从文件映射来（hc_heap_create时HcHeapOptions::_fileBacked打开）
+// 文件按_extentBytes一段一段地增长，每段用MAP_SHARED映射，PageCache从映射里按页往后切；
+// 冷的页由内核直接写回文件再丢掉，不需要swap，数据量可以比内存大
+// 文件是匿名的：指定目录时在目录下建O_TMPFILE（不支持时建了马上unlink），没指定时用memfd；关闭后自动删除
+// 文件只增长不缩短，还回来的页合并以后够FILE_DISCARD_PAGES页的，用MADV_REMOVE在文件里打洞，不占磁盘
+//
+// 除了Sync以外都由PageCache在持有_pageMtx时调用
+
+static const size_t FILE_EXTENT_BYTES = (size_t)64 << 20;  // 默认每次增长64MB
+static const size_t FILE_DISCARD_PAGES = 32;               // 合并以后的空闲span至少这么多页(256KB)才打洞，太小的打洞不值
+
+class FileBacking
+{
+private:
+    struct Extent
+    {
+        char* _base;
+        size_t _bytes;
+    };
+
+    int _fd = -1;
+    size_t _extentBytes = FILE_EXTENT_BYTES;
+    size_t _fileBytes = 0;          // 文件现在的长度
+    char* _cur = nullptr;           // 当前这一段还没切的部分
+    char* _end = nullptr;
+    std::vector<Extent> _extents;
+public:
+    FileBacking() = default;
+    FileBacking(const FileBacking&) = delete;
+
+    ~FileBacking()
+    {
+        Close();
+    }
+
+    // dir为nullptr时用memfd，extentBytes是每次增长多少（按页对齐，至少一个1MB的span）
+    bool Open(const char* dir, size_t extentBytes)
+    {
+#if defined(_WIN32) || defined(_WIN64)
+        return false;
+#else
+        assert(_fd < 0);
+        if (dir == nullptr)
+        {
+#if defined(__linux__)
+            _fd = memfd_create("hcmalloc-heap", MFD_CLOEXEC);
+#endif
+        }
+        else
+        {
+#ifdef O_TMPFILE
+            _fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+            if (_fd < 0)
+            {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s/hcmalloc-heap-XXXXXX", dir);
+                _fd = mkstemp(path);
+                if (_fd >= 0)
+                    unlink(path);
+            }
+        }
+
+        size_t minBytes = (NPAGES - 1) << PAGE_SHIFT;
+        _extentBytes = SizeClass::_RoundUp(std::max(extentBytes, minBytes), (size_t)1 << PAGE_SHIFT);
+        return _fd >= 0;
+#endif
+    }
+
+    bool IsOpen() const
+    {
+        return _fd >= 0;
+    }
+
+    // 文件的长度
+    size_t FileBytes() const
+    {
+        return _fileBytes;
+    }
+
+    // 文件实际占用的磁盘（memfd是内存）字节数，打洞以后变小
+    size_t AllocatedBytes() const
+    {
+#if defined(_WIN32) || defined(_WIN64)
+        return 0;
+#else
+        struct stat st;
+        if (fstat(_fd, &st) != 0)
+            return 0;
+        return (size_t)st.st_blocks * 512;
+#endif
+    }
+
+    // 当前这一段剩下的不够k页、Map要让文件再长一段时，先把剩下的尾巴交给调用方当空闲的页用
+    // 没有尾巴时返回nullptr；尾巴没碰过，在文件里本来就是洞
+    void* TakeTail(size_t k, size_t& kpage)
+    {
+        size_t rest = _end - _cur;
+        if (rest == 0 || rest >= (k << PAGE_SHIFT))
+            return nullptr;
+
+        void* ptr = _cur;
+        kpage = rest >> PAGE_SHIFT;
+        _cur = _end;
+        return ptr;
+    }
+
+    // 切k页出来，当前这一段不够时文件再长一段（太大的申请单独长一段），失败时返回nullptr
+    // 调用前先用TakeTail把这一段的尾巴拿走，否则尾巴就丢了
+    void* Map(size_t k)
+    {
+        size_t bytes = k << PAGE_SHIFT;
+        if ((size_t)(_end - _cur) < bytes)
+        {
+            if (!Grow(std::max(bytes, _extentBytes)))
+                return nullptr;
+        }
+        void* ptr = _cur;
+        _cur += bytes;
+        return ptr;
+    }
+
+    // 页不用了：内容扔掉，文件里对应的部分打洞；地址还留在映射里，PageCache可以再给出去
+    void Discard(void* ptr, size_t kpage)
+    {
+#if !defined(_WIN32) && !defined(_WIN64)
+        madvise(ptr, kpage << PAGE_SHIFT, MADV_REMOVE);
+#endif
+    }
+
+    // 把所有映射的脏页写回文件，async为true时只是发起写回不等待
+    int Sync(bool async)
+    {
+#if defined(_WIN32) || defined(_WIN64)
+        return -1;
+#else
+        for (const Extent& extent : _extents)
+        {
+            if (msync(extent._base, extent._bytes, async ? MS_ASYNC : MS_SYNC) != 0)
+                return -1;
+        }
+        return 0;
+#endif
+    }
+
+    // 解除所有映射并关闭文件，文件随之删除
+    void Close()
+    {
+#if !defined(_WIN32) && !defined(_WIN64)
+        for (const Extent& extent : _extents)
+        {
+            munmap(extent._base, extent._bytes);
+        }
+        std::vector<Extent>().swap(_extents);
+        if (_fd >= 0)
+            close(_fd);
+#endif
+        _fd = -1;
+        _fileBytes = 0;
+        _cur = _end = nullptr;
+    }
+
+private:
+    bool Grow(size_t bytes)
+    {
+#if defined(_WIN32) || defined(_WIN64)
+        return false;
+#else
+        if (ftruncate(_fd, _fileBytes + bytes) != 0)
+            return false;
+
+        // 和SystemAlloc一样要按页（8KB）对齐：先多占一页的地址空间，再把文件映射到对齐的位置上
+        size_t align = (size_t)1 << PAGE_SHIFT;
+        char* reserve = (char*)mmap(nullptr, bytes + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reserve == MAP_FAILED)
+            return false;
+        char* base = (char*)SizeClass::_RoundUp((size_t)reserve, align);
+        if (mmap(base, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, _fd, _fileBytes) == MAP_FAILED)
+        {
+            munmap(reserve, bytes + align);
+            return false;
+        }
+        if (base != reserve)
+            munmap(reserve, base - reserve);
+        if (reserve + align != base)
+            munmap(base + bytes, reserve + align - base);
+
+        _extents.push_back(Extent{ base, bytes });
+        _fileBytes += bytes;
+        _cur = base;
+        _end = base + bytes;
+        return true;
+#endif
+    }
+};
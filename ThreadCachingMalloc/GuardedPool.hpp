@@ -0,0 +1,274 @@
+#pragma once
+
+#include <csignal>
+#include <cstdio>
+#include <execinfo.h>
+#include <unistd.h>
+
+#include "Common.hpp"
+#include "PageCache.hpp"
+
+// 带保护页的采样分配（类似GWP-ASan），用来在线上抓堆内存错误
+// 大约每N次ConcurrentAlloc抽一次放进保护区：每个槽位一页数据，相邻槽位之间隔一页不可访问的保护页，
+// 对象靠着数据页的末尾放，越界写会立刻碰到后面的保护页；
+// 释放后整页设成不可访问，之后的访问（use-after-free）也会立刻触发SIGSEGV。
+// SIGSEGV处理函数判断出错地址在不在保护区里，在的话打印申请和释放时的调用栈。
+//
+// 不抽样的申请只多一次线程局部计数器的减一（见ConcurrentAlloc.hpp）
+// 保护区在PageCache里登记成一个_isGuarded的span，ConcurrentFree查到它就交给这里释放
+
+static const size_t GUARDED_SLOTS = 64;                     // 槽位个数
+static const size_t GUARDED_STACK_DEPTH = 16;               // 最多记录16层调用栈
+static const long GUARDED_DISABLED_INTERVAL = 1 << 16;      // 关闭时每隔多少次申请看一眼开关，见SetSampleRate
+
+// 一个槽位的记录
+struct GuardedSlot
+{
+    enum State { FREE, ALLOCATED, RELEASED };
+
+    State _state = FREE;
+    void* _ptr = nullptr;           // 给出去的地址
+    size_t _size = 0;
+    void* _allocStack[GUARDED_STACK_DEPTH] = {};
+    int _allocDepth = 0;
+    void* _freeStack[GUARDED_STACK_DEPTH] = {};
+    int _freeDepth = 0;
+};
+
+class GuardedPool
+{
+private:
+    char* _base = nullptr;          // 整个保护区：保护页 | 槽0 | 保护页 | 槽1 | ... | 保护页
+    size_t _regionPages = 0;
+    GuardedSlot _slots[GUARDED_SLOTS];
+    size_t _freeQueue[GUARDED_SLOTS] = {};  // 空闲槽位，先进先出，释放的槽位尽量晚一点再复用
+    size_t _freeHead = 0;
+    size_t _freeCount = 0;
+    std::mutex _mtx;
+    std::atomic<long> _sampleRate{ 0 };     // 0表示关闭
+    std::atomic<bool> _enabled{ false };    // 打开过采样，之后一直是true：关掉以后保护区里可能还有没释放的对象
+    struct sigaction _oldAction = {};
+
+    static GuardedPool _sInst;      // 定义在HcMalloc.cc
+
+    constexpr GuardedPool()
+    {}
+    GuardedPool(const GuardedPool&) = delete;
+public:
+    static GuardedPool* GetInstance()
+    {
+        return &_sInst;
+    }
+
+    // 打开采样，大约每rate次申请抽一次，rate为0时关闭
+    // 各线程的倒计数不重置，新的值要等它们各自数完这一轮才生效：
+    // 从关闭到打开最多晚GUARDED_DISABLED_INTERVAL次申请，改抽样间隔最多晚原来间隔的两倍，关闭时下一次抽样就不抽了。
+    // 重置的话快路径上要多读一个全局的计数，和"不抽样的申请只多一次减一"冲突，所以不做
+    void SetSampleRate(long rate)
+    {
+        if (rate > 0)
+        {
+            Init();
+            _enabled.store(true, std::memory_order_relaxed);
+        }
+        _sampleRate.store(rate);
+    }
+
+    long SampleRate() const
+    {
+        return _sampleRate.load(std::memory_order_relaxed);
+    }
+
+    // 计数器减到0时调用，返回下一次抽样前还要经过多少次申请
+    // 返回之前如果决定抽这一次，ptr指向保护区里的内存
+    long Sample(size_t size, void*& ptr)
+    {
+        ptr = nullptr;
+        long rate = SampleRate();
+        if (rate <= 0)
+            return GUARDED_DISABLED_INTERVAL;
+
+        if (size <= ((size_t)1 << PAGE_SHIFT))
+            ptr = Allocate(size);
+
+        // 间隔在[1, 2*rate]之间随机，避免固定间隔总抽到同一个调用点
+        static thread_local unsigned int seed = (unsigned int)(uintptr_t)&seed;
+        seed = seed * 1103515245 + 12345;
+        return 1 + (long)((seed >> 8) % (2 * (unsigned long)rate));
+    }
+
+    bool Contains(void* ptr) const
+    {
+        return (uintptr_t)ptr - (uintptr_t)_base < (_regionPages << PAGE_SHIFT);
+    }
+
+    // 带大小的释放不查页号映射，只能按地址范围认出保护区里的对象；从没打开过采样（默认）时只读一个标志
+    // 对象是打开以后才给出去的，交到释放它的线程手上时这个标志一定已经能看到
+    bool MaybeContains(void* ptr) const
+    {
+        return _enabled.load(std::memory_order_relaxed) && Contains(ptr);
+    }
+
+    // 申请时的大小
+    size_t UsableSize(void* ptr)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        return _slots[SlotIndex(ptr)]._size;
+    }
+
+    void Free(void* ptr)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+
+        size_t index = SlotIndex(ptr);
+        GuardedSlot& slot = _slots[index];
+        if (slot._state != GuardedSlot::ALLOCATED || slot._ptr != ptr)
+        {
+            Report(slot._state == GuardedSlot::RELEASED ? "double free" : "invalid free", ptr, &slot);
+            abort();
+        }
+
+        slot._freeDepth = backtrace(slot._freeStack, GUARDED_STACK_DEPTH);
+        slot._state = GuardedSlot::RELEASED;
+        mprotect(SlotPage(index), (size_t)1 << PAGE_SHIFT, PROT_NONE);
+
+        _freeQueue[(_freeHead + _freeCount) % GUARDED_SLOTS] = index;
+        ++_freeCount;
+    }
+
+private:
+    // 第一次打开采样时映射保护区、登记到PageCache、装上SIGSEGV处理函数
+    void Init()
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_base)
+            return;
+
+        _regionPages = 2 * GUARDED_SLOTS + 1;
+#ifdef HC_SEGMENTS
+        // 释放时按段头查span，保护区也要放在一段里（129页，一段放得下）
+        static_assert(2 * GUARDED_SLOTS + 1 < SEGMENT_PAGES, "guarded region must fit in one segment");
+        _base = (char*)SegmentAlloc(_regionPages);
+#else
+        _base = (char*)SystemAlloc(_regionPages);
+#endif
+        mprotect(_base, _regionPages << PAGE_SHIFT, PROT_NONE);
+
+        for (size_t i = 0; i < GUARDED_SLOTS; ++i)
+        {
+            _freeQueue[i] = i;
+        }
+        _freeHead = 0;
+        _freeCount = GUARDED_SLOTS;
+
+        {
+            std::lock_guard<HcMutex> pageLock(PageCache::GetInstance()->_pageMtx);
+            Span* span = PageCache::GetInstance()->NewExternalSpan(_base, _regionPages);
+            span->_isGuarded = true;
+        }
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = SignalHandler;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &_oldAction);
+    }
+
+    void* Allocate(size_t size)
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        if (_freeCount == 0)
+            return nullptr;
+
+        size_t index = _freeQueue[_freeHead];
+        _freeHead = (_freeHead + 1) % GUARDED_SLOTS;
+        --_freeCount;
+
+        char* page = SlotPage(index);
+        mprotect(page, (size_t)1 << PAGE_SHIFT, PROT_READ | PROT_WRITE);
+
+        // 靠着页尾放，按size最低位的2的幂对齐（至少8字节），这样对齐申请依然是对齐的
+        size_t align = size == 0 ? 8 : std::max<size_t>(8, size & (~size + 1));
+        size_t bytes = SizeClass::_RoundUp(size == 0 ? 1 : size, align);
+        if (bytes > ((size_t)1 << PAGE_SHIFT))
+            bytes = (size_t)1 << PAGE_SHIFT;
+
+        GuardedSlot& slot = _slots[index];
+        slot._state = GuardedSlot::ALLOCATED;
+        slot._ptr = page + ((size_t)1 << PAGE_SHIFT) - bytes;
+        slot._size = size;
+        slot._allocDepth = backtrace(slot._allocStack, GUARDED_STACK_DEPTH);
+        slot._freeDepth = 0;
+        return slot._ptr;
+    }
+
+    char* SlotPage(size_t index) const
+    {
+        return _base + ((2 * index + 1) << PAGE_SHIFT);
+    }
+
+    // 地址所在的槽位，保护页算作它前面那个槽位（越界写一般是往后写）
+    size_t SlotIndex(void* ptr) const
+    {
+        size_t page = ((uintptr_t)ptr - (uintptr_t)_base) >> PAGE_SHIFT;
+        if (page == 0)
+            return 0;
+        return (page - 1) / 2;
+    }
+
+    // 在信号处理函数里也会调用，只用write/backtrace_symbols_fd这类不申请内存的函数
+    void Report(const char* what, void* addr, GuardedSlot* slot)
+    {
+        char buf[256];
+        int len = snprintf(buf, sizeof(buf), "\n==%d== GuardedPool: %s at %p\n", (int)getpid(), what, addr);
+        write(STDERR_FILENO, buf, len);
+
+        if (slot == nullptr || slot->_state == GuardedSlot::FREE)
+            return;
+
+        len = snprintf(buf, sizeof(buf), "object %p of %zu bytes allocated at:\n", slot->_ptr, slot->_size);
+        write(STDERR_FILENO, buf, len);
+        backtrace_symbols_fd(slot->_allocStack, slot->_allocDepth, STDERR_FILENO);
+
+        if (slot->_state == GuardedSlot::RELEASED)
+        {
+            len = snprintf(buf, sizeof(buf), "freed at:\n");
+            write(STDERR_FILENO, buf, len);
+            backtrace_symbols_fd(slot->_freeStack, slot->_freeDepth, STDERR_FILENO);
+        }
+    }
+
+    static void SignalHandler(int sig, siginfo_t* info, void* context)
+    {
+        GuardedPool* pool = GetInstance();
+        void* addr = info->si_addr;
+
+        if (pool->Contains(addr))
+        {
+            size_t page = ((uintptr_t)addr - (uintptr_t)pool->_base) >> PAGE_SHIFT;
+            GuardedSlot* slot = &pool->_slots[pool->SlotIndex(addr)];
+
+            if (page % 2 == 0)
+                pool->Report("buffer overflow", addr, slot);
+            else if (slot && slot->_state == GuardedSlot::RELEASED)
+                pool->Report("use after free", addr, slot);
+            else
+                pool->Report("invalid access", addr, slot);
+        }
+
+        // 交还给原来的处理函数；原来是默认处理的话，返回后重新执行出错的指令，按默认方式崩溃
+        if (pool->_oldAction.sa_flags & SA_SIGINFO)
+        {
+            pool->_oldAction.sa_sigaction(sig, info, context);
+        }
+        else if (pool->_oldAction.sa_handler != SIG_DFL && pool->_oldAction.sa_handler != SIG_IGN)
+        {
+            pool->_oldAction.sa_handler(sig);
+        }
+        else
+        {
+            signal(sig, SIG_DFL);
+        }
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <new>
+#include <memory_resource>
+
+#include "ConcurrentAlloc.hpp"
+
+// 让标准容器直接从ThreadCache申请内存，而不是走全局的malloc
+// HcAllocator<T>  满足标准Allocator要求，可以用在 std::vector/std::map/std::unordered_map 等容器上
+// HcMemoryResource 是 std::pmr::memory_resource 的子类，给 std::pmr:: 系列容器用
+// 两者都把申请时的大小和对齐传回释放接口，小对象释放时不需要查页号映射
+
+// 超过一页的对齐内存池给不了，交给全局的对齐operator new
+static const size_t HC_MAX_ALIGN = (size_t)1 << PAGE_SHIFT;
+
+static inline void* HcAllocateBytes(size_t bytes, size_t align)
+{
+    // 和malloc(0)一样，0字节也要返回一个可以释放的有效指针
+    if (bytes == 0)
+        bytes = 1;
+
+    if (align > HC_MAX_ALIGN)
+        return ::operator new(bytes, std::align_val_t(align));
+
+    return ConcurrentAllocAligned(bytes, align);
+}
+
+static inline void HcDeallocateBytes(void* ptr, size_t bytes, size_t align)
+{
+    if (bytes == 0)
+        bytes = 1;
+
+    if (align > HC_MAX_ALIGN)
+    {
+        ::operator delete(ptr, std::align_val_t(align));
+        return;
+    }
+
+    ConcurrentFreeAligned(ptr, bytes, align);
+}
+
+template <class T>
+class HcAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type is_always_equal;
+
+    HcAllocator() noexcept
+    {}
+
+    template <class U>
+    HcAllocator(const HcAllocator<U>&) noexcept
+    {}
+
+    T* allocate(size_t n)
+    {
+        if (n > (size_t)-1 / sizeof(T))
+            throw std::bad_array_new_length();
+
+        return (T*)HcAllocateBytes(n * sizeof(T), alignof(T));
+    }
+
+    void deallocate(T* p, size_t n) noexcept
+    {
+        HcDeallocateBytes(p, n * sizeof(T), alignof(T));
+    }
+};
+
+// 所有实例共用同一个全局内存池，所以任意两个分配器都相等
+template <class T, class U>
+bool operator==(const HcAllocator<T>&, const HcAllocator<U>&) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const HcAllocator<T>&, const HcAllocator<U>&) noexcept
+{
+    return false;
+}
+
+class HcMemoryResource : public std::pmr::memory_resource
+{
+public:
+    // 全局唯一的实例，用法和 std::pmr::new_delete_resource() 一样
+    static HcMemoryResource* GetInstance()
+    {
+        static HcMemoryResource sInst;
+        return &sInst;
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        return HcAllocateBytes(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override
+    {
+        HcDeallocateBytes(p, bytes, alignment);
+    }
+
+    // 不同的HcMemoryResource对象背后是同一个内存池，一个申请的可以由另一个释放
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return dynamic_cast<const HcMemoryResource*>(&other) != nullptr;
+    }
+};
+
+// 在内存池上构造和析构单个对象，大小和对齐在编译期已知，走ConcurrentAlloc<N>的快路径
+// HcDelete<T>的T必须是对象的实际类型（不能用基类指针删派生类对象），因为释放时按sizeof(T)找桶
+template <class T>
+constexpr size_t HcObjectSize()
+{
+    return SizeClass::AlignedSize(sizeof(T), alignof(T));
+}
+
+template <class T, class... Args>
+T* HcNew(Args&&... args)
+{
+    static_assert(alignof(T) <= HC_MAX_ALIGN, "HcNew does not support alignment above one page");
+    void* obj = ConcurrentAlloc<HcObjectSize<T>()>();
+    try
+    {
+        return new (obj) T(std::forward<Args>(args)...);
+    }
+    catch (...)
+    {
+        ConcurrentFree<HcObjectSize<T>()>(obj);
+        throw;
+    }
+}
+
+template <class T>
+void HcDelete(T* obj)
+{
+    if (obj == nullptr)
+        return;
+    obj->~T();
+    ConcurrentFree<HcObjectSize<T>()>(obj);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "ConcurrentAlloc.hpp"
+
+// 可以增长的字节缓冲区（拼字符串、攒报文之类），容量总是正好是一个大小类：
+// 要n字节时按hc_nallocx(n)申请，大小类向上取整多出来的部分也算进容量，下次追加先用它们，不用马上再搬家
+// 变大时至少翻倍，只拷贝用了的部分；超过1MB的大块走hc_realloc，用mremap不拷贝
+//
+// 一个HcBuffer同一时间只给一个线程用；释放时按容量走带大小的释放，不用查页号映射
+
+class HcBuffer
+{
+private:
+    char* _data = nullptr;
+    size_t _size = 0;
+    size_t _capacity = 0;       // 申请时的hc_nallocx，就是这一块实际能用的大小
+public:
+    HcBuffer() = default;
+
+    explicit HcBuffer(size_t capacity)
+    {
+        Reserve(capacity);
+    }
+
+    HcBuffer(const HcBuffer&) = delete;
+    HcBuffer& operator=(const HcBuffer&) = delete;
+
+    HcBuffer(HcBuffer&& other) noexcept
+        : _data(other._data), _size(other._size), _capacity(other._capacity)
+    {
+        other._data = nullptr;
+        other._size = other._capacity = 0;
+    }
+
+    HcBuffer& operator=(HcBuffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            hc_sdallocx(_data, _capacity, 0);
+            _data = other._data;
+            _size = other._size;
+            _capacity = other._capacity;
+            other._data = nullptr;
+            other._size = other._capacity = 0;
+        }
+        return *this;
+    }
+
+    ~HcBuffer()
+    {
+        hc_sdallocx(_data, _capacity, 0);
+    }
+
+    // 容量至少到n，返回false时（到了堆的硬上限）内容不变
+    bool Reserve(size_t n)
+    {
+        if (n <= _capacity)
+            return true;
+
+        size_t capacity = hc_nallocx(n, 0);
+        if (capacity == 0)
+            return false;
+
+        char* data = nullptr;
+        if (_capacity > ((NPAGES - 1) << PAGE_SHIFT))
+        {
+            // 直接向系统申请的大块交给hc_realloc，用mremap不拷贝
+            data = (char*)hc_realloc(_data, capacity);
+            if (data == nullptr)
+                return false;
+        }
+        else
+        {
+            // 自己知道旧的容量和用了多少，不用像hc_realloc那样查页号映射，也只拷用了的部分
+            data = (char*)hc_malloc(capacity);
+            if (data == nullptr)
+                return false;
+            if (_size > 0)
+                memcpy(data, _data, _size);
+            hc_sdallocx(_data, _capacity, 0);
+        }
+        _data = data;
+        _capacity = capacity;
+        return true;
+    }
+
+    bool Append(const void* src, size_t n)
+    {
+        if (_size + n > _capacity && !Reserve(std::max(_size + n, 2 * _capacity)))
+            return false;
+        memcpy(_data + _size, src, n);
+        _size += n;
+        return true;
+    }
+
+    // 末尾留出n字节让调用方直接写（例如read、snprintf），写完用Commit把实际写的长度加上
+    char* Prepare(size_t n)
+    {
+        if (_size + n > _capacity && !Reserve(std::max(_size + n, 2 * _capacity)))
+            return nullptr;
+        return _data + _size;
+    }
+
+    void Commit(size_t n)
+    {
+        assert(_size + n <= _capacity);
+        _size += n;
+    }
+
+    void Clear()
+    {
+        _size = 0;
+    }
+
+    char* Data()
+    {
+        return _data;
+    }
+
+    const char* Data() const
+    {
+        return _data;
+    }
+
+    size_t Size() const
+    {
+        return _size;
+    }
+
+    size_t Capacity() const
+    {
+        return _capacity;
+    }
+};
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "ConcurrentAlloc.hpp"
+
+// 相互独立的堆：把可以整体丢掉的子系统（例如一个缓存）和进程里其他的内存隔开
+//     HcHeap* heap = hc_heap_create();
+//     void* p = hc_heap_alloc(heap, size);
+//     hc_heap_free(heap, p);
+//     hc_heap_destroy(heap);      // 堆里没释放的对象也一起没了
+// 每个堆有自己的PageCache和CentralCache，每个线程在每个堆上也有自己的ThreadCache，和默认的堆（ConcurrentAlloc）互不干扰
+// 销毁时PageCache按记下的每一块向系统申请的内存整块还回去，不用一个个对象、一个个span地释放
+//
+// 堆里的内存只能用hc_heap_free释放（ConcurrentFree查的是默认堆的页号映射）；
+// 堆上不做采样保护和trace，也不能设上限，向系统申请失败时hc_heap_alloc返回nullptr
+// 销毁时不能有别的线程还在用这个堆。各线程在这个堆上的ThreadCache不用通知：
+// 每个堆有一个编号(generation)，线程记着自己的ThreadCache属于哪个编号的堆，对不上就知道那个堆已经没了，
+// 不会再去碰里面缓存的内存，ThreadCache对象本身在这个线程下次用到这个槽位或者退出时回收
+//
+// 创建时可以让堆的页从文件映射来（HcHeapOptions::_fileBacked，见FileBacking.hpp），适合大量很少访问的对象：
+// 冷的页由内核写回文件后丢掉，不需要swap。hc_heap_advise/hc_heap_sync按对象所在的整个span给内核提示、写回
+
+static const size_t HC_MAX_HEAPS = 64;      // 同时存在的堆最多64个（不算默认的堆）
+
+struct HcHeapOptions
+{
+    bool _fileBacked = false;                   // 页从文件映射来
+    const char* _dir = nullptr;                 // 文件建在哪个目录下，nullptr时用memfd
+    size_t _extentBytes = FILE_EXTENT_BYTES;    // 文件每次增长多少
+};
+
+// hc_heap_advise的提示，作用在对象所在的整个span上
+enum HcAdvice
+{
+    HC_ADVICE_WILLNEED,     // 马上要用，提前读进来
+    HC_ADVICE_COLD,         // 暂时不用，内存紧张时先回收这些页（MADV_COLD）
+    HC_ADVICE_PAGEOUT,      // 现在就写回文件并回收（MADV_PAGEOUT），匿名内存的堆需要swap
+};
+
+// 一个线程在一个堆槽位上的ThreadCache
+struct HeapCacheRef
+{
+    ThreadCache* _cache = nullptr;
+    uint64_t _generation = 0;       // _cache属于哪个编号的堆，编号从1开始
+};
+
+// 定义在HcMalloc.cc
+extern constinit thread_local HeapCacheRef tlsHeapCaches[HC_MAX_HEAPS];
+
+class HcHeap
+{
+private:
+    PageCache _pageCache{ true };
+    CentralCache _centralCache{ &_pageCache };
+    FileBacking _file;
+    size_t _slot;               // 在tlsHeapCaches里的下标
+    uint64_t _generation;
+public:
+    HcHeap(size_t slot, uint64_t generation)
+        : _slot(slot)
+        , _generation(generation)
+    {}
+    HcHeap(const HcHeap&) = delete;
+
+    size_t Slot() const
+    {
+        return _slot;
+    }
+
+    PageCache* GetPageCache()
+    {
+        return &_pageCache;
+    }
+
+    FileBacking* GetFileBacking()
+    {
+        return &_file;
+    }
+
+    // 改成从文件映射页，只能在创建后马上调用
+    bool OpenFileBacking(const char* dir, size_t extentBytes)
+    {
+        if (!_file.Open(dir, extentBytes))
+            return false;
+        _pageCache.SetFileBacking(&_file);
+        return true;
+    }
+
+    int Advise(void* ptr, HcAdvice advice)
+    {
+#if defined(_WIN32) || defined(_WIN64)
+        return -1;
+#else
+        int flag = MADV_WILLNEED;
+        if (advice == HC_ADVICE_COLD)
+        {
+#ifdef MADV_COLD
+            flag = MADV_COLD;
+#else
+            return -1;
+#endif
+        }
+        else if (advice == HC_ADVICE_PAGEOUT)
+        {
+#ifdef MADV_PAGEOUT
+            flag = MADV_PAGEOUT;
+#else
+            return -1;
+#endif
+        }
+        Span* span = _pageCache.MapObjectToSpan(ptr);
+        return madvise((void*)(span->_pageId << PAGE_SHIFT), (size_t)span->_n << PAGE_SHIFT, flag);
+#endif
+    }
+
+    // ptr所在的span写回文件，ptr为nullptr时整个堆；匿名内存的堆什么都不用做
+    int Sync(void* ptr, bool async)
+    {
+        if (!_file.IsOpen())
+            return 0;
+#if defined(_WIN32) || defined(_WIN64)
+        return -1;
+#else
+        if (ptr == nullptr)
+        {
+            std::lock_guard<HcMutex> lock(_pageCache._pageMtx);
+            return _file.Sync(async);
+        }
+        Span* span = _pageCache.MapObjectToSpan(ptr);
+        return msync((void*)(span->_pageId << PAGE_SHIFT), (size_t)span->_n << PAGE_SHIFT, async ? MS_ASYNC : MS_SYNC);
+#endif
+    }
+
+    // 当前线程在这个堆上的ThreadCache，没有就创建一个
+    ThreadCache* GetThreadCache()
+    {
+        HeapCacheRef& ref = tlsHeapCaches[_slot];
+        if (ref._generation == _generation)
+            return ref._cache;
+        return BindThreadCache();
+    }
+
+    void* Allocate(size_t size)
+    {
+        if (size > MAX_BYTES)
+            return AllocateLarge(size);
+        return GetThreadCache()->Allocate(size);
+    }
+
+    void Free(void* ptr)
+    {
+        size_t sizeClass = _pageCache.MapObjectToSizeClass(ptr);
+        if (sizeClass != 0)
+        {
+            GetThreadCache()->Deallocate(ptr, sizeClass - 1, SizeClass::ClassSize(sizeClass - 1));
+            return;
+        }
+
+        Span* span = _pageCache.MapObjectToSpan(ptr);
+        HC_PROBE2(large_free, span->_n, ptr);
+        HC_LOCK(_pageCache._pageMtx, LOCK_SITE_LARGE_FREE);
+        _pageCache.ReleaseSpanToPageCache(span);
+        _pageCache._pageMtx.unlock();
+    }
+
+private:
+    void* AllocateLarge(size_t size)
+    {
+        size_t kpage = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+
+        HC_LOCK(_pageCache._pageMtx, LOCK_SITE_LARGE_ALLOC);
+        Span* span = _pageCache.NewSpan(kpage);
+        if (span)
+            span->_isUse = true;
+        _pageCache._pageMtx.unlock();
+        if (span == nullptr)
+            return nullptr;
+
+        void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
+        HC_PROBE3(large_alloc, size, kpage, ptr);
+        return ptr;
+    }
+
+    // 给当前线程在这个槽位上创建（或者复用上一个堆留下的）ThreadCache，定义在HcMalloc.cc
+    ThreadCache* BindThreadCache();
+};
+
+// 创建一个堆，options为nullptr时用匿名内存；已经有HC_MAX_HEAPS个堆、向系统申请失败或者文件建不起来时返回nullptr
+HcHeap* hc_heap_create(const HcHeapOptions* options = nullptr);
+
+// 销毁堆，把它向系统申请的内存全部还回去；heap为nullptr时什么都不做
+void hc_heap_destroy(HcHeap* heap);
+
+// 和hc_malloc一样，申请失败时返回nullptr
+inline void* hc_heap_alloc(HcHeap* heap, size_t size)
+{
+    return heap->Allocate(size);
+}
+
+inline void hc_heap_free(HcHeap* heap, void* ptr)
+{
+    if (ptr)
+        heap->Free(ptr);
+}
+
+// 给ptr所在的整个span一个提示，返回值和madvise一样
+inline int hc_heap_advise(HcHeap* heap, void* ptr, HcAdvice advice)
+{
+    return heap->Advise(ptr, advice);
+}
+
+// 把ptr所在的span（ptr为nullptr时整个堆）写回文件，返回值和msync一样
+inline int hc_heap_sync(HcHeap* heap, void* ptr, bool async = false)
+{
+    return heap->Sync(ptr, async);
+}
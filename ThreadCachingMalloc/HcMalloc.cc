@@ -0,0 +1,157 @@
+// 分配器的全部全局状态，整个程序只有这一份
+// 头文件里只有声明和inline函数，用到内存池的程序都要把这个文件一起编译（见Makefile）
+//
+// 这里的对象都是constinit的：构造函数是constexpr，里面只有0和nullptr，
+// 编译器把它们放进.bss，程序启动时不执行任何构造函数，
+// 所以别的全局对象的构造函数里（main之前）也可以放心地申请内存，不用管初始化顺序。
+// 需要真正初始化的部分都推迟到第一次用到的时候：
+// SpanList的头节点第一次访问时才连成环，PageMap的节点、span描述符、ThreadCache都是用到时才申请
+
+#include "ConcurrentAlloc.hpp"
+#include "AllocTrace.hpp"
+#include "HcHeap.hpp"
+#include "ConcurrentArena.hpp"
+
+constinit PageCache PageCache::_sInst;
+constinit CentralCache CentralCache::_sInt(PageCache::GetInstance());
+constinit std::atomic<size_t> ThreadCache::_sReleaseEpoch{ 0 };
+constinit ThreadCache* ThreadCache::_sCaches = nullptr;
+constinit std::mutex ThreadCache::_sCachesMtx;
+constinit HcTuning HcTuning::_sInst;
+
+constinit thread_local ThreadCache* pTLSThreadCache = nullptr;
+constinit std::mutex tcMtx;
+constinit ObjectPool<ThreadCache> tcPool;
+
+#ifdef HC_GUARDED_SAMPLING
+constinit GuardedPool GuardedPool::_sInst;
+constinit thread_local long tlsGuardedCountdown = 0;
+#endif
+
+constinit AllocTrace AllocTrace::_sInst;
+
+// hc_heap_create创建的堆：每个槽位上现在的堆的编号，0表示空着
+// heapMtx还保护线程退出时把ThreadCache还给堆，保证这时堆不会被同时销毁
+constinit thread_local HeapCacheRef tlsHeapCaches[HC_MAX_HEAPS];
+static constinit std::mutex heapMtx;
+static constinit uint64_t heapGenerations[HC_MAX_HEAPS] = {};
+static constinit uint64_t nextHeapGeneration = 0;
+
+#ifdef HC_GUARDED_SAMPLING
+void* ConcurrentAllocSampled(size_t size)
+{
+    void* ptr = nullptr;
+    tlsGuardedCountdown = GuardedPool::GetInstance()->Sample(size, ptr);
+    return ptr;
+}
+#endif
+
+void* ConcurrentAllocFailed(size_t size, bool newHandler)
+{
+    while (true)
+    {
+        GetThreadCache()->ReleaseAll();
+        ArenaSpanCache::GetInstance()->Drain();
+        ThreadCache::RequestReleaseAll();
+        {
+            std::lock_guard<HcMutex> lock(PageCache::GetInstance()->_pageMtx);
+            PageCache::GetInstance()->ReleaseFreeSpans();
+        }
+
+        void* ptr = ConcurrentAllocImpl(size);
+        if (ptr || !newHandler)
+            return ptr;
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+
+// 线程退出时把它在各个堆上的ThreadCache还掉：堆还在的把缓存的内存还给堆，已经销毁的直接丢掉
+struct HeapCacheReaper
+{
+    ~HeapCacheReaper()
+    {
+        std::lock_guard<std::mutex> heapLock(heapMtx);
+        for (size_t slot = 0; slot < HC_MAX_HEAPS; ++slot)
+        {
+            HeapCacheRef& ref = tlsHeapCaches[slot];
+            if (ref._cache == nullptr)
+                continue;
+
+            if (ref._generation == heapGenerations[slot])
+                ref._cache->ReleaseAll();
+
+            std::lock_guard<std::mutex> lock(tcMtx);
+            tcPool.Delete(ref._cache);
+            ref = HeapCacheRef();
+        }
+    }
+};
+
+ThreadCache* HcHeap::BindThreadCache()
+{
+    // 第一次经过这里时构造，线程退出时析构
+    static thread_local HeapCacheReaper reaper;
+
+    HeapCacheRef& ref = tlsHeapCaches[_slot];
+    {
+        std::lock_guard<std::mutex> lock(tcMtx);
+        if (ref._cache == nullptr)
+            ref._cache = tcPool.New();
+        else
+            new (ref._cache) ThreadCache;   // 上一个用这个槽位的堆已经销毁了，里面缓存的内存早就还给系统了，直接清空
+    }
+    ref._cache->SetCentralCache(&_centralCache);
+    ref._generation = _generation;
+    return ref._cache;
+}
+
+static const size_t HEAP_PAGES = SizeClass::_RoundUp(sizeof(HcHeap), (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+
+HcHeap* hc_heap_create(const HcHeapOptions* options)
+{
+    std::lock_guard<std::mutex> lock(heapMtx);
+    for (size_t slot = 0; slot < HC_MAX_HEAPS; ++slot)
+    {
+        if (heapGenerations[slot] != 0)
+            continue;
+
+        void* mem = nullptr;
+        try
+        {
+            mem = SystemAlloc(HEAP_PAGES);
+        }
+        catch (const std::bad_alloc&)
+        {
+            return nullptr;
+        }
+        HcHeap* heap = new (mem) HcHeap(slot, nextHeapGeneration + 1);
+        if (options && options->_fileBacked && !heap->OpenFileBacking(options->_dir, options->_extentBytes))
+        {
+            heap->~HcHeap();
+            SystemFree(mem, HEAP_PAGES);
+            return nullptr;
+        }
+        heapGenerations[slot] = ++nextHeapGeneration;
+        return heap;
+    }
+    return nullptr;
+}
+
+void hc_heap_destroy(HcHeap* heap)
+{
+    if (heap == nullptr)
+        return;
+
+    {
+        // 编号清掉以后，各线程手里这个堆的ThreadCache都作废了
+        std::lock_guard<std::mutex> lock(heapMtx);
+        heapGenerations[heap->Slot()] = 0;
+    }
+    heap->GetPageCache()->ReleaseAllMemory();
+    heap->~HcHeap();
+    SystemFree(heap, HEAP_PAGES);
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+#include "SpinLock.hpp"
+
+// 锁竞争统计，用来判断该在哪把锁上下功夫
+// 编译时加 -DHC_LOCK_STATS，CentralCache的桶锁和PageCache的_pageMtx换成带统计的HcMutex，
+// 每把锁、每个加锁的位置（LockSite）各自记录：加锁次数、其中需要等待的次数、等待时间的直方图
+// 不加的时候HcMutex就是std::mutex，HC_LOCK(mtx, site)就是mtx.lock()，没有任何额外开销
+// 桶锁的类型是HcBucketMutex：默认是std::mutex，-DHC_SPIN_LOCK 时换成先自旋再睡眠的SpinMutex（SpinLock.hpp）
+// 不等待的加锁只多一次try_lock和两次原子加；需要等待时才读时钟
+// 打印用 DumpLockStats()，清零用 ResetLockStats()（见ConcurrentAlloc.hpp）
+
+// 加锁的位置
+enum LockSite
+{
+    LOCK_SITE_FETCH_RANGE,      // FetchRangeObj：桶锁
+    LOCK_SITE_GET_ONE_SPAN,     // GetOneSpan：从PageCache拿到span后重新加桶锁
+    LOCK_SITE_RELEASE_LIST,     // ReleaseListToSpans：桶锁
+    LOCK_SITE_NEW_SPAN,         // GetOneSpan：向PageCache要span（NewSpan）
+    LOCK_SITE_RELEASE_SPAN,     // ReleaseListToSpans：把空了的span还给PageCache
+    LOCK_SITE_LARGE_ALLOC,      // 大于256KB的申请
+    LOCK_SITE_LARGE_FREE,       // 大于256KB的释放
+    LOCK_SITE_OTHER,            // 其他（arena、堆上限、保护区等）
+    LOCK_SITE_COUNT
+};
+
+static const char* const kLockSiteNames[LOCK_SITE_COUNT] = {
+    "FetchRangeObj", "GetOneSpan", "ReleaseListToSpans", "NewSpan",
+    "ReleaseSpanToPageCache", "LargeAlloc", "LargeFree", "Other"
+};
+
+#ifdef HC_LOCK_STATS
+
+static const size_t LOCK_WAIT_BINS = 24;   // 第i档是等待了[2^i, 2^(i+1))纳秒，最后一档包括更长的
+
+struct LockStats
+{
+    std::atomic<uint64_t> _acquisitions{ 0 };
+    std::atomic<uint64_t> _contended{ 0 };     // try_lock失败、需要等待的次数
+    std::atomic<uint64_t> _waitNs{ 0 };        // 等待的总时间
+    std::atomic<uint64_t> _waitHist[LOCK_WAIT_BINS]{};
+
+    void Record(bool contended, uint64_t waitNs)
+    {
+        _acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (!contended)
+            return;
+
+        _contended.fetch_add(1, std::memory_order_relaxed);
+        _waitNs.fetch_add(waitNs, std::memory_order_relaxed);
+        size_t bin = 0;
+        while (bin + 1 < LOCK_WAIT_BINS && (waitNs >> (bin + 1)) != 0)
+            ++bin;
+        _waitHist[bin].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void Reset()
+    {
+        _acquisitions = 0;
+        _contended = 0;
+        _waitNs = 0;
+        for (auto& n : _waitHist)
+            n = 0;
+    }
+
+    // 一行汇总，有等待的话再打一行直方图（只打不为0的档）
+    void Dump(FILE* fp, const char* name) const
+    {
+        uint64_t acq = _acquisitions.load(std::memory_order_relaxed);
+        uint64_t cont = _contended.load(std::memory_order_relaxed);
+        uint64_t wait = _waitNs.load(std::memory_order_relaxed);
+        if (acq == 0)
+            return;
+
+        fprintf(fp, "%-24s 加锁: %10llu  等待: %10llu (%5.1f%%)  平均等待: %8.0f ns  总等待: %8.2f ms\n",
+            name, (unsigned long long)acq, (unsigned long long)cont, 100.0 * cont / acq,
+            cont ? (double)wait / cont : 0.0, wait / 1e6);
+        if (cont == 0)
+            return;
+
+        fprintf(fp, "%-24s", "");
+        for (size_t i = 0; i < LOCK_WAIT_BINS; ++i)
+        {
+            uint64_t n = _waitHist[i].load(std::memory_order_relaxed);
+            if (n)
+                fprintf(fp, " <%lluns:%llu", 2ULL << i, (unsigned long long)n);
+        }
+        fprintf(fp, "\n");
+    }
+};
+
+// 每个加锁位置的统计，所有翻译单元共用一份
+inline LockStats& LockSiteStats(LockSite site)
+{
+    static LockStats sSites[LOCK_SITE_COUNT];
+    return sSites[site];
+}
+
+// 带统计的互斥锁，可以直接给std::lock_guard用（算作LOCK_SITE_OTHER）
+template <class Mutex>
+class InstrumentedMutex
+{
+private:
+    Mutex _mtx;
+    LockStats _stats;
+public:
+    void lock()
+    {
+        lock(LOCK_SITE_OTHER);
+    }
+
+    void lock(LockSite site)
+    {
+        bool contended = !_mtx.try_lock();
+        uint64_t waitNs = 0;
+        if (contended)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            _mtx.lock();
+            waitNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        }
+        _stats.Record(contended, waitNs);
+        LockSiteStats(site).Record(contended, waitNs);
+    }
+
+    bool try_lock()
+    {
+        if (!_mtx.try_lock())
+            return false;
+        _stats.Record(false, 0);
+        return true;
+    }
+
+    void unlock()
+    {
+        _mtx.unlock();
+    }
+
+    LockStats& Stats()
+    {
+        return _stats;
+    }
+};
+
+#ifdef HC_SPIN_LOCK
+typedef InstrumentedMutex<SpinMutex> HcBucketMutex;
+#else
+typedef InstrumentedMutex<std::mutex> HcBucketMutex;
+#endif
+typedef InstrumentedMutex<std::mutex> HcMutex;
+
+#define HC_LOCK(mtx, site) (mtx).lock(site)
+
+#else
+
+#ifdef HC_SPIN_LOCK
+typedef SpinMutex HcBucketMutex;
+#else
+typedef std::mutex HcBucketMutex;
+#endif
+typedef std::mutex HcMutex;
+
+#define HC_LOCK(mtx, site) (mtx).lock()
+
+#endif
@@ -1,5 +1,6 @@
 #pragma once
-#include <iostream>
+#include <new>
+#include <cstdlib>
 
 // 定长内存池
 
@@ -10,6 +11,9 @@ private:
     char *_memory = nullptr;   // 大块的内存空间
     void *_freelist = nullptr; // 链表，管理还回来的内存块
     size_t _remainBytes = 0;      // 剩下的空间
+    void *_chunks = nullptr;   // 申请过的所有大块，每块的最后一个指针指向上一块，ReleaseAll时一起释放
+
+    static const size_t CHUNK_BYTES = 128 * 1024;
 public:
     T *New()
     {
@@ -24,12 +28,14 @@ public:
         {
             if (_remainBytes < sizeof(T))
             {
-                _remainBytes = 128 * 1024;
-                _memory = (char *)malloc(_remainBytes); // 开辟128KB
+                _memory = (char *)malloc(CHUNK_BYTES); // 开辟128KB
                 if (_memory == nullptr)
                 {
                     throw std::bad_alloc();
                 }
+                _remainBytes = CHUNK_BYTES - sizeof(void *);
+                *(void **)(_memory + _remainBytes) = _chunks;
+                _chunks = _memory;
             }
 
             obj = (T *)_memory;
@@ -53,4 +59,18 @@ public:
         *(void**)obj = _freelist;
         _freelist = obj; 
     }
+
+    // 释放所有大块，New出来的对象全部作废（不调用析构函数）
+    void ReleaseAll()
+    {
+        while (_chunks != nullptr)
+        {
+            void *next = *(void **)((char *)_chunks + CHUNK_BYTES - sizeof(void *));
+            free(_chunks);
+            _chunks = next;
+        }
+        _memory = nullptr;
+        _freelist = nullptr;
+        _remainBytes = 0;
+    }
 };
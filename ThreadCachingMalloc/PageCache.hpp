@@ -2,26 +2,62 @@
 
 #include "Common.hpp"
 #include "ObjectPool.hpp"
-
-// PageCache 也是只能有一份，也要使用单例模式
+#include "PageMap.hpp"
+#include "FileBacking.hpp"
+#include "Tuning.hpp"
+#ifdef HC_SEGMENTS
+#include "Segment.hpp"
+#endif
+
+// 默认的堆（ConcurrentAlloc）用的PageCache是单例；hc_heap_create创建的每个堆也各有一个（见HcHeap.hpp）
+// 向系统申请的内存都从这里过，可以设置上限（SetHeapLimit）：
+// 超过软上限时，PageCache里空闲的span直接还给系统，并且要求所有线程把ThreadCache还掉（PressureEpoch）；
+// 到了硬上限就不再向系统申请，NewSpan返回nullptr，由ConcurrentAlloc调用new_handler或者hc_malloc返回nullptr
+// 默认的PageCache还可以限制留着的空闲页（page_cache_max_free_bytes，见Tuning.hpp），多出来的还给系统
 class PageCache
 {
 private:
     SpanList _spanLists[NPAGES];        // 哈希桶
-    std::unordered_map<PAGE_ID, Span*> _idSpanMap; // 页号到SPan的映射，用于内存回收
+    size_t _freePages = 0;              // _spanLists上一共挂着多少页
+#ifdef HC_SEGMENTS
+    SpanMap _idSpanMap;                 // 页号到Span的映射：默认的堆按段头查（见Segment.hpp），别的堆按页号映射查
+#else
+    PageMap _idSpanMap;                 // 页号到Span的映射，用于内存回收和释放时查大小类
+#endif
     ObjectPool<Span> _spanPool;
-private:
-    PageCache()
+    std::atomic<size_t> _mappedBytes{ 0 };      // 当前向系统申请了多少字节
+    std::atomic<size_t> _softLimit{ 0 };        // 0表示不限
+    std::atomic<size_t> _hardLimit{ 0 };
+    std::atomic<size_t> _pressureEpoch{ 0 };    // 每次碰到软上限加一
+    bool _isolated = false;             // 是不是hc_heap_create创建的堆
+    SpanList _regions;                  // _isolated时记下向系统申请的每一块内存（大块的span就是它自己），销毁时一次还掉
+    FileBacking* _file = nullptr;       // 不为空时页从文件映射来，不记_regions，销毁时整个文件一起关掉
+    SpanList _largeSpans;               // _file时超过128页的空闲span：不能还给系统，整块留着（还和相邻的合并），NewSpan按首次适配找
+
+    static PageCache _sInst;        // 常量初始化，定义在HcMalloc.cc
+public:
+    // isolated为true时是hc_heap_create创建的堆：不设上限，空闲的span不还给系统，销毁时按_regions整块还回去
+    constexpr explicit PageCache(bool isolated = false)
+#ifdef HC_SEGMENTS
+        : _idSpanMap(!isolated), _isolated(isolated)
+#else
+        : _isolated(isolated)
+#endif
     {}
     PageCache(const PageCache&) = delete;
 
-    static PageCache _sInst;
-public:
+    // 改成从文件映射页，只能在刚创建、还没有申请过内存时调用
+    void SetFileBacking(FileBacking* file)
+    {
+        assert(_isolated && _mappedBytes.load() == 0);
+        _file = file;
+    }
+
     // 整个PageCache的锁，而不是桶锁，因为有时需要同时访问多个桶
-    std::mutex _pageMtx;
+    HcMutex _pageMtx;
 
     // 获取单例对象
-    static PageCache* GetInstance()
+    static constexpr PageCache* GetInstance()
     {
         return &_sInst;
     }
@@ -34,14 +70,36 @@ public:
         // 大于32页(256KB)的直接向PageCache申请，如果它还大于128页，那就向系统堆申请
         if (k > NPAGES - 1)
         {
-            void* ptr = SystemAlloc(k);
+            // 文件映射的堆先用还回来的大块，不够再让文件变长
+            if (_file)
+            {
+                Span* span = TakeLargeSpan(k);
+                if (span)
+                {
+                    // 尾页也登记上：后面的空闲span合并时查到的是它，而不是这段页以前的旧映射
+                    _idSpanMap.Set(span->_pageId, span);
+                    _idSpanMap.Set(span->_pageId + span->_n - 1, span);
+                    return span;
+                }
+            }
+
+            void* ptr = MapPages(k);
+            if (ptr == nullptr)
+                return nullptr;
             // Span* span = new Span;
             Span* span = _spanPool.New();
             span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
             span->_n = k;
+            if (_isolated && !_file)
+                _regions.PushFront(span);
 
             // 方便后续释放内存
-            _idSpanMap[span->_pageId] = span;
+            _idSpanMap.Set(span->_pageId, span);
+#ifdef HC_SEGMENTS
+            _idSpanMap.SetLarge(span);
+#endif
+            if (_file)
+                _idSpanMap.Set(span->_pageId + span->_n - 1, span);
             return span;
         }
 
@@ -49,11 +107,12 @@ public:
         if (!_spanLists[k].Empty())
         {
             // 给出Span的时候，也需要在_idSpanMap里缓存
-            Span* kSpan = _spanLists[k].PopFront();      // -----------------------
+            Span* kSpan = PopFreeSpan(k);
+            kSpan->_sizeClass = 0;
 
             for (PAGE_ID  i = 0; i < kSpan->_n; ++i)
             {
-                _idSpanMap[kSpan->_pageId + i] = kSpan;
+                _idSpanMap.Set(kSpan->_pageId + i, kSpan);
             }
 
             return kSpan;
@@ -65,7 +124,7 @@ public:
             if (!_spanLists[i].Empty())
             {
                 // 切分
-                Span* nSpan = _spanLists[i].PopFront();
+                Span* nSpan = PopFreeSpan(i);
                 // Span* kSpan = new Span;
                 Span* kSpan = _spanPool.New();
 
@@ -77,16 +136,16 @@ public:
                 nSpan->_n -= k;
 
                 // 把nSpan再挂回去
-                _spanLists[nSpan->_n].PushFront(nSpan);
+                PushFreeSpan(nSpan);
 
                 // 存储nSpan的首尾页号跟nSpan映射，方便page cache回收内存时进行的合并查找
-                _idSpanMap[nSpan->_pageId] = nSpan;
-                _idSpanMap[nSpan->_pageId + nSpan->_n - 1] = nSpan;
+                _idSpanMap.Set(nSpan->_pageId, nSpan);
+                _idSpanMap.Set(nSpan->_pageId + nSpan->_n - 1, nSpan);
 
                 // 建立页号和span的映射，方便将小块内存放回Span时查找span
                 for (PAGE_ID  i = 0; i < kSpan->_n; ++i)
                 {
-                    _idSpanMap[kSpan->_pageId + i] = kSpan;
+                    _idSpanMap.Set(kSpan->_pageId + i, kSpan);
                 }
 
                 // 返回kSpan
@@ -97,50 +156,245 @@ public:
         // 到这里证明后面已经没有更多页的span了，需要向堆申请。
         // 向堆申请128页的大块span(128 * 8KB = 1024KB = 1MB)
         // Span* bigSpan = new Span;
+        // 快到硬上限时一整块申请不下来，只申请k页
+#ifdef HC_SEGMENTS
+        // 默认的堆一次申请一整段，段头后面的511页切成不超过128页的几个空闲span挂上；
+        // 快到硬上限时一整段申请不下来，只申请段头加k页
+        if (!_isolated)
+        {
+            size_t npage = SEGMENT_PAGES - 1;
+            void* segment = MapPages(npage);
+            if (segment == nullptr)
+            {
+                npage = k;
+                segment = MapPages(npage);
+                if (segment == nullptr)
+                    return nullptr;
+            }
+            AddFreePages(segment, npage);
+            return NewSpan(k);
+        }
+#endif
+        // 文件映射的堆：还回来的大块切128页下来用，不让文件变长
+        if (_file)
+        {
+            Span* span = TakeLargeSpan(NPAGES - 1);
+            if (span)
+            {
+                PushFreeSpan(span);
+                _idSpanMap.Set(span->_pageId, span);
+                _idSpanMap.Set(span->_pageId + span->_n - 1, span);
+                return NewSpan(k);
+            }
+        }
+
+        size_t npage = NPAGES - 1;
+        void* ptr = MapPages(npage);
+        if (ptr == nullptr)
+        {
+            npage = k;
+            ptr = MapPages(npage);
+            if (ptr == nullptr)
+                return nullptr;
+        }
         Span* bigSpan = _spanPool.New();
-        void* ptr = SystemAlloc(NPAGES - 1);
         bigSpan->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
-        bigSpan->_n = NPAGES - 1;
+        bigSpan->_n = npage;
+        if (_isolated && !_file)
+        {
+            Span* region = _spanPool.New();
+            region->_pageId = bigSpan->_pageId;
+            region->_n = npage;
+            _regions.PushFront(region);
+        }
 
         // 挂到spanLists上去
-        _spanLists[bigSpan->_n].PushFront(bigSpan);
+        PushFreeSpan(bigSpan);
 
         // 此时虽然已经有大块内存了，但是还是要返回一个K页的Span
         // 为了避免代码重复，直接递归调用
         return NewSpan(k);
     }
 
-    // 计算一个内存块应该属于哪个Span
-    Span* MapObjectToSpan(void* obj)
+    // 把直接向系统申请的大块span（超过128页）改成k页（也超过128页），调用时持有_pageMtx
+    // 用mremap让内核搬页表，内容不用拷贝：后面的地址空着就原地变长，否则挪到别处
+    // 文件映射来的span、超过硬上限或者系统不支持时返回false，span不变，由调用方重新申请再拷贝
+    bool ResizeLargeSpan(Span* span, size_t k)
     {
-        // 先计算页号
-        PAGE_ID id = (PAGE_ID)obj >> PAGE_SHIFT;
+#if defined(__linux__)
+        assert(span->_n > NPAGES - 1 && k > NPAGES - 1);
+        if (_file)
+            return false;
+#ifdef HC_SEGMENTS
+        // 搬走以后起始地址就不在段头后面了
+        if (!_isolated)
+            return false;
+#endif
+
+        size_t oldBytes = (size_t)span->_n << PAGE_SHIFT;
+        size_t newBytes = k << PAGE_SHIFT;
+        size_t hard = _hardLimit.load(std::memory_order_relaxed);
+        if (newBytes > oldBytes && hard != 0 && _mappedBytes.load(std::memory_order_relaxed) + newBytes - oldBytes > hard)
+            return false;
+
+        void* old = (void*)(span->_pageId << PAGE_SHIFT);
+        void* ptr = mremap(old, oldBytes, newBytes, 0);
+        if (ptr == MAP_FAILED)
+        {
+            // mremap挪的位置只按系统页(4KB)对齐：和SystemAlloc一样先占一段多一页的地址，再让它把页表搬到对齐的位置上
+            size_t align = (size_t)1 << PAGE_SHIFT;
+            char* reserve = (char*)mmap(nullptr, newBytes + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (reserve == MAP_FAILED)
+                return false;
+            char* target = (char*)SizeClass::_RoundUp((size_t)reserve, align);
+            ptr = mremap(old, oldBytes, newBytes, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+            if (ptr == MAP_FAILED)
+            {
+                munmap(reserve, newBytes + align);
+                return false;
+            }
+            if (target != reserve)
+                munmap(reserve, target - reserve);
+            if (reserve + align != target)
+                munmap(target + newBytes, reserve + align - target);
+        }
 
-        std::unique_lock<std::mutex> lock(_pageMtx);
+        _idSpanMap.Erase(span->_pageId);
+        span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
+        span->_n = k;
+        _idSpanMap.Set(span->_pageId, span);
+        if (newBytes > oldBytes)
+            _mappedBytes += newBytes - oldBytes;
+        else
+            _mappedBytes -= oldBytes - newBytes;
+        HC_PROBE3(pc_remap, oldBytes >> PAGE_SHIFT, k, ptr);
+        return true;
+#else
+        return false;
+#endif
+    }
 
-        // 在_idSpanMap中去找
-        auto ret = _idSpanMap.find(id);
-        if (ret != _idSpanMap.end())
+    // 预热：空闲链表上的页不到bytes字节时向系统申请，按128页一块挂上，页提前摸一遍；到了上限时提前停下
+    // 调用时不持有_pageMtx
+    void Reserve(size_t bytes)
+    {
+        size_t npage = NPAGES - 1;
+#ifdef HC_SEGMENTS
+        if (!_isolated)
+            npage = SEGMENT_PAGES - 1;
+#endif
+        for (size_t have = FreeBytes(); have < bytes; have += npage << PAGE_SHIFT)
         {
-            return ret->second;
+            std::lock_guard<HcMutex> lock(_pageMtx);
+            void* ptr = MapPages(npage);
+            if (ptr == nullptr)
+                break;
+            SystemPopulate(ptr, npage);
+#ifdef HC_SEGMENTS
+            if (!_isolated)
+            {
+                AddFreePages(ptr, npage);
+                continue;
+            }
+#endif
+
+            Span* span = _spanPool.New();
+            span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
+            span->_n = NPAGES - 1;
+            if (_isolated && !_file)
+            {
+                Span* region = _spanPool.New();
+                region->_pageId = span->_pageId;
+                region->_n = span->_n;
+                _regions.PushFront(region);
+            }
+            PushFreeSpan(span);
+            _idSpanMap.Set(span->_pageId, span);
+            _idSpanMap.Set(span->_pageId + span->_n - 1, span);
         }
-        else
+    }
+
+    // 空闲链表上挂着的页一共多少字节，调用时不持有_pageMtx
+    size_t FreeBytes()
+    {
+        std::lock_guard<HcMutex> lock(_pageMtx);
+        return _freePages << PAGE_SHIFT;
+    }
+
+    // 登记一段不由PageCache切分的内存（例如采样保护区），让MapObjectToSpan能找到它
+    // 这种span一直标记为使用中，不会和相邻的span合并
+    Span* NewExternalSpan(void* ptr, size_t kpage)
+    {
+        Span* span = _spanPool.New();
+        span->_pageId = (PAGE_ID)ptr >> PAGE_SHIFT;
+        span->_n = kpage;
+        span->_isUse = true;
+
+        for (PAGE_ID i = 0; i < span->_n; ++i)
         {
-            // 正常情况下都找得到
-            assert(false);
-            return nullptr;
+            _idSpanMap.Set(span->_pageId + i, span);
+        }
+        return span;
+    }
+
+    // 把span交给CentralCache切小块时调用，index是大小类下标；调用方需要持有_pageMtx
+    void SetSizeClass(Span* span, size_t index)
+    {
+        span->_sizeClass = (uint16_t)(index + 1);
+        for (PAGE_ID i = 0; i < span->_n; ++i)
+        {
+            _idSpanMap.Set(span->_pageId + i, span, span->_sizeClass);
         }
     }
 
+    // 计算一个内存块应该属于哪个Span
+    // 不加锁：对象所在页的映射在对象交出去之前就写好了，对象还回来之前不会变
+    Span* MapObjectToSpan(void* obj)
+    {
+        // 先计算页号
+        PAGE_ID id = (PAGE_ID)obj >> PAGE_SHIFT;
+
+        Span* span = _idSpanMap.Get(id);
+        // 正常情况下都找得到
+        assert(span != nullptr);
+        return span;
+    }
+
+    // 内存块所在span的大小类下标+1，不是小对象返回0；和MapObjectToSpan一样不加锁
+    size_t MapObjectToSizeClass(void* obj)
+    {
+        return _idSpanMap.GetSizeClass((PAGE_ID)obj >> PAGE_SHIFT);
+    }
+
     // 将Span挂回PageCache，但是由于Span有可能都被切成小块的，为了避免内存碎片
     // 将可以合并的Span合并后再挂到PageCache上
     void ReleaseSpanToPageCache(Span* span)
     {
+        // 文件映射来的大块不能单独解除映射（会在映射中间留下别人能用的空洞），
+        // 和别的span一样合并、挂起来：超过128页的挂到_largeSpans上，以后的大块和128页的span从这里切；
+        // 合并完够FILE_DISCARD_PAGES页的在文件里打洞（见下面）
         // 大于128页直接释放给堆
-        if (span->_n > NPAGES - 1)
+#ifdef HC_SEGMENTS
+        // 大块单独占一段，连段头一起还掉；段头上的映射要在还之前去掉
+        if (span->_n > NPAGES - 1 && !_isolated)
+        {
+            _idSpanMap.Erase(span->_pageId);
+            _idSpanMap.EraseLarge(span);
+            _mappedBytes -= SegmentRelease((void*)(span->_pageId << PAGE_SHIFT), span->_n) << PAGE_SHIFT;
+            _spanPool.Delete(span);
+            return;
+        }
+#endif
+        if (span->_n > NPAGES - 1 && !_file)
         {
             void* ptr = (void*)(span->_pageId << PAGE_SHIFT);
-            SystemFree(ptr);
+            if (_isolated)
+                _regions.Erase(span);
+            SystemFree(ptr, span->_n);
+            _mappedBytes -= (size_t)span->_n << PAGE_SHIFT;
+
+            // 地址还给系统以后可能被重新映射给别的span，映射不能留着
+            _idSpanMap.Erase(span->_pageId);
 
             //delete span;
             _spanPool.Delete(span);
@@ -149,38 +403,44 @@ public:
         }
 
         // 尝试向前和向后合并，解决内存碎片问题
+        uint32_t releasedPages = span->_n;
+        // 文件映射的堆合并完要打洞的范围：这次还回来的页，加上合并进来的还没打过洞的小span
+        // 够FILE_DISCARD_PAGES页的空闲span都打过洞，合并时不用再打一遍
+        PAGE_ID discardBegin = span->_pageId;
+        PAGE_ID discardEnd = span->_pageId + span->_n;
         // 向前合并
         while (1)
         {
             // 计算PageID
             PAGE_ID id = span->_pageId - 1;
             // 在_idSpanMap中找对应的Span
-            auto ret = _idSpanMap.find(id);
+            Span* prevSpan = _idSpanMap.Get(id);
 
             // 前面的页号没找到对应的Span，不合并
-            if (ret == _idSpanMap.end())
+            if (prevSpan == nullptr)
             {
                 break;
             }
 
-            Span* prevSpan = ret->second;
             // 前面的Span正在被使用，不合并
             if (prevSpan->_isUse == true)
             {
                 break;
             }
 
-            // 超出128页，无法管理，不合并
-            if (prevSpan->_n + span->_n > NPAGES - 1)
+            // 超出128页，无法管理，不合并（文件映射的堆有_largeSpans，不限）
+            if (prevSpan->_n + span->_n > NPAGES - 1 && !_file)
             {
                 break;
             }
 
             // 到这里说明可以合并
+            if (prevSpan->_n < FILE_DISCARD_PAGES)
+                discardBegin = prevSpan->_pageId;
             span->_n += prevSpan->_n;
             span->_pageId = prevSpan->_pageId;
 
-            _spanLists[prevSpan->_n].Erase(prevSpan);
+            EraseFreeSpan(prevSpan);
 
             //// 删掉prevSpan，还有因为span都是new出来的，不要忘记delete
             ////delete prevSpan;
@@ -192,36 +452,266 @@ public:
         while (1)
         {
             PAGE_ID id = span->_pageId + span->_n;
-            auto ret = _idSpanMap.find(id);
-            if (ret == _idSpanMap.end())
+            Span* nextSpan = _idSpanMap.Get(id);
+            if (nextSpan == nullptr)
             {
                 break;
             }
 
-            Span* nextSpan = ret->second;
             if (nextSpan->_isUse == true)
             {
                 break;
             }
 
-            if (span->_n + nextSpan->_n > NPAGES - 1)
+            if (span->_n + nextSpan->_n > NPAGES - 1 && !_file)
             {
                 break;
             }
 
             // 合并
+            if (nextSpan->_n < FILE_DISCARD_PAGES)
+                discardEnd = nextSpan->_pageId + nextSpan->_n;
             span->_n += nextSpan->_n;
 
-            _spanLists[nextSpan->_n].Erase(nextSpan);
+            EraseFreeSpan(nextSpan);
             _spanPool.Delete(nextSpan);
         }
 
-        // 将合并后的span挂上，并且为了以后方便合并，将前后PAGE_ID加进_idSpanMap
-        _spanLists[span->_n].PushFront(span);
         span->_isUse = false;
-        _idSpanMap[span->_pageId] = span;
-        _idSpanMap[span->_pageId + span->_n - 1] = span;
+        HC_PROBE3(pc_coalesce, span->_pageId, releasedPages, span->_n);
+
+        if (_file && span->_n >= FILE_DISCARD_PAGES)
+            _file->Discard((void*)(discardBegin << PAGE_SHIFT), discardEnd - discardBegin);
+
+        // 超过软上限时不留着，直接还给系统
+        size_t soft = _softLimit.load(std::memory_order_relaxed);
+        if (soft != 0 && _mappedBytes.load(std::memory_order_relaxed) > soft)
+        {
+            UnmapSpan(span);
+            return;
+        }
+
+        // 将合并后的span挂上，并且为了以后方便合并，将前后PAGE_ID加进_idSpanMap
+        PushFreeSpan(span);
+        _idSpanMap.Set(span->_pageId, span);
+        _idSpanMap.Set(span->_pageId + span->_n - 1, span);
+
+        // 空闲的页超过了page_cache_max_free_bytes，多出来的还给系统（先还大的）
+        // 新申请的一整块剩下的页没经过这里，也一起算进去
+        size_t maxFree = HcTuning::GetInstance()->_pageCacheMaxFreeBytes.load(std::memory_order_relaxed);
+        if (maxFree != 0 && !_isolated && (_freePages << PAGE_SHIFT) > maxFree)
+            ReleaseFreeSpans(maxFree);
     }
-};
 
-PageCache PageCache::_sInst;
\ No newline at end of file
+    // 设置软、硬上限（字节），0表示不限。调用时不能持有_pageMtx
+    void SetHeapLimit(size_t soft, size_t hard)
+    {
+        assert(!_isolated);
+        _softLimit.store(soft);
+        _hardLimit.store(hard);
+
+        std::lock_guard<HcMutex> lock(_pageMtx);
+        if (soft != 0 && _mappedBytes.load() > soft)
+        {
+            ++_pressureEpoch;
+            ReleaseFreeSpans();
+        }
+    }
+
+    // 把空闲的span还给系统，直到只剩下不超过keepBytes字节（先还大的），返回还了多少字节，调用方需要持有_pageMtx
+    size_t ReleaseFreeSpans(size_t keepBytes = 0)
+    {
+        size_t bytes = 0;
+        for (size_t i = NPAGES - 1; i > 0; --i)
+        {
+            while (!_spanLists[i].Empty() && (_freePages << PAGE_SHIFT) > keepBytes)
+            {
+                Span* span = PopFreeSpan(i);
+                bytes += (size_t)span->_n << PAGE_SHIFT;
+                UnmapSpan(span);
+            }
+        }
+        return bytes;
+    }
+
+    size_t MappedBytes() const
+    {
+        return _mappedBytes.load(std::memory_order_relaxed);
+    }
+
+    // ThreadCache在慢路径上检查它，变了就把自己整个还掉
+    size_t PressureEpoch() const
+    {
+        return _pressureEpoch.load(std::memory_order_relaxed);
+    }
+
+    // 销毁堆：按_regions把向系统申请的内存整块还回去，不用看里面的span和对象
+    // 页号映射的节点、span描述符也一起释放，之后这个PageCache不能再用
+    void ReleaseAllMemory()
+    {
+        assert(_isolated);
+        if (_file)
+            _file->Close();
+        while (!_regions.Empty())
+        {
+            Span* region = _regions.PopFront();
+            SystemFree((void*)(region->_pageId << PAGE_SHIFT), region->_n);
+        }
+        _idSpanMap.ReleaseNodes();
+        _spanPool.ReleaseAll();
+        _mappedBytes = 0;
+        _freePages = 0;
+    }
+
+private:
+    // 向系统申请k页，超过软上限时先把空闲的span还给系统，超过硬上限或者系统申请失败时返回nullptr
+    void* MapPages(size_t k)
+    {
+        // 第一次向系统要内存时读一下HCMALLOC_*环境变量
+        HcTuning::GetInstance()->LoadEnvironment();
+
+        size_t bytes = k << PAGE_SHIFT;
+#ifdef HC_SEGMENTS
+        // 默认的堆按段申请，段头多占一页
+        if (!_isolated)
+            bytes += (size_t)1 << PAGE_SHIFT;
+#endif
+        size_t soft = _softLimit.load(std::memory_order_relaxed);
+        size_t hard = _hardLimit.load(std::memory_order_relaxed);
+
+        if (soft != 0 && _mappedBytes.load(std::memory_order_relaxed) + bytes > soft)
+        {
+            ++_pressureEpoch;
+            ReleaseFreeSpans();
+        }
+        if (hard != 0 && _mappedBytes.load(std::memory_order_relaxed) + bytes > hard)
+        {
+            return nullptr;
+        }
+
+        void* ptr = nullptr;
+        if (_file)
+        {
+            // 文件要再长一段时，上一段剩下的尾巴当成还回来的页挂上（和前面的空闲span合并），不然就再也用不上了
+            size_t tailPages = 0;
+            void* tail = _file->TakeTail(k, tailPages);
+            if (tail)
+            {
+                Span* span = _spanPool.New();
+                span->_pageId = (PAGE_ID)tail >> PAGE_SHIFT;
+                span->_n = (uint32_t)tailPages;
+                _mappedBytes += tailPages << PAGE_SHIFT;
+                ReleaseSpanToPageCache(span);
+            }
+            ptr = _file->Map(k);
+            if (ptr == nullptr)
+                return nullptr;
+        }
+        else
+        {
+            try
+            {
+#ifdef HC_SEGMENTS
+                ptr = _isolated ? SystemAlloc(k) : SegmentAlloc(k);
+#else
+                ptr = SystemAlloc(k);
+#endif
+            }
+            catch (const std::bad_alloc&)
+            {
+                return nullptr;
+            }
+        }
+        _mappedBytes += bytes;
+        HC_PROBE2(pc_sys_alloc, k, ptr);
+        return ptr;
+    }
+
+#ifdef HC_SEGMENTS
+    // 刚申请的一段：切成不超过128页的空闲span挂上，首尾页号登记到段头上
+    void AddFreePages(void* ptr, size_t kpage)
+    {
+        PAGE_ID id = (PAGE_ID)ptr >> PAGE_SHIFT;
+        while (kpage > 0)
+        {
+            Span* span = _spanPool.New();
+            span->_pageId = id;
+            span->_n = (uint32_t)std::min(kpage, NPAGES - 1);
+            PushFreeSpan(span);
+            _idSpanMap.Set(span->_pageId, span);
+            _idSpanMap.Set(span->_pageId + span->_n - 1, span);
+            id += span->_n;
+            kpage -= span->_n;
+        }
+    }
+#endif
+
+    // 从_largeSpans上首次适配一个至少k页的span，从头上切k页返回，剩下的挂回去；没有时返回nullptr
+    // 返回的span的页号映射由调用方设
+    Span* TakeLargeSpan(size_t k)
+    {
+        Span* large = _largeSpans.Begin();
+        while (large != _largeSpans.End() && large->_n < k)
+            large = large->_next;
+        if (large == _largeSpans.End())
+            return nullptr;
+
+        EraseFreeSpan(large);
+        if (large->_n == k)
+            return large;
+
+        Span* span = _spanPool.New();
+        span->_pageId = large->_pageId;
+        span->_n = (uint32_t)k;
+        large->_pageId += k;
+        large->_n -= (uint32_t)k;
+        PushFreeSpan(large);
+        _idSpanMap.Set(large->_pageId, large);
+        return span;
+    }
+
+    // 空闲链表的进出都走这几个函数，顺便记下一共挂着多少页；超过128页的（只有文件映射的堆有）在_largeSpans上
+    void PushFreeSpan(Span* span)
+    {
+        if (span->_n > NPAGES - 1)
+            _largeSpans.PushFront(span);
+        else
+            _spanLists[span->_n].PushFront(span);
+        _freePages += span->_n;
+    }
+
+    Span* PopFreeSpan(size_t k)
+    {
+        Span* span = _spanLists[k].PopFront();
+        _freePages -= span->_n;
+        return span;
+    }
+
+    void EraseFreeSpan(Span* span)
+    {
+        if (span->_n > NPAGES - 1)
+            _largeSpans.Erase(span);
+        else
+            _spanLists[span->_n].Erase(span);
+        _freePages -= span->_n;
+    }
+
+    // 把一个空闲的span还给系统，它的页号映射也要全部去掉：
+    // 这段地址以后可能被重新映射，留下的映射会让相邻的span合并到一个已经不存在的span上
+    void UnmapSpan(Span* span)
+    {
+        // 堆的内存按_regions整块还，不能只还一部分
+        assert(!_isolated);
+        for (PAGE_ID i = 0; i < span->_n; ++i)
+        {
+            _idSpanMap.Erase(span->_pageId + i);
+        }
+#ifdef HC_SEGMENTS
+        _mappedBytes -= SegmentRelease((void*)(span->_pageId << PAGE_SHIFT), span->_n) << PAGE_SHIFT;
+#else
+        SystemRelease((void*)(span->_pageId << PAGE_SHIFT), span->_n);
+        _mappedBytes -= (size_t)span->_n << PAGE_SHIFT;
+#endif
+        _spanPool.Delete(span);
+    }
+};
@@ -209,4 +209,119 @@ public:
 
 	void PreallocateMoreMemory() {
 	}
-};
\ No newline at end of file
+};
+// 内存池用的页号映射：两层，页号 -> Span*，另外每一页记一个大小类
+// 大小类和Span*放在同一个叶子里，不带大小的释放只读叶子就知道是哪个桶，不用再去摸Span
+// 查一次是两次前后依赖的读：根数组里的一项，再是叶子里这一页的大小类。根数组的一项管256MB，
+// 一个缓存行管2GB，基本一直在缓存里，存活对象多、释放顺序乱时不命中的一般只有叶子这一次；
+// 要用Span的（大块、采样的对象、还回CentralCache时）还要再读一次Span，描述符在ObjectPool的块里，不按地址排
+// 读不加锁：只有持有PageCache::_pageMtx时才写，一个对象交给用户之前，它所在页的映射已经写好了
+// 根数组(64位下8MB)和叶子都是第一次用到时用SystemAlloc申请的，没碰过的页不占物理内存；
+// 对象里只放根数组的指针，零初始化就能用，hc_heap_create的每个堆也不用多带几MB
+struct Span;
+
+class PageMap
+{
+private:
+#if defined(_WIN64) || defined(__LP64__)
+	static const int BITS = 48 - PAGE_SHIFT;        // 用户态地址最多48位
+#else
+	static const int BITS = 32 - PAGE_SHIFT;
+#endif
+	static const int LEAF_BITS = BITS < 15 ? BITS : 15;
+	static const int LEAF_LENGTH = 1 << LEAF_BITS;
+	static const int ROOT_BITS = BITS - LEAF_BITS;
+	static const size_t ROOT_LENGTH = (size_t)1 << ROOT_BITS;
+
+	struct Leaf
+	{
+		Span* _spans[LEAF_LENGTH];
+		uint16_t _sizeClasses[LEAF_LENGTH];     // 小对象span是大小类下标+1，其他是0
+		Leaf* _next;                            // 申请过的叶子串起来，ReleaseNodes不用扫整个根数组
+	};
+
+	Leaf** _root = nullptr;
+	Leaf* _leaves = nullptr;
+
+	Leaf* FindLeaf(PAGE_ID id) const
+	{
+		if ((id >> BITS) > 0 || _root == nullptr)
+			return nullptr;
+		return _root[id >> LEAF_BITS];
+	}
+
+	// 确保id所在的叶子存在
+	Leaf* EnsureLeaf(PAGE_ID id)
+	{
+		assert((id >> BITS) == 0);
+		if (_root == nullptr)
+			_root = (Leaf**)NewNode(ROOT_LENGTH * sizeof(Leaf*));
+
+		Leaf*& leaf = _root[id >> LEAF_BITS];
+		if (leaf == nullptr)
+		{
+			leaf = (Leaf*)NewNode(sizeof(Leaf));
+			leaf->_next = _leaves;
+			_leaves = leaf;
+		}
+		return leaf;
+	}
+
+	// mmap出来的内存本来就是0
+	static size_t NodePages(size_t bytes)
+	{
+		return SizeClass::_RoundUp(bytes, (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+	}
+
+	static void* NewNode(size_t bytes)
+	{
+		return SystemAlloc(NodePages(bytes));
+	}
+
+public:
+	Span* Get(PAGE_ID id) const
+	{
+		Leaf* leaf = FindLeaf(id);
+		return leaf ? leaf->_spans[id & (LEAF_LENGTH - 1)] : nullptr;
+	}
+
+	// 大小类下标+1，不是小对象的span返回0
+	size_t GetSizeClass(PAGE_ID id) const
+	{
+		Leaf* leaf = FindLeaf(id);
+		return leaf ? leaf->_sizeClasses[id & (LEAF_LENGTH - 1)] : 0;
+	}
+
+	void Set(PAGE_ID id, Span* span, size_t sizeClass = 0)
+	{
+		Leaf* leaf = EnsureLeaf(id);
+		leaf->_spans[id & (LEAF_LENGTH - 1)] = span;
+		leaf->_sizeClasses[id & (LEAF_LENGTH - 1)] = (uint16_t)sizeClass;
+	}
+
+	void Erase(PAGE_ID id)
+	{
+		Leaf* leaf = FindLeaf(id);
+		if (leaf)
+		{
+			leaf->_spans[id & (LEAF_LENGTH - 1)] = nullptr;
+			leaf->_sizeClasses[id & (LEAF_LENGTH - 1)] = 0;
+		}
+	}
+
+	// 把所有节点还给系统，之后整个映射是空的；只在销毁堆时调用
+	void ReleaseNodes()
+	{
+		while (_leaves)
+		{
+			Leaf* next = _leaves->_next;
+			SystemFree(_leaves, NodePages(sizeof(Leaf)));
+			_leaves = next;
+		}
+		if (_root)
+		{
+			SystemFree(_root, NodePages(ROOT_LENGTH * sizeof(Leaf*)));
+			_root = nullptr;
+		}
+	}
+};
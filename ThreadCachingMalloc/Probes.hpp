@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+
+// USDT静态探针：线上不用重新编译，直接用bpftrace/perf挂到分配器的慢路径上看发生了什么
+//     bpftrace -e 'usdt:./tcmalloc:hcmalloc:cc_refill { @[arg0] = count(); }'
+//     perf probe -x ./tcmalloc sdt_hcmalloc:large_alloc
+// 例子见bpftrace/目录。探针只在慢路径上，没挂的时候就是一条nop，参数留在原来的寄存器里
+//
+// 探针（provider都是hcmalloc）和参数：
+//     tc_fetch         大小类下标, 块大小, 想要的块数, 实际拿到的块数     ThreadCache::FetchFromCentralCache
+//     tc_list_too_long 大小类下标, 块大小, 还回去的块数, 链表长度         ThreadCache::ListTooLong
+//     cc_refill        大小类下标, 块大小, span的页数                       CentralCache::GetOneSpan向PageCache要新span
+//     pc_sys_alloc     页数, 地址                                           PageCache向系统（或者文件）要内存
+//     pc_coalesce      合并后的起始页号, 还回来的页数, 合并后的页数         PageCache::ReleaseSpanToPageCache
+//     pc_remap         原来的页数, 新的页数, 新地址                         PageCache::ResizeLargeSpan（hc_realloc）
+//     large_alloc      申请的字节数, 页数, 地址                             大于256KB的申请
+//     large_free       页数, 地址                                           大于256KB的释放
+//
+// 有<sys/sdt.h>（systemtap-sdt-dev）时用它；没有时x86-64上用下面和它格式相同的实现，
+// 别的平台上探针是空的。-DHC_NO_PROBES 可以全部去掉
+
+#if defined(HC_NO_PROBES)
+#define HC_PROBES_ENABLED 0
+#elif __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HC_PROBES_ENABLED 1
+#define HC_PROBE1(name, a) DTRACE_PROBE1(hcmalloc, name, (uint64_t)(a))
+#define HC_PROBE2(name, a, b) DTRACE_PROBE2(hcmalloc, name, (uint64_t)(a), (uint64_t)(b))
+#define HC_PROBE3(name, a, b, c) DTRACE_PROBE3(hcmalloc, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c))
+#define HC_PROBE4(name, a, b, c, d) DTRACE_PROBE4(hcmalloc, name, (uint64_t)(a), (uint64_t)(b), (uint64_t)(c), (uint64_t)(d))
+#elif defined(__x86_64__)
+#define HC_PROBES_ENABLED 1
+
+// 和sys/sdt.h一样：探针的位置放一条nop，在.note.stapsdt里记一条note（nop的地址、名字、每个参数在哪里），
+// 工具按note把nop换成断点。参数的位置由编译器填：寄存器(%rdi)、栈上(8(%rsp))或者常数($5)
+#define HC_SDT_NOTE(name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"hcmalloc\"\n" \
+    ".asciz \"" #name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define HC_PROBE1(name, a) \
+    __asm__ __volatile__(HC_SDT_NOTE(name, "8@%[a0]") \
+        :: [a0] "nor"((uint64_t)(a)))
+#define HC_PROBE2(name, a, b) \
+    __asm__ __volatile__(HC_SDT_NOTE(name, "8@%[a0] 8@%[a1]") \
+        :: [a0] "nor"((uint64_t)(a)), [a1] "nor"((uint64_t)(b)))
+#define HC_PROBE3(name, a, b, c) \
+    __asm__ __volatile__(HC_SDT_NOTE(name, "8@%[a0] 8@%[a1] 8@%[a2]") \
+        :: [a0] "nor"((uint64_t)(a)), [a1] "nor"((uint64_t)(b)), [a2] "nor"((uint64_t)(c)))
+#define HC_PROBE4(name, a, b, c, d) \
+    __asm__ __volatile__(HC_SDT_NOTE(name, "8@%[a0] 8@%[a1] 8@%[a2] 8@%[a3]") \
+        :: [a0] "nor"((uint64_t)(a)), [a1] "nor"((uint64_t)(b)), [a2] "nor"((uint64_t)(c)), [a3] "nor"((uint64_t)(d)))
+#else
+#define HC_PROBES_ENABLED 0
+#endif
+
+#if !HC_PROBES_ENABLED
+#define HC_PROBE1(name, a) ((void)0)
+#define HC_PROBE2(name, a, b) ((void)0)
+#define HC_PROBE3(name, a, b, c) ((void)0)
+#define HC_PROBE4(name, a, b, c, d) ((void)0)
+#endif
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "Common.hpp"
+#include "PageMap.hpp"
+
+// 按段管理页（编译时 -DHC_SEGMENTS 打开）：默认的堆向系统要内存时一次要一整段（4MB，按4MB对齐），
+// 段的第一页是段头，记着段里每一页属于哪个span、是哪个大小类，
+// 释放时 地址 & ~(SEGMENT_SIZE-1) 就是段头，一次读就找到，不用先读页号映射的根数组
+//
+//     | 段头(1页) | 511页，切成不超过128页的span挂到PageCache上 |
+//
+// 超过128页的大块自己单独占一段：段头后面紧跟着这一块，段的长度按块的大小来，只有起始地址按4MB对齐；
+// 超过一段(4MB)的大块后面几段的开头是用户数据，没有段头，这几段的段号另外登记（见SpanMap::SetLarge）
+// 段里的页还给系统以后，段头上记的映射也去掉；整段的页都还掉以后段头也一起还掉
+// hc_heap_create创建的堆（包括文件映射的）还是用页号映射
+//
+// 代价：段和段之间的span不能合并，每段多占一页（大块也是）；大块的hc_realloc不再用mremap搬，改成拷贝
+
+#if defined(_WIN32) || defined(_WIN64)
+#error "HC_SEGMENTS只支持POSIX系统"
+#endif
+
+static const size_t SEGMENT_SHIFT = 22;
+static const size_t SEGMENT_SIZE = (size_t)1 << SEGMENT_SHIFT;
+static const size_t SEGMENT_PAGES = SEGMENT_SIZE >> PAGE_SHIFT;    // 512页，第0页是段头
+
+struct SegmentHeader
+{
+    Span* _spans[SEGMENT_PAGES];
+    uint16_t _sizeClasses[SEGMENT_PAGES];   // 小对象span是大小类下标+1，其他是0
+    size_t _pages = 0;                      // 除了段头还有多少页映射着，减到0时段头也还掉
+};
+
+// 段头在第一页里按段号错开几个缓存行：段都按4MB对齐，段头要是都在开头，
+// 各段的_sizeClasses会落在缓存的同一组里，释放时互相挤掉
+static const size_t SEGMENT_HEADER_COLORS = 32;
+
+static_assert(sizeof(SegmentHeader) + (SEGMENT_HEADER_COLORS - 1) * CACHE_LINE_SIZE <= ((size_t)1 << PAGE_SHIFT),
+    "segment header must fit in one page");
+
+// 页号所在段的段头
+inline SegmentHeader* SegmentOf(PAGE_ID id)
+{
+    PAGE_ID segment = id >> (SEGMENT_SHIFT - PAGE_SHIFT);
+    return (SegmentHeader*)((segment << SEGMENT_SHIFT) + (segment % SEGMENT_HEADER_COLORS) * CACHE_LINE_SIZE);
+}
+
+// 申请一段，段头后面有kpage页可以用（kpage+1页不到一段时也占一段的地址，只映射kpage+1页），返回段头后面第一页
+// 和SystemAlloc一样失败时抛std::bad_alloc
+inline void* SegmentAlloc(size_t kpage)
+{
+    size_t bytes = (kpage + 1) << PAGE_SHIFT;
+    char* base = (char*)mmap(NULL, bytes + SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        throw std::bad_alloc();
+
+    char* aligned = (char*)(((uintptr_t)base + SEGMENT_SIZE - 1) & ~(uintptr_t)(SEGMENT_SIZE - 1));
+    if (aligned != base)
+        munmap(base, aligned - base);
+    if (aligned + bytes != base + bytes + SEGMENT_SIZE)
+        munmap(aligned + bytes, base + SEGMENT_SIZE - aligned);
+
+    // mmap出来的是0，映射都是空的
+    SegmentHeader* header = SegmentOf((PAGE_ID)aligned >> PAGE_SHIFT);
+    header->_pages = kpage;
+    return aligned + ((size_t)1 << PAGE_SHIFT);
+}
+
+// 把段里ptr开始的kpage页还给系统，整段都还掉以后把段头也还掉；返回一共还了多少页（包括段头）
+inline size_t SegmentRelease(void* ptr, size_t kpage)
+{
+    SegmentHeader* header = SegmentOf((PAGE_ID)ptr >> PAGE_SHIFT);
+    assert(header->_pages >= kpage);
+    munmap(ptr, kpage << PAGE_SHIFT);
+    header->_pages -= kpage;
+    if (header->_pages > 0)
+        return kpage;
+    munmap((void*)((uintptr_t)header & ~(uintptr_t)(SEGMENT_SIZE - 1)), (size_t)1 << PAGE_SHIFT);
+    return kpage + 1;
+}
+
+// 和PageMap一样的接口，默认的堆按段头查，别的堆按页号映射查
+// 默认的堆用不到页号映射，_pageMap拿来登记超过一段的大块占着的后面几段：按这几段第0页的页号记大块的span
+class SpanMap
+{
+private:
+    PageMap _pageMap;
+    bool _segmented;
+    size_t _largeSegments = 0;      // 登记了多少个这样的段，没有时Get不用查_pageMap
+public:
+    constexpr explicit SpanMap(bool segmented)
+        : _segmented(segmented)
+    {}
+
+    // 合并时会查span前后的页：段头(第0页)的位置返回nullptr，不去读下一段（可能没有映射）
+    // 大块后面几段里的页没有段头，查登记的大块
+    Span* Get(PAGE_ID id) const
+    {
+        if (!_segmented)
+            return _pageMap.Get(id);
+        if (_largeSegments > 0)
+        {
+            Span* large = _pageMap.Get(id & ~(PAGE_ID)(SEGMENT_PAGES - 1));
+            if (large)
+                return large;
+        }
+        size_t index = id & (SEGMENT_PAGES - 1);
+        return index ? SegmentOf(id)->_spans[index] : nullptr;
+    }
+
+    // 释放的快路径：只查已经交出去的对象的起始页，它们都在有段头的段里（大块的起始页在第一段），一次读
+    size_t GetSizeClass(PAGE_ID id) const
+    {
+        if (!_segmented)
+            return _pageMap.GetSizeClass(id);
+        return SegmentOf(id)->_sizeClasses[id & (SEGMENT_PAGES - 1)];
+    }
+
+    void Set(PAGE_ID id, Span* span, size_t sizeClass = 0)
+    {
+        if (!_segmented)
+            return _pageMap.Set(id, span, sizeClass);
+        size_t index = id & (SEGMENT_PAGES - 1);
+        assert(index != 0);
+        SegmentOf(id)->_spans[index] = span;
+        SegmentOf(id)->_sizeClasses[index] = (uint16_t)sizeClass;
+    }
+
+    void Erase(PAGE_ID id)
+    {
+        if (!_segmented)
+            return _pageMap.Erase(id);
+        size_t index = id & (SEGMENT_PAGES - 1);
+        if (index)
+        {
+            SegmentOf(id)->_spans[index] = nullptr;
+            SegmentOf(id)->_sizeClasses[index] = 0;
+        }
+    }
+
+    // 大块超过一段时，把第一段后面的几段登记成属于它；还给系统之前要EraseLarge
+    void SetLarge(Span* span)
+    {
+        if (!_segmented)
+            return;
+        const size_t shift = SEGMENT_SHIFT - PAGE_SHIFT;
+        PAGE_ID last = (span->_pageId + span->_n - 1) >> shift;
+        for (PAGE_ID segment = (span->_pageId >> shift) + 1; segment <= last; ++segment)
+        {
+            _pageMap.Set(segment << shift, span);
+            ++_largeSegments;
+        }
+    }
+
+    void EraseLarge(Span* span)
+    {
+        if (!_segmented)
+            return;
+        const size_t shift = SEGMENT_SHIFT - PAGE_SHIFT;
+        PAGE_ID last = (span->_pageId + span->_n - 1) >> shift;
+        for (PAGE_ID segment = (span->_pageId >> shift) + 1; segment <= last; ++segment)
+        {
+            _pageMap.Erase(segment << shift);
+            --_largeSegments;
+        }
+    }
+
+    void ReleaseNodes()
+    {
+        _pageMap.ReleaseNodes();
+    }
+};
@@ -0,0 +1,715 @@
+#pragma once
+
+#include <cstring>
+#include <cerrno>
+
+#include "Common.hpp"
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+// 多个进程共用的内存池：整个池子放在一块有名字的共享内存（shm_open + mmap）里，
+// 进程A申请的内存把偏移交给进程B，B用自己的映射地址直接读，不用拷贝，用完由B释放
+//     ShmPool* pool = hc_shm_create("/ingest", bytes);    // 另一个进程用hc_shm_open("/ingest")
+//     void* p = hc_shm_alloc(pool, size);
+//     uint64_t off = hc_shm_offset(pool, p);               // 通过管道、或者池子里的队列交给别的进程
+//     void* q = hc_shm_ptr(pool, off);                     // 对方进程里的地址
+//     hc_shm_free(pool, q);
+//
+// 结构和默认的堆一样分三层：每个线程的缓存 -> 每个大小类一个链表 -> 按页数挂的空闲span，
+// 大小类也用同一张表，只是后两层放在共享内存里，各个进程的映射地址不一样，所以里面不能存指针：
+// span描述符放在一个数组里，互相之间用下标连；页号映射是一个数组，存span的下标；
+// 还回span的块链成链表时，块里存的是段内偏移。ThreadCache在各进程自己的内存里，缓存的块用本进程的地址连起来
+//
+// 段的大小在创建时定下来，不会增长（增长需要所有进程重新映射），用完时hc_shm_alloc返回nullptr
+// 锁都是进程间共享的robust锁：持有锁的进程死掉后，下一个加锁的进程标记一下接着用。
+// 临界区只改几个下标，进程刚好死在改到一半时这把锁管的链表可能不完整，这种情况只能丢掉整个池子重建；
+// 死掉的进程ThreadCache里缓存的块、还没交出去的对象就泄漏了
+// 创建和打开池子的程序必须用同一份大小类表编译（打开时比较表的指纹，不一样就打不开）
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+static const uint32_t SHM_NIL = 0xFFFFFFFF;     // 空的下标
+static const char SHM_MAGIC[8] = { 'H', 'C', 'S', 'H', 'M', '0', '0', '2' };
+
+// 大小类表的指纹（FNV-1a）：个数一样但是大小不一样的表（比如sizeclassgen生成的）也能认出来
+// 页的大小、页数上限也算进去，它们决定了span怎么切
+static constexpr uint64_t ShmClassTableHash()
+{
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t value) {
+        for (int i = 0; i < 8; ++i)
+        {
+            hash ^= (value >> (i * 8)) & 0xFF;
+            hash *= 1099511628211ull;
+        }
+    };
+    mix(PAGE_SHIFT);
+    mix(NPAGES);
+    mix(NFREELIST);
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        mix(SizeClass::ClassSize(i));
+    }
+    return hash;
+}
+
+// 放在共享内存里的锁
+class ShmMutex
+{
+private:
+    pthread_mutex_t _mtx;
+public:
+    void Init()
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&_mtx, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    void lock()
+    {
+        // 上一个持有者没解锁就死了
+        if (pthread_mutex_lock(&_mtx) == EOWNERDEAD)
+            pthread_mutex_consistent(&_mtx);
+    }
+
+    void unlock()
+    {
+        pthread_mutex_unlock(&_mtx);
+    }
+};
+
+// 和Span一样，指针都换成了下标和偏移
+struct ShmSpan
+{
+    uint32_t _pageId = 0;           // 段内的页号
+    uint32_t _n = 0;                // 页的数量
+    uint32_t _next = SHM_NIL;       // span下标
+    uint32_t _prev = SHM_NIL;
+    uint64_t _freeList = 0;         // 还回来的块，块里存下一块的段内偏移，0表示空
+    uint32_t _useCount = 0;         // 切出去的块有多少还没还回来
+    uint32_t _bump = 0;             // 还没切过的部分从这里开始（span内的字节数）
+    uint16_t _sizeClass = 0;        // 大小类下标+1，0表示大块
+    bool _isUse = false;
+};
+
+// 段的开头
+struct ShmHeader
+{
+    char _magic[8];
+    uint64_t _bytes;                // 整个段的大小
+    uint32_t _npages;
+    uint32_t _firstPage;            // 前面的页放这个头、span描述符和页号映射
+    uint32_t _nfreelist;
+    uint64_t _classHash;            // ShmClassTableHash()，打开时和自己的比
+    std::atomic<uint32_t> _ready;   // 创建的进程初始化完以后置1
+    std::atomic<uint64_t> _root;    // 使用者放的入口对象（比如交换偏移的队列），别的进程打开后从这里找
+    std::atomic<uint64_t> _usedPages;
+
+    ShmMutex _pageMtx;
+    uint32_t _freeDescs;            // 空闲的span描述符，用_next连起来
+    uint32_t _pageLists[NPAGES];    // 空闲的span按页数挂，超过128页的挂在[0]上
+
+    // 每个大小类还有空闲块的span，各自一把锁
+    struct alignas(CACHE_LINE_SIZE) Bucket
+    {
+        ShmMutex _mtx;
+        uint32_t _spans;
+    } _buckets[NFREELIST];
+};
+
+class ShmPool
+{
+private:
+    // 一个线程在这个池子上的缓存，在进程自己的内存里
+    struct ThreadCacheShm
+    {
+        ShmPool* _pool;
+        FreeList _freeLists[NFREELIST];
+    };
+
+    char* _base = nullptr;
+    size_t _bytes = 0;
+    ShmHeader* _hdr = nullptr;
+    ShmSpan* _spans = nullptr;          // 描述符的个数和页数一样，每个span至少一页，不会不够
+    uint32_t* _pageMap = nullptr;       // 每页所在span的下标
+    pthread_key_t _cacheKey;            // 线程退出时把缓存还回池子
+
+    ShmPool() = default;
+    ShmPool(const ShmPool&) = delete;
+
+    static void Layout(size_t npages, size_t& spansOff, size_t& pageMapOff, size_t& firstPage)
+    {
+        spansOff = SizeClass::_RoundUp(sizeof(ShmHeader), CACHE_LINE_SIZE);
+        pageMapOff = spansOff + npages * sizeof(ShmSpan);
+        firstPage = SizeClass::_RoundUp(pageMapOff + npages * sizeof(uint32_t), (size_t)1 << PAGE_SHIFT) >> PAGE_SHIFT;
+    }
+
+    static ShmPool* Map(int fd, size_t bytes)
+    {
+        void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+            return nullptr;
+
+        size_t spansOff, pageMapOff, firstPage;
+        Layout(bytes >> PAGE_SHIFT, spansOff, pageMapOff, firstPage);
+
+        ShmPool* pool = new ShmPool;
+        pool->_base = (char*)base;
+        pool->_bytes = bytes;
+        pool->_hdr = (ShmHeader*)base;
+        pool->_spans = (ShmSpan*)(pool->_base + spansOff);
+        pool->_pageMap = (uint32_t*)(pool->_base + pageMapOff);
+        pthread_key_create(&pool->_cacheKey, ReleaseThreadCache);
+        return pool;
+    }
+
+public:
+    // 建一个新的段，名字已经存在时失败；bytes按页对齐，至少4MB
+    static ShmPool* Create(const char* name, size_t bytes)
+    {
+        bytes = SizeClass::_RoundUp(std::max(bytes, (size_t)4 << 20), (size_t)1 << PAGE_SHIFT);
+        size_t npages = bytes >> PAGE_SHIFT;
+        if (npages >= SHM_NIL)
+            return nullptr;
+
+        int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            return nullptr;
+        if (ftruncate(fd, bytes) != 0)
+        {
+            close(fd);
+            shm_unlink(name);
+            return nullptr;
+        }
+        ShmPool* pool = Map(fd, bytes);
+        if (pool == nullptr)
+        {
+            shm_unlink(name);
+            return nullptr;
+        }
+        pool->Init();
+        return pool;
+    }
+
+    // 打开别的进程建好的段，创建者还没初始化完时等一会儿
+    static ShmPool* Open(const char* name)
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmHeader))
+        {
+            close(fd);
+            return nullptr;
+        }
+        ShmPool* pool = Map(fd, st.st_size);
+        if (pool == nullptr)
+            return nullptr;
+
+        ShmHeader* hdr = pool->_hdr;
+        for (int i = 0; i < 1000 && hdr->_ready.load(std::memory_order_acquire) == 0; ++i)
+        {
+            usleep(1000);
+        }
+        if (hdr->_ready.load(std::memory_order_acquire) == 0
+            || memcmp(hdr->_magic, SHM_MAGIC, sizeof(SHM_MAGIC)) != 0
+            || hdr->_nfreelist != NFREELIST
+            || hdr->_classHash != ShmClassTableHash()
+            || hdr->_bytes != pool->_bytes)
+        {
+            pool->Unmap();
+            return nullptr;
+        }
+        return pool;
+    }
+
+    static int Unlink(const char* name)
+    {
+        return shm_unlink(name);
+    }
+
+    // 把当前线程的缓存还回去，解除映射。同一进程里别的线程要在这之前退出或者调用过ReleaseThreadCache
+    void Close()
+    {
+        ReleaseThreadCache();
+        Unmap();
+    }
+
+    uint64_t ToOffset(const void* ptr) const
+    {
+        return ptr ? (uint64_t)((const char*)ptr - _base) : 0;
+    }
+
+    void* FromOffset(uint64_t offset) const
+    {
+        return offset ? _base + offset : nullptr;
+    }
+
+    void SetRoot(uint64_t offset)
+    {
+        _hdr->_root.store(offset, std::memory_order_release);
+    }
+
+    uint64_t Root() const
+    {
+        return _hdr->_root.load(std::memory_order_acquire);
+    }
+
+    // span占用的页数（包括还在各个ThreadCache和span里空着的块）
+    size_t UsedPages() const
+    {
+        return _hdr->_usedPages.load(std::memory_order_relaxed);
+    }
+
+    void* Allocate(size_t size)
+    {
+        if (size > MAX_BYTES)
+            return AllocateLarge(size);
+
+        ThreadCacheShm* tc = GetThreadCache();
+        size_t index = SizeClass::Index(size);
+        FreeList& list = tc->_freeLists[index];
+        if (!list.Empty())
+            return list.Pop();
+        return FetchFromCentral(list, index);
+    }
+
+    void Free(void* ptr)
+    {
+        uint32_t si = _pageMap[PageOf(ptr)];
+        ShmSpan& span = _spans[si];
+        if (span._sizeClass == 0)
+        {
+            std::lock_guard<ShmMutex> lock(_hdr->_pageMtx);
+            ReleaseSpan(si);
+            return;
+        }
+
+        size_t index = span._sizeClass - 1;
+        FreeList& list = GetThreadCache()->_freeLists[index];
+        list.Push(ptr);
+        if (list.Size() >= list.MaxSize())
+        {
+            // 和ThreadCache::ListTooLong一样只还一批
+            size_t batchNum = std::min(list.Size(), SizeClass::NumMoveSize(SizeClass::ClassSize(index)));
+            void* start = nullptr;
+            void* end = nullptr;
+            list.PopRange(start, end, batchNum);
+            ReleaseList(index, start);
+        }
+    }
+
+    // 当前线程缓存的块全部还回池子
+    void ReleaseThreadCache()
+    {
+        ThreadCacheShm* tc = (ThreadCacheShm*)pthread_getspecific(_cacheKey);
+        if (tc == nullptr)
+            return;
+        pthread_setspecific(_cacheKey, nullptr);
+        ReleaseThreadCache(tc);
+    }
+
+private:
+    void Init()
+    {
+        size_t npages = _bytes >> PAGE_SHIFT;
+        size_t spansOff, pageMapOff, firstPage;
+        Layout(npages, spansOff, pageMapOff, firstPage);
+
+        // ftruncate出来的段全是0
+        ShmHeader* hdr = _hdr;
+        memcpy(hdr->_magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+        hdr->_bytes = _bytes;
+        hdr->_npages = npages;
+        hdr->_firstPage = firstPage;
+        hdr->_nfreelist = NFREELIST;
+        hdr->_classHash = ShmClassTableHash();
+        hdr->_pageMtx.Init();
+        for (size_t i = 0; i < NPAGES; ++i)
+        {
+            hdr->_pageLists[i] = SHM_NIL;
+        }
+        for (size_t i = 0; i < NFREELIST; ++i)
+        {
+            hdr->_buckets[i]._mtx.Init();
+            hdr->_buckets[i]._spans = SHM_NIL;
+        }
+
+        for (size_t i = 0; i < npages; ++i)
+        {
+            new (&_spans[i]) ShmSpan;
+            _spans[i]._next = i + 1 < npages ? i + 1 : SHM_NIL;
+        }
+        hdr->_freeDescs = 0;
+        memset(_pageMap, 0xFF, npages * sizeof(uint32_t));
+
+        if (firstPage < npages)
+        {
+            uint32_t si = NewDesc();
+            _spans[si]._pageId = firstPage;
+            _spans[si]._n = npages - firstPage;
+            PushFreeSpan(si);
+        }
+        hdr->_ready.store(1, std::memory_order_release);
+    }
+
+    void Unmap()
+    {
+        pthread_key_delete(_cacheKey);
+        munmap(_base, _bytes);
+        delete this;
+    }
+
+    ThreadCacheShm* GetThreadCache()
+    {
+        ThreadCacheShm* tc = (ThreadCacheShm*)pthread_getspecific(_cacheKey);
+        if (tc == nullptr)
+        {
+            tc = new ThreadCacheShm;
+            tc->_pool = this;
+            pthread_setspecific(_cacheKey, tc);
+        }
+        return tc;
+    }
+
+    static void ReleaseThreadCache(void* arg)
+    {
+        ThreadCacheShm* tc = (ThreadCacheShm*)arg;
+        for (size_t i = 0; i < NFREELIST; ++i)
+        {
+            FreeList& list = tc->_freeLists[i];
+            if (list.Empty())
+                continue;
+            void* start = nullptr;
+            void* end = nullptr;
+            list.PopRange(start, end, list.Size());
+            tc->_pool->ReleaseList(i, start);
+        }
+        delete tc;
+    }
+
+    size_t PageOf(const void* ptr) const
+    {
+        return (size_t)((const char*)ptr - _base) >> PAGE_SHIFT;
+    }
+
+    void* SpanAddress(const ShmSpan& span) const
+    {
+        return _base + ((size_t)span._pageId << PAGE_SHIFT);
+    }
+
+    // ---- 下标连起来的双向链表 ----
+
+    void ListPush(uint32_t& head, uint32_t si)
+    {
+        _spans[si]._prev = SHM_NIL;
+        _spans[si]._next = head;
+        if (head != SHM_NIL)
+            _spans[head]._prev = si;
+        head = si;
+    }
+
+    void ListErase(uint32_t& head, uint32_t si)
+    {
+        ShmSpan& span = _spans[si];
+        if (span._prev != SHM_NIL)
+            _spans[span._prev]._next = span._next;
+        else
+            head = span._next;
+        if (span._next != SHM_NIL)
+            _spans[span._next]._prev = span._prev;
+        span._next = span._prev = SHM_NIL;
+    }
+
+    // ---- 页这一层，调用时持有_pageMtx ----
+
+    uint32_t NewDesc()
+    {
+        uint32_t si = _hdr->_freeDescs;
+        _hdr->_freeDescs = _spans[si]._next;
+        _spans[si] = ShmSpan();
+        return si;
+    }
+
+    void FreeDesc(uint32_t si)
+    {
+        _spans[si]._next = _hdr->_freeDescs;
+        _hdr->_freeDescs = si;
+    }
+
+    static size_t ListIndex(size_t n)
+    {
+        return n < NPAGES ? n : 0;
+    }
+
+    // 空闲的span只记首尾两页，合并时只看得到这两页
+    void PushFreeSpan(uint32_t si)
+    {
+        ShmSpan& span = _spans[si];
+        span._isUse = false;
+        span._sizeClass = 0;
+        ListPush(_hdr->_pageLists[ListIndex(span._n)], si);
+        _pageMap[span._pageId] = si;
+        _pageMap[span._pageId + span._n - 1] = si;
+    }
+
+    // 和PageCache::NewSpan一样：先找正好k页的，再找更大的切开；超过128页的在[0]上找第一个够大的
+    uint32_t NewSpan(size_t k)
+    {
+        uint32_t si = SHM_NIL;
+        for (size_t i = k; i < NPAGES && si == SHM_NIL; ++i)
+        {
+            si = _hdr->_pageLists[i];
+        }
+        for (uint32_t s = _hdr->_pageLists[0]; si == SHM_NIL && s != SHM_NIL; s = _spans[s]._next)
+        {
+            if (_spans[s]._n >= k)
+                si = s;
+        }
+        if (si == SHM_NIL)
+            return SHM_NIL;
+
+        ShmSpan& span = _spans[si];
+        ListErase(_hdr->_pageLists[ListIndex(span._n)], si);
+        if (span._n > k)
+        {
+            uint32_t ri = NewDesc();
+            _spans[ri]._pageId = span._pageId + k;
+            _spans[ri]._n = span._n - k;
+            PushFreeSpan(ri);
+            span._n = k;
+        }
+
+        span._isUse = true;
+        for (size_t i = 0; i < k; ++i)
+        {
+            _pageMap[span._pageId + i] = si;
+        }
+        _hdr->_usedPages.fetch_add(k, std::memory_order_relaxed);
+        return si;
+    }
+
+    // 和前后空闲的span合并后挂回去
+    void ReleaseSpan(uint32_t si)
+    {
+        ShmSpan& span = _spans[si];
+        _hdr->_usedPages.fetch_sub(span._n, std::memory_order_relaxed);
+
+        while (span._pageId > _hdr->_firstPage)
+        {
+            uint32_t pi = _pageMap[span._pageId - 1];
+            if (pi == SHM_NIL || _spans[pi]._isUse)
+                break;
+            ShmSpan& prev = _spans[pi];
+            ListErase(_hdr->_pageLists[ListIndex(prev._n)], pi);
+            span._pageId = prev._pageId;
+            span._n += prev._n;
+            FreeDesc(pi);
+        }
+        while (span._pageId + span._n < _hdr->_npages)
+        {
+            uint32_t ni = _pageMap[span._pageId + span._n];
+            if (ni == SHM_NIL || _spans[ni]._isUse)
+                break;
+            ShmSpan& next = _spans[ni];
+            ListErase(_hdr->_pageLists[ListIndex(next._n)], ni);
+            span._n += next._n;
+            FreeDesc(ni);
+        }
+        PushFreeSpan(si);
+    }
+
+    void* AllocateLarge(size_t size)
+    {
+        size_t kpage = SizeClass::RoundUp(size) >> PAGE_SHIFT;
+        std::lock_guard<ShmMutex> lock(_hdr->_pageMtx);
+        uint32_t si = NewSpan(kpage);
+        return si == SHM_NIL ? nullptr : SpanAddress(_spans[si]);
+    }
+
+    // ---- 大小类这一层 ----
+
+    bool HasFree(const ShmSpan& span, size_t size) const
+    {
+        return span._freeList != 0 || span._bump + size <= ((size_t)span._n << PAGE_SHIFT);
+    }
+
+    // 和ThreadCache::FetchFromCentralCache一样慢启动，拿一批放进本线程的链表
+    void* FetchFromCentral(FreeList& list, size_t index)
+    {
+        size_t size = SizeClass::ClassSize(index);
+        size_t numMove = SizeClass::NumMoveSize(size);
+        size_t batchNum = std::min(list.MaxSize(), numMove);
+        if (list.MaxSize() < numMove)
+            list.MaxSize() += 3;
+        else
+            list.MaxSize() = std::min(list.MaxSize() + numMove, 2 * numMove);
+
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t actualNum = FetchRange(index, size, batchNum, start, end);
+        if (actualNum == 0)
+            return nullptr;
+        if (actualNum > 1)
+            list.PushRange(NextObj(start), end, actualNum - 1);
+        return start;
+    }
+
+    // 最多拿batchNum块，用本进程的地址连起来；段用完时返回0
+    size_t FetchRange(size_t index, size_t size, size_t batchNum, void*& start, void*& end)
+    {
+        ShmHeader::Bucket& bucket = _hdr->_buckets[index];
+        std::unique_lock<ShmMutex> lock(bucket._mtx);
+
+        uint32_t si = bucket._spans;
+        if (si == SHM_NIL)
+        {
+            lock.unlock();
+            {
+                std::lock_guard<ShmMutex> pageLock(_hdr->_pageMtx);
+                si = NewSpan(SizeClass::NumMovePage(size));
+                if (si != SHM_NIL)
+                {
+                    _spans[si]._sizeClass = index + 1;
+                    _spans[si]._freeList = 0;
+                    _spans[si]._bump = 0;
+                    _spans[si]._useCount = 0;
+                }
+            }
+            lock.lock();
+            if (si == SHM_NIL)
+                return 0;
+            ListPush(bucket._spans, si);
+        }
+
+        ShmSpan& span = _spans[si];
+        char* spanBase = (char*)SpanAddress(span);
+        size_t spanBytes = (size_t)span._n << PAGE_SHIFT;
+        void* head = nullptr;
+        void* tail = nullptr;
+        size_t n = 0;
+        while (n < batchNum && span._freeList != 0)
+        {
+            void* obj = _base + span._freeList;
+            span._freeList = *(uint64_t*)obj;
+            NextObj(obj) = head;
+            head = obj;
+            if (tail == nullptr)
+                tail = obj;
+            ++n;
+        }
+        while (n < batchNum && span._bump + size <= spanBytes)
+        {
+            void* obj = spanBase + span._bump;
+            span._bump += size;
+            NextObj(obj) = head;
+            head = obj;
+            if (tail == nullptr)
+                tail = obj;
+            ++n;
+        }
+        span._useCount += n;
+        if (!HasFree(span, size))
+            ListErase(bucket._spans, si);
+
+        start = head;
+        end = tail;
+        return n;
+    }
+
+    // 把本线程链表上的一串块还给各自的span，span全还回来了就交给页这一层
+    void ReleaseList(size_t index, void* start)
+    {
+        size_t size = SizeClass::ClassSize(index);
+        ShmHeader::Bucket& bucket = _hdr->_buckets[index];
+        std::unique_lock<ShmMutex> lock(bucket._mtx);
+        while (start)
+        {
+            void* next = NextObj(start);
+            uint32_t si = _pageMap[PageOf(start)];
+            ShmSpan& span = _spans[si];
+            bool wasFull = !HasFree(span, size);    // 没有空闲块的span不在链表上
+
+            *(uint64_t*)start = span._freeList;
+            span._freeList = ToOffset(start);
+            if (--span._useCount == 0)
+            {
+                if (!wasFull)
+                    ListErase(bucket._spans, si);
+                lock.unlock();
+                {
+                    std::lock_guard<ShmMutex> pageLock(_hdr->_pageMtx);
+                    ReleaseSpan(si);
+                }
+                lock.lock();
+            }
+            else if (wasFull)
+            {
+                ListPush(bucket._spans, si);
+            }
+            start = next;
+        }
+    }
+};
+
+// 新建一个名为name的共享内存池（名字以/开头），已经存在或者失败时返回nullptr
+inline ShmPool* hc_shm_create(const char* name, size_t bytes)
+{
+    return ShmPool::Create(name, bytes);
+}
+
+// 打开别的进程建好的池子
+inline ShmPool* hc_shm_open(const char* name)
+{
+    return ShmPool::Open(name);
+}
+
+// 当前线程缓存的块还回池子并解除映射，池子本身还在，直到hc_shm_unlink而且所有进程都关掉
+inline void hc_shm_close(ShmPool* pool)
+{
+    if (pool)
+        pool->Close();
+}
+
+inline int hc_shm_unlink(const char* name)
+{
+    return ShmPool::Unlink(name);
+}
+
+// 池子用完时返回nullptr
+inline void* hc_shm_alloc(ShmPool* pool, size_t size)
+{
+    return pool->Allocate(size);
+}
+
+// 可以释放别的进程申请的内存
+inline void hc_shm_free(ShmPool* pool, void* ptr)
+{
+    if (ptr)
+        pool->Free(ptr);
+}
+
+// 地址和段内偏移互相转换，偏移在所有打开这个池子的进程里都一样，nullptr对应0
+inline uint64_t hc_shm_offset(ShmPool* pool, const void* ptr)
+{
+    return pool->ToOffset(ptr);
+}
+
+inline void* hc_shm_ptr(ShmPool* pool, uint64_t offset)
+{
+    return pool->FromOffset(offset);
+}
+
+#endif
@@ -0,0 +1,281 @@
+// 大小类生成器：根据实际的申请大小直方图生成一张大小类表
+// 用法：sizeclassgen <直方图文件> [-o 输出头文件] [--max-classes N] [--max-waste 0.125]
+//
+// 直方图文件每行一个 "大小 次数"，#开头的行是注释（tracereplay --histogram 可以从trace里导出）
+// 生成的头文件在编译时用 -DHC_SIZE_CLASS_TABLE=\"文件名\" 替换默认的208个大小类
+//
+// 选大小类时同时考虑三件事：
+// 1. 内碎片：申请size，实际给的是大小类的大小，差值就是浪费
+// 2. 大小类个数：每多一个大小类，每个线程就多一个自由链表、CentralCache就多一个桶
+// 3. span尾部浪费：一个span切完之后剩下的不够一块的尾巴
+// 候选大小类 = 默认的大小类 ∪ 直方图里出现过的大小（按8/128字节对齐），用动态规划选一个子集。
+// 相邻两个大小类的间隔不超过 max-waste（默认12.5%，和默认表一样），
+// 这样直方图里没出现过的大小最坏的浪费也不会比默认表差。
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <map>
+
+#include "Common.hpp"
+
+struct Histogram
+{
+    std::vector<size_t> _sizes;     // 升序
+    std::vector<double> _counts;
+};
+
+struct WasteReport
+{
+    double _requested = 0;  // 申请的总字节数
+    double _internal = 0;   // 内碎片
+    double _span = 0;       // span尾部浪费，按对象平摊
+};
+
+static bool ReadHistogram(const char* path, Histogram& hist)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == nullptr)
+        return false;
+
+    std::map<size_t, double> buckets;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (line[0] == '#')
+            continue;
+
+        unsigned long long size = 0;
+        double count = 0;
+        if (sscanf(line, "%llu %lf", &size, &count) != 2)
+            continue;
+
+        // 超过MAX_BYTES的直接按页向PageCache申请，和大小类无关
+        if (size > MAX_BYTES)
+            continue;
+        if (size == 0)
+            size = 1;
+        buckets[size] += count;
+    }
+    fclose(fp);
+
+    for (auto& kv : buckets)
+    {
+        hist._sizes.push_back(kv.first);
+        hist._counts.push_back(kv.second);
+    }
+    return true;
+}
+
+// 生成的表要求 <=1024 的大小类按8字节对齐，>1024 的按128字节对齐（见Common.hpp的查找表）
+static size_t AlignClass(size_t size)
+{
+    return size <= 1024 ? SizeClass::_RoundUp(size, 8) : SizeClass::_RoundUp(size, 128);
+}
+
+// 一个大小为size的块平摊到的span尾部浪费
+static double SpanWastePerObject(size_t size)
+{
+    size_t bytes = SizeClass::NumMovePage(size) << PAGE_SHIFT;
+    size_t nobjs = bytes / size;
+    return (double)(bytes - nobjs * size) / nobjs;
+}
+
+static WasteReport Evaluate(const std::vector<size_t>& classes, const Histogram& hist)
+{
+    WasteReport report;
+    for (size_t i = 0; i < hist._sizes.size(); ++i)
+    {
+        size_t size = hist._sizes[i];
+        size_t cls = *std::lower_bound(classes.begin(), classes.end(), size);
+
+        report._requested += hist._counts[i] * size;
+        report._internal += hist._counts[i] * (cls - size);
+        report._span += hist._counts[i] * SpanWastePerObject(cls);
+    }
+    return report;
+}
+
+// 在候选大小类里选一个子集，使 浪费 + lambda * 大小类个数 最小
+static std::vector<size_t> Fit(const std::vector<size_t>& cand, const Histogram& hist,
+    double maxWaste, double lambda)
+{
+    size_t m = cand.size();
+
+    // cnt[j]/sum[j]: 大小 <= cand[j] 的申请次数和字节数
+    std::vector<double> cnt(m + 1, 0), sum(m + 1, 0);
+    size_t h = 0;
+    for (size_t j = 0; j < m; ++j)
+    {
+        cnt[j + 1] = cnt[j];
+        sum[j + 1] = sum[j];
+        while (h < hist._sizes.size() && hist._sizes[h] <= cand[j])
+        {
+            cnt[j + 1] += hist._counts[h];
+            sum[j + 1] += hist._counts[h] * hist._sizes[h];
+            ++h;
+        }
+    }
+
+    // f[j+1]: 最后一个大小类是cand[j]时的最小代价，f[0]对应大小0
+    const double INF = 1e300;
+    std::vector<double> f(m + 1, INF);
+    std::vector<size_t> from(m + 1, 0);
+    f[0] = 0;
+
+    for (size_t j = 0; j < m; ++j)
+    {
+        double perObj = cand[j] + SpanWastePerObject(cand[j]);
+        for (size_t i = j + 1; i-- > 0;)
+        {
+            size_t prev = i == 0 ? 0 : cand[i - 1];
+            // 间隔太大的话，prev+1 这个大小的浪费会超过maxWaste
+            if (cand[j] > prev + 16 && cand[j] > prev * (1 + maxWaste))
+                break;
+            if (f[i] >= INF)
+                continue;
+
+            double cost = f[i] + lambda
+                + perObj * (cnt[j + 1] - cnt[i]) - (sum[j + 1] - sum[i]);
+            if (cost < f[j + 1])
+            {
+                f[j + 1] = cost;
+                from[j + 1] = i;
+            }
+        }
+    }
+
+    std::vector<size_t> classes;
+    for (size_t j = m; j > 0; j = from[j])
+    {
+        classes.push_back(cand[j - 1]);
+    }
+    std::reverse(classes.begin(), classes.end());
+    return classes;
+}
+
+static void PrintReport(const char* name, const std::vector<size_t>& classes, const WasteReport& r)
+{
+    printf("%-8s 大小类: %4zu  内碎片: %6.2f%%  span尾部浪费: %6.2f%%  合计: %6.2f%%\n",
+        name, classes.size(),
+        100 * r._internal / r._requested, 100 * r._span / r._requested,
+        100 * (r._internal + r._span) / r._requested);
+}
+
+static bool WriteTable(const char* path, const char* histPath, const std::vector<size_t>& classes,
+    const WasteReport& before, const WasteReport& after)
+{
+    FILE* fp = fopen(path, "w");
+    if (fp == nullptr)
+        return false;
+
+    fprintf(fp, "#pragma once\n\n");
+    fprintf(fp, "// 由 sizeclassgen 根据 %s 生成，不要手动修改\n", histPath);
+    fprintf(fp, "// 大小类个数: %zu\n", classes.size());
+    fprintf(fp, "// 预计浪费(内碎片+span尾部): %.2f%% -> %.2f%%\n",
+        100 * (before._internal + before._span) / before._requested,
+        100 * (after._internal + after._span) / after._requested);
+    fprintf(fp, "static constexpr size_t kSizeClassTable[] = {");
+    for (size_t i = 0; i < classes.size(); ++i)
+    {
+        fprintf(fp, "%s%zu,", i % 8 == 0 ? "\n    " : " ", classes[i]);
+    }
+    fprintf(fp, "\n};\n");
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* histPath = nullptr;
+    const char* outPath = "SizeClassTable.hpp";
+    size_t maxClasses = NFREELIST;
+    double maxWaste = 0.125;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            outPath = argv[++i];
+        else if (arg == "--max-classes" && i + 1 < argc)
+            maxClasses = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--max-waste" && i + 1 < argc)
+            maxWaste = strtod(argv[++i], nullptr);
+        else
+            histPath = argv[i];
+    }
+
+    if (histPath == nullptr)
+    {
+        fprintf(stderr, "usage: %s <histogram> [-o out.hpp] [--max-classes N] [--max-waste 0.125]\n", argv[0]);
+        return 1;
+    }
+
+    Histogram hist;
+    if (!ReadHistogram(histPath, hist) || hist._sizes.empty())
+    {
+        fprintf(stderr, "cannot read histogram: %s\n", histPath);
+        return 1;
+    }
+
+    // 默认的大小类，同时也是候选大小类的一部分，保证动态规划一定有解
+    std::vector<size_t> defaults;
+    for (size_t size = 1; size <= MAX_BYTES; size = SizeClass::RoundUp(size) + 1)
+    {
+        defaults.push_back(SizeClass::RoundUp(size));
+    }
+
+    std::vector<size_t> cand = defaults;
+    for (size_t size : hist._sizes)
+    {
+        cand.push_back(AlignClass(size));
+    }
+    std::sort(cand.begin(), cand.end());
+    cand.erase(std::unique(cand.begin(), cand.end()), cand.end());
+
+    // 二分每个大小类的代价lambda，在不超过maxClasses的前提下浪费最小
+    double lo = 0, hi = 0;
+    for (size_t i = 0; i < hist._sizes.size(); ++i)
+        hi += hist._counts[i] * MAX_BYTES;
+
+    std::vector<size_t> best = Fit(cand, hist, maxWaste, lo);
+    if (best.size() > maxClasses)
+    {
+        best = Fit(cand, hist, maxWaste, hi);
+        for (int iter = 0; iter < 100; ++iter)
+        {
+            double mid = (lo + hi) / 2;
+            std::vector<size_t> classes = Fit(cand, hist, maxWaste, mid);
+            if (classes.size() <= maxClasses)
+            {
+                best = classes;
+                hi = mid;
+            }
+            else
+            {
+                lo = mid;
+            }
+        }
+    }
+
+    if (best.size() > maxClasses)
+    {
+        fprintf(stderr, "cannot fit %zu classes with max waste %.3f, got %zu\n",
+            maxClasses, maxWaste, best.size());
+        return 1;
+    }
+
+    WasteReport before = Evaluate(defaults, hist);
+    WasteReport after = Evaluate(best, hist);
+    PrintReport("默认", defaults, before);
+    PrintReport("生成", best, after);
+
+    if (!WriteTable(outPath, histPath, best, before, after))
+    {
+        fprintf(stderr, "cannot write %s\n", outPath);
+        return 1;
+    }
+    printf("已写入 %s\n", outPath);
+
+    return 0;
+}
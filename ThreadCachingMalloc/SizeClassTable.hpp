@@ -0,0 +1,19 @@
+#pragma once
+
+// 由 sizeclassgen 根据 SizeClassSample.txt 生成，不要手动修改
+// 大小类个数: 93
+// 预计浪费(内碎片+span尾部): 7.04% -> 6.60%
+static constexpr size_t kSizeClassTable[] = {
+    16, 24, 40, 56, 64, 72, 88, 104,
+    120, 128, 144, 160, 176, 192, 200, 224,
+    240, 256, 288, 320, 360, 400, 448, 496,
+    512, 520, 576, 640, 720, 800, 896, 992,
+    1000, 1024, 1152, 1280, 1408, 1536, 1664, 1792,
+    1920, 2048, 2304, 2560, 2816, 2944, 3072, 3456,
+    3840, 4224, 4736, 5248, 5888, 6528, 7296, 8192,
+    9216, 10240, 11264, 12288, 13312, 14336, 15360, 16384,
+    18432, 20480, 22528, 24576, 27648, 30720, 32768, 33792,
+    37888, 41984, 47104, 52224, 58368, 65536, 73728, 81920,
+    90112, 98304, 106496, 114688, 122880, 131072, 147456, 163840,
+    180224, 196608, 221184, 245760, 262144,
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// 先自旋再睡眠的互斥锁，给CentralCache的桶锁用
+// FetchRangeObj这种临界区只有几十到几百纳秒，std::mutex抢不到就进内核睡眠，睡一次比临界区本身还贵
+// 抢不到时先原地自旋一会儿，还抢不到再用futex睡眠（非Linux上退化成yield）
+// 自旋的次数是自适应的（和glibc的PTHREAD_MUTEX_ADAPTIVE_NP一样）：记住最近几次自旋了多久才抢到，
+// 下次最多自旋它的两倍；单核机器上自旋没有意义（持有锁的线程不可能同时在跑），直接睡眠
+//
+// 状态：0 没锁，1 锁着没人等，2 锁着并且可能有人在睡眠（解锁时需要唤醒）
+
+static const uint32_t SPIN_LOCK_MAX_SPINS = 1000;
+
+class SpinMutex
+{
+private:
+    std::atomic<uint32_t> _state{ 0 };
+    uint32_t _spins = 0;        // 最近几次抢到锁之前平均自旋的次数，只在持有锁时修改
+
+    static inline void CpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    static bool SingleCore()
+    {
+        static const bool single = std::thread::hardware_concurrency() <= 1;
+        return single;
+    }
+
+    void Wait()
+    {
+#if defined(__linux__)
+        syscall(SYS_futex, (uint32_t*)&_state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+#else
+        std::this_thread::yield();
+#endif
+    }
+
+    void Wake()
+    {
+#if defined(__linux__)
+        syscall(SYS_futex, (uint32_t*)&_state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+
+    void LockSlow()
+    {
+        uint32_t maxSpins = SingleCore() ? 0 : std::min(SPIN_LOCK_MAX_SPINS, _spins * 2 + 10);
+        for (uint32_t i = 0; i < maxSpins; ++i)
+        {
+            CpuRelax();
+            uint32_t c = 0;
+            if (_state.load(std::memory_order_relaxed) == 0
+                && _state.compare_exchange_weak(c, 1, std::memory_order_acquire))
+            {
+                // 自旋抢到了，_spins往这次的次数靠近1/8
+                _spins += ((int32_t)i - (int32_t)_spins) / 8;
+                return;
+            }
+        }
+
+        // 自旋没抢到，标成有人等待，然后睡眠直到抢到为止
+        while (_state.exchange(2, std::memory_order_acquire) != 0)
+        {
+            Wait();
+        }
+        if (maxSpins)
+            _spins += ((int32_t)maxSpins - (int32_t)_spins) / 8;
+    }
+
+public:
+    void lock()
+    {
+        uint32_t c = 0;
+        if (_state.compare_exchange_strong(c, 1, std::memory_order_acquire))
+            return;
+        LockSlow();
+    }
+
+    bool try_lock()
+    {
+        uint32_t c = 0;
+        return _state.compare_exchange_strong(c, 1, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        if (_state.exchange(0, std::memory_order_release) == 2)
+            Wake();
+    }
+};
@@ -2,27 +2,137 @@
 
 #include "Common.hpp"
 #include "CentralCache.hpp"
+#include "Tuning.hpp"
+
+// 跨线程回收闲置的ThreadCache（见下面的5.）要从/proc读线程的状态，只在Linux上做；快路径上没有额外的开销，
+// -DHC_NO_IDLE_RECLAIM 可以整个去掉
+#if defined(__linux__) && !defined(HC_NO_IDLE_RECLAIM)
+#define HC_IDLE_RECLAIM
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 // ThreadCache 是哈希桶结构
 // 需要注意的是：在计算下标选择桶的时候，不需要将size进行对齐就可以得到对应的下标
 // 计算alignSize的目的是当自由链表为空，需要向CentreCache获取内存时，保证对应的内存大小符合自由链表规定的内存块大小
 
+// 自由链表长度的反馈调节（和tcmalloc一样）：
+// 1. 链表空了(FetchFromCentralCache)：_maxSize没到一批的数量时慢启动，每次加slow_start_step（默认3）；
+//    到了以后再加一批，最多两批
+// 2. 链表超长(ListTooLong)：只还一批给CentralCache，留下剩下的；连续超长MAX_OVERAGES次就把_maxSize减一批
+// 3. 定期回收(Scavenge)：每scavenge_period（默认4096）次释放，每个链表还掉闲置部分(低水位)的一半，_maxSize减一批；
+//    整个ThreadCache超过thread_cache_max_bytes（默认4MB）时每个链表还一半
+// 4. 别的线程调用ThreadCache::RequestReleaseAll()或者堆碰到软上限后，每个线程在下一次走慢路径时整个还掉；
+//    线程退出时也整个还掉（见ConcurrentAlloc.hpp）
+// 5. 闲置的线程(ReclaimIdle)：突发之后就不再申请释放的线程碰不到上面的时机，由别的线程替它还：
+//    默认的堆上的ThreadCache都登记在_sCaches上，任何线程做定期回收时顺便扫一遍，
+//    从上一次扫描到现在一次慢路径都没走过、现在又睡在系统调用里的，整个还给CentralCache；RequestReleaseAll不等两轮，马上还
+// 批次大小、上面几个参数都可以运行时调（见Tuning.hpp），快路径上用的两个在这里各存一份，慢路径上发现改了再换
+static const size_t MAX_OVERAGES = 3;
+
+// 别的线程回收闲置的ThreadCache时和主人线程的同步，快路径上什么都不用做：
+//     主人：只在进出慢路径（FetchFromCentralCache、ListTooLong、OnSlowPath、Scavenge等，见SlowPathScope）时把_activity加一，
+//           奇数表示在慢路径里（里面可能睡在锁上）；快路径每次都从pTLSThreadCache取ThreadCache（GetThreadCache）
+//     回收的线程：先把主人的pTLSThreadCache置空，再确认主人睡在系统调用里(/proc里是S状态)、_activity还是扫描时的偶数，
+//           才去动链表，做完再把pTLSThreadCache装回去
+// 快路径里没有系统调用，主人睡着就不在快路径中间；这时醒来的话看到pTLSThreadCache是空的，在GetThreadCache里等回收做完。
+// 判断不了的情况：信号处理函数打断了快路径，又在处理函数里睡眠，会被当成闲置，这样的程序要用-DHC_NO_IDLE_RECLAIM
 class ThreadCache
 {
 private:
     FreeList _freeLists[NFREELIST];
+    size_t _cachedBytes = 0;        // 所有自由链表里的内存一共多少字节
+    size_t _maxCachedBytes = HcTuning::GetInstance()->_threadCacheMaxBytes.load(std::memory_order_relaxed);
+    size_t _scavengeCountdown = HcTuning::GetInstance()->_scavengePeriod.load(std::memory_order_relaxed);  // 还有多少次释放就要回收一次
+    size_t _releaseEpoch = 0;       // 最后一次响应RequestReleaseAll时的_sReleaseEpoch
+    size_t _tuningGeneration = HcTuning::GetInstance()->Generation();
+    CentralCache* _central = CentralCache::GetInstance();   // hc_heap_create创建的堆上的ThreadCache指向堆自己的
+
+    // 跨线程回收用，见上面
+    std::atomic<size_t> _activity{ 0 };         // 主人进出慢路径时各加一，奇数表示在慢路径里
+    size_t _slowDepth = 0;                      // 慢路径的嵌套层数，只有主人线程读写
+    size_t _idleActivity = 1;                   // 上一次扫描时看到的_activity（初值是奇数，第一次扫描不算闲置）；它和下面几个由_sCachesMtx保护
+    size_t _drainedActivity = 1;                // 最后一次被别的线程还掉时的_activity，之后没走过慢路径就不用再还
+    ThreadCache** _slot = nullptr;              // 主人线程的pTLSThreadCache
+    long _tid = 0;                              // 主人线程的内核线程号
+    ThreadCache* _prevCache = nullptr;          // 在_sCaches上的前后
+    ThreadCache* _nextCache = nullptr;
+
+    static std::atomic<size_t> _sReleaseEpoch;     // 定义在HcMalloc.cc
+    static ThreadCache* _sCaches;                  // 默认的堆上所有线程的ThreadCache
+    static std::mutex _sCachesMtx;
+
+    // 慢路径的进出，可以嵌套，只有最外层改_activity
+    struct SlowPathScope
+    {
+        ThreadCache* _tc;
+
+        SlowPathScope(ThreadCache* tc)
+            : _tc(tc)
+        {
+#ifdef HC_IDLE_RECLAIM
+            if (_tc->_slowDepth++ == 0)
+                _tc->_activity.store(_tc->_activity.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#endif
+        }
+
+        ~SlowPathScope()
+        {
+#ifdef HC_IDLE_RECLAIM
+            if (--_tc->_slowDepth == 0)
+                _tc->_activity.store(_tc->_activity.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+#endif
+        }
+    };
 public:
-    // 申请内存
+    // 申请内存，到了堆的硬上限时返回nullptr
     void* Allocate(size_t size)
     {
-        assert(size < MAX_BYTES);
-        // 计算申请的内存在对齐后，实际要申请的大小
-        size_t alignSize = SizeClass::RoundUp(size);
-        // 计算下标（位于哪个哈希桶
-        size_t index = SizeClass::Index(size);
+        assert(size <= MAX_BYTES);
+        // 计算下标（位于哪个哈希桶），以及申请的内存在对齐后实际要申请的大小
+        return Allocate(SizeClass::Index(size), SizeClass::RoundUp(size));
+    }
+
+    // 大小在编译期已知：下标和对齐后的大小都是常量，只剩下链表的头删
+    template <size_t N>
+    void* Allocate()
+    {
+        static_assert(N <= MAX_BYTES, "ThreadCache::Allocate<N> only serves small objects");
+        constexpr size_t index = SizeClass::Index(N);
+        constexpr size_t alignSize = SizeClass::RoundUp(N);
+        return Allocate(index, alignSize);
+    }
+
+    // 释放内存
+    void Deallocate(void* ptr, size_t size)
+    {
+        assert(ptr);
+        assert(size <= MAX_BYTES);
+
+        // 计算在哪个桶，然后插到桶里去
+        Deallocate(ptr, SizeClass::Index(size), SizeClass::RoundUp(size));
+    }
+
+    template <size_t N>
+    void Deallocate(void* ptr)
+    {
+        static_assert(N <= MAX_BYTES, "ThreadCache::Deallocate<N> only serves small objects");
+        assert(ptr);
+        constexpr size_t index = SizeClass::Index(N);
+        constexpr size_t alignSize = SizeClass::RoundUp(N);
+        Deallocate(ptr, index, alignSize);
+    }
+
+    // 下标和对齐后的大小都已经算好的申请和释放，运行期大小、编译期大小的入口和按PageMap里的大小类释放都走这里
+    void* Allocate(size_t index, size_t alignSize)
+    {
         // ThreadCache里面有就直接用，没有则向CentralCache里申请
         if(!_freeLists[index].Empty())
         {
+            _cachedBytes -= alignSize;
             return _freeLists[index].Pop();
         }
         else
@@ -31,51 +141,80 @@ public:
         }
     }
 
-    // 释放内存
-    void Deallocate(void* ptr, size_t size)
+    void Deallocate(void* ptr, size_t index, size_t alignSize)
     {
-        assert(ptr);
-        assert(size < MAX_BYTES);
-
-        // 计算在哪个桶，然后插到桶里去
-        size_t index = SizeClass::Index(size);
         _freeLists[index].Push(ptr);
+        _cachedBytes += alignSize;
 
         // 如果桶下的内存块的数量大于一个批次的数量时，就归还一定的内存给CentralCache
         if(_freeLists[index].Size() >= _freeLists[index].MaxSize())
         {
-            ListTooLong(_freeLists[index], size);
+            ListTooLong(_freeLists[index], alignSize);
+        }
+        else if (_cachedBytes > _maxCachedBytes)
+        {
+            // 超过上限时不管闲不闲置，每个链表都还一半，否则正在用的链表攒多了会每次释放都来回收一遍
+            Scavenge(true);
+        }
+        else if (--_scavengeCountdown == 0)
+        {
+            _scavengeCountdown = HcTuning::GetInstance()->_scavengePeriod.load(std::memory_order_relaxed);
+            Scavenge();
+            ReclaimIdle(this, false);
         }
-
     }
 
     // 将内存还给CentralCache, 第二个参数是内存块大小
-    void ListTooLong(FreeList& list, size_t size)
+    // 和FetchFromCentralCache一样不内联，快路径上只留下链表操作
+    __attribute__((noinline)) void ListTooLong(FreeList& list, size_t size)
     {
-        void* start = nullptr;
-        void* end = nullptr;
-        list.PopRange(start, end, list.MaxSize());
+        SlowPathScope scope(this);
+        // 只还一批，剩下的留着，避免下一次申请又要去CentralCache拿
+        size_t batchNum = HcTuning::GetInstance()->NumMoveSize(SizeClass::RoundUp(size));
+        HC_PROBE4(tc_list_too_long, SizeClass::Index(size), size, min(list.Size(), batchNum), list.Size());
+        ReleaseToCentralCache(list, size, min(list.Size(), batchNum));
+
+        // 反复超长说明_maxSize太大了，调小一批
+        if (list.MaxSize() > batchNum && ++list.Overages() > MAX_OVERAGES)
+        {
+            list.MaxSize() -= batchNum;
+            list.Overages() = 0;
+        }
 
-        CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+        OnSlowPath();
     }
 
     // 从CentralCache中申请内存
-    void* FetchFromCentralCache(size_t index, size_t size)
+    __attribute__((noinline)) void* FetchFromCentralCache(size_t index, size_t size)
     {
+        SlowPathScope scope(this);
         // ThreadCache申请时需要申请一批内存块，不能太多也不能太少
         // 这里采用慢启动反馈调节算法
         // 一次一批，每次逐渐增多，直到达到上限
-        size_t batchNum = min(_freeLists[index].MaxSize(), SizeClass::NumMoveSize(size));
-        if(batchNum == _freeLists[index].MaxSize())
+        size_t numMove = HcTuning::GetInstance()->NumMoveSize(size);
+        size_t batchNum = min(_freeLists[index].MaxSize(), numMove);
+        if(_freeLists[index].MaxSize() < numMove)
         {
-            _freeLists[index].MaxSize() += 3;
+            _freeLists[index].MaxSize() += HcTuning::GetInstance()->_slowStartStep.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            // 已经是整批整批地拿了还会空，说明这个链表用得多，允许它多攒一批，最多两批
+            // 再多的话存活对象会散在更多span上，CentralCache的span还不回PageCache
+            _freeLists[index].MaxSize() = min(_freeLists[index].MaxSize() + numMove, 2 * numMove);
         }
         // batchNum最小为1
 
         void* start = nullptr;
         void* end = nullptr;
-        size_t actualNum = CentralCache::GetInstance()->FetchRangeObj(start, end, batchNum, size);
-        assert(actualNum > 0);
+        size_t actualNum = _central->FetchRangeObj(start, end, batchNum, size);
+        HC_PROBE4(tc_fetch, index, size, batchNum, actualNum);
+
+        OnSlowPath();
+
+        // 到了堆的硬上限
+        if (actualNum == 0)
+            return nullptr;
 
         if(actualNum == 1)
         {
@@ -87,8 +226,228 @@ public:
         {
             // 插入ThreadCache的自由链表
             _freeLists[index].PushRange(NextObj(start), end, actualNum - 1);
+            _cachedBytes += (actualNum - 1) * size;
             return start;
         }
     }
-};
 
+    // 回收闲置的内存：每个链表自上次回收以来一直没用到的部分（低水位）还一半回去
+    // force为true时按链表的实际长度而不是低水位来还
+    void Scavenge(bool force = false)
+    {
+        SlowPathScope scope(this);
+        for (size_t i = 0; i < NFREELIST; ++i)
+        {
+            FreeList& list = _freeLists[i];
+            size_t size = SizeClass::ClassSize(i);
+
+            size_t lowWater = force ? list.Size() : list.LowWater();
+            if (lowWater > 0)
+            {
+                ReleaseToCentralCache(list, size, lowWater > 1 ? lowWater / 2 : 1);
+            }
+
+            size_t batchNum = HcTuning::GetInstance()->NumMoveSize(size);
+            if (list.MaxSize() > batchNum)
+            {
+                list.MaxSize() = std::max(list.MaxSize() - batchNum, batchNum);
+            }
+            list.ClearLowWater();
+        }
+    }
+
+    // 把所有链表里的内存都还给CentralCache，线程退出时调用
+    void ReleaseAll()
+    {
+        SlowPathScope scope(this);
+        DrainLists();
+    }
+
+    // 预热：第index个链表先放进count块，_maxSize至少调到count再多一批，释放时不会马上又还回去
+    // 整个ThreadCache最多放到thread_cache_max_bytes，再多的话第一次释放就会还一半；到了堆的硬上限时提前停下
+    void Prefill(size_t index, size_t count)
+    {
+        SlowPathScope scope(this);
+        FreeList& list = _freeLists[index];
+        size_t size = SizeClass::ClassSize(index);
+        size_t batchNum = HcTuning::GetInstance()->NumMoveSize(size);
+        list.MaxSize() = std::max(list.MaxSize(), count + batchNum);
+        while (list.Size() < count && _cachedBytes + size <= _maxCachedBytes)
+        {
+            size_t want = std::min({ count - list.Size(), batchNum, (_maxCachedBytes - _cachedBytes) / size });
+            void* start = nullptr;
+            void* end = nullptr;
+            size_t actualNum = _central->FetchRangeObj(start, end, want, size);
+            if (actualNum == 0)
+                break;
+            list.PushRange(start, end, actualNum);
+            _cachedBytes += actualNum * size;
+        }
+        list.ClearLowWater();
+    }
+
+    // 第index个链表现在的_maxSize，也就是这个线程在这个大小类上学到的缓存多少块合适
+    size_t ListMaxSize(size_t index)
+    {
+        return _freeLists[index].MaxSize();
+    }
+
+    // 要求所有线程把ThreadCache整个还掉：现在没在用的马上由当前线程替它们还，正在用的在下一次走慢路径时自己还
+    static void RequestReleaseAll()
+    {
+        ++_sReleaseEpoch;
+        ReclaimIdle(nullptr, true);
+    }
+
+    // 登记到_sCaches上，之后闲置时别的线程可以替它还（只有默认的堆上的ThreadCache登记）
+    // slot是主人线程的pTLSThreadCache，回收时要先把它置空
+    void Register(ThreadCache** slot)
+    {
+        std::lock_guard<std::mutex> lock(_sCachesMtx);
+        _slot = slot;
+#ifdef HC_IDLE_RECLAIM
+        _tid = syscall(SYS_gettid);
+#endif
+        _nextCache = _sCaches;
+        if (_sCaches)
+            _sCaches->_prevCache = this;
+        _sCaches = this;
+    }
+
+    // 线程退出时先注销再ReleaseAll：注销要等正在进行的扫描结束，之后别的线程不会再碰它
+    void Unregister()
+    {
+        std::lock_guard<std::mutex> lock(_sCachesMtx);
+        if (_prevCache)
+            _prevCache->_nextCache = _nextCache;
+        else
+            _sCaches = _nextCache;
+        if (_nextCache)
+            _nextCache->_prevCache = _prevCache;
+        _prevCache = _nextCache = nullptr;
+    }
+
+    // 把别的线程闲置的ThreadCache整个还给CentralCache，返回还了几个
+    // 闲置：上一次扫描到现在_activity没变过，也就是一次慢路径都没走过，并且现在睡在系统调用里；force时不用等两次扫描
+    // 同一时间只有一个线程扫描，别的线程正在扫描时直接返回；self是调用者自己的ThreadCache，不扫
+    static size_t ReclaimIdle(ThreadCache* self, bool force)
+    {
+#ifndef HC_IDLE_RECLAIM
+        return 0;
+#else
+        std::unique_lock<std::mutex> lock(_sCachesMtx, std::try_to_lock);
+        if (!lock.owns_lock())
+            return 0;
+
+        size_t reclaimed = 0;
+        for (ThreadCache* tc = _sCaches; tc; tc = tc->_nextCache)
+        {
+            size_t activity = tc->_activity.load(std::memory_order_acquire);
+            bool idle = tc != self && activity % 2 == 0 && activity != tc->_drainedActivity
+                && (force || activity == tc->_idleActivity);
+            tc->_idleActivity = activity;
+            // 正在跑的线程先不打扰，省得它下一次申请释放要来等这把锁
+            if (!idle || !ThreadSleeping(tc->_tid))
+                continue;
+
+            // 先收走再确认：确认之后主人醒来的话，看到的pTLSThreadCache是空的
+            __atomic_store_n(tc->_slot, nullptr, __ATOMIC_SEQ_CST);
+            if (ThreadSleeping(tc->_tid) && tc->_activity.load(std::memory_order_acquire) == activity)
+            {
+                tc->DrainLists();
+                tc->_drainedActivity = activity;
+                ++reclaimed;
+            }
+            __atomic_store_n(tc->_slot, tc, __ATOMIC_RELEASE);
+        }
+        return reclaimed;
+#endif
+    }
+
+    // pTLSThreadCache是空的但是线程已经有ThreadCache：别的线程正在回收它，回收的线程拿着_sCachesMtx，拿到锁时已经装回去了
+    static void WaitReclaim()
+    {
+        std::lock_guard<std::mutex> lock(_sCachesMtx);
+    }
+
+    void SetCentralCache(CentralCache* central)
+    {
+        _central = central;
+    }
+
+    // 当前缓存了多少字节
+    size_t CachedBytes() const
+    {
+        return _cachedBytes;
+    }
+
+private:
+    void DrainLists()
+    {
+        for (size_t i = 0; i < NFREELIST; ++i)
+        {
+            FreeList& list = _freeLists[i];
+            if (!list.Empty())
+            {
+                ReleaseToCentralCache(list, SizeClass::ClassSize(i), list.Size());
+            }
+            list.MaxSize() = 1;
+            list.Overages() = 0;
+            list.ClearLowWater();
+        }
+    }
+
+#ifdef HC_IDLE_RECLAIM
+    // 线程现在是不是睡在系统调用里：/proc里的状态是S。D状态可能是快路径中间碰到缺页，不算
+    static bool ThreadSleeping(long tid)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%ld/stat", tid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        char buf[256];
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0)
+            return false;
+        buf[n] = '\0';
+        // 第二项是括号里的线程名，名字里也可能有括号，从最后一个')'往后看
+        const char* p = strrchr(buf, ')');
+        return p && p[1] == ' ' && p[2] == 'S';
+    }
+#endif
+
+    void ReleaseToCentralCache(FreeList& list, size_t size, size_t n)
+    {
+        if (n == 0)
+            return;
+
+        void* start = nullptr;
+        void* end = nullptr;
+        list.PopRange(start, end, n);
+        _cachedBytes -= n * SizeClass::RoundUp(size);
+
+        _central->ReleaseListToSpans(start, size);
+    }
+
+    // 两个计数都只增不减，和变了说明其中一个变了
+    void OnSlowPath()
+    {
+        SlowPathScope scope(this);
+        size_t epoch = _sReleaseEpoch.load(std::memory_order_relaxed) + _central->GetPageCache()->PressureEpoch();
+        if (epoch != _releaseEpoch)
+        {
+            _releaseEpoch = epoch;
+            DrainLists();
+        }
+
+        // 参数改了：换上新的上限，回收间隔等这一轮数完再换
+        size_t generation = HcTuning::GetInstance()->Generation();
+        if (generation != _tuningGeneration)
+        {
+            _tuningGeneration = generation;
+            _maxCachedBytes = HcTuning::GetInstance()->_threadCacheMaxBytes.load(std::memory_order_relaxed);
+        }
+    }
+};
@@ -0,0 +1,260 @@
+// trace回放工具：按原来的线程划分和先后约束重放一份 AllocTrace 记录下来的trace
+// 用法：tracereplay <trace文件> [--histogram 输出文件]
+//
+// 分别用内存池(ConcurrentAlloc/ConcurrentFree)和glibc(malloc/free)各回放一次，
+// 每次在一个fork出来的子进程里跑，这样两者的峰值RSS互不影响。输出：
+//   耗时      回放所有操作的墙上时间
+//   峰值RSS   子进程回放期间RSS的最大增长量
+//   碎片率    峰值RSS / 峰值存活字节数（存活字节数由trace本身算出，和分配器无关）
+//
+// 先后约束：每个线程按原来的顺序执行自己的操作；释放别的线程申请的对象时，要等那次申请回放完
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <map>
+#include <chrono>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ConcurrentAlloc.hpp"
+#include "AllocTrace.hpp"
+
+// 回放时的一次操作
+struct ReplayOp
+{
+    uint32_t _op;
+    size_t _size;
+    size_t _obj;        // 对象编号，同一地址的每次申请都是一个新对象
+};
+
+struct Replay
+{
+    std::vector<std::vector<ReplayOp>> _threads;    // 每个线程的操作序列
+    size_t _nobjs = 0;
+    size_t _nops = 0;
+    size_t _peakLive = 0;                           // 按时间顺序算出来的峰值存活字节数
+};
+
+static bool LoadTrace(const char* path, std::vector<TraceRecord>& records)
+{
+    FILE* fp = fopen(path, "rb");
+    if (fp == nullptr)
+        return false;
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header._magic, "HCTRACE1", 8) != 0
+        || header._recordSize != sizeof(TraceRecord))
+    {
+        fclose(fp);
+        return false;
+    }
+
+    TraceRecord rec;
+    while (fread(&rec, sizeof(rec), 1, fp) == 1)
+    {
+        records.push_back(rec);
+    }
+    fclose(fp);
+
+    std::stable_sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a._time < b._time;
+        });
+    return true;
+}
+
+// 把地址换成对象编号，丢掉trace开始之前申请的对象的释放
+static void BuildReplay(const std::vector<TraceRecord>& records, Replay& replay)
+{
+    std::unordered_map<uint64_t, std::pair<size_t, size_t>> live;     // 地址 -> (对象编号, 大小)
+    size_t liveBytes = 0;
+
+    for (const TraceRecord& rec : records)
+    {
+        if (rec._tid >= replay._threads.size())
+            replay._threads.resize(rec._tid + 1);
+
+        if (rec._op == TRACE_ALLOC)
+        {
+            // 和malloc(0)一样，0字节按1字节申请
+            size_t size = rec._size ? (size_t)rec._size : 1;
+            size_t obj = replay._nobjs++;
+            live[rec._obj] = std::make_pair(obj, size);
+            replay._threads[rec._tid].push_back({ TRACE_ALLOC, size, obj });
+
+            liveBytes += size;
+            replay._peakLive = std::max(replay._peakLive, liveBytes);
+        }
+        else
+        {
+            auto it = live.find(rec._obj);
+            if (it == live.end())
+                continue;
+
+            replay._threads[rec._tid].push_back({ TRACE_FREE, it->second.second, it->second.first });
+            liveBytes -= it->second.second;
+            live.erase(it);
+        }
+        ++replay._nops;
+    }
+}
+
+static void WriteHistogram(const char* path, const Replay& replay)
+{
+    std::map<size_t, size_t> hist;
+    for (auto& ops : replay._threads)
+    {
+        for (auto& op : ops)
+        {
+            if (op._op == TRACE_ALLOC)
+                ++hist[op._size];
+        }
+    }
+
+    FILE* fp = fopen(path, "w");
+    if (fp == nullptr)
+        return;
+    fprintf(fp, "# size count\n");
+    for (auto& kv : hist)
+    {
+        fprintf(fp, "%zu %zu\n", kv.first, kv.second);
+    }
+    fclose(fp);
+}
+
+// 从 /proc/self/status 读一项，单位KB
+static size_t ReadStatusKB(const char* key)
+{
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp == nullptr)
+        return 0;
+
+    char line[256];
+    size_t kb = 0;
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, key, len) == 0)
+        {
+            kb = strtoul(line + len + 1, nullptr, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+template <class Alloc, class Free>
+static void RunReplay(const char* name, const Replay& replay, Alloc alloc, Free free)
+{
+    std::vector<std::atomic<void*>> objs(replay._nobjs);
+    for (auto& obj : objs)
+        obj.store(nullptr, std::memory_order_relaxed);
+
+    size_t baseRSS = ReadStatusKB("VmRSS:");
+    auto begin = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> vthread;
+    for (auto& ops : replay._threads)
+    {
+        vthread.emplace_back([&]() {
+            for (const ReplayOp& op : ops)
+            {
+                if (op._op == TRACE_ALLOC)
+                {
+                    char* ptr = (char*)alloc(op._size);
+                    // 每页写一下，让RSS反映真实的使用情况
+                    for (size_t off = 0; off < op._size; off += 4096)
+                        ptr[off] = 1;
+                    objs[op._obj].store(ptr, std::memory_order_release);
+                }
+                else
+                {
+                    void* ptr;
+                    while ((ptr = objs[op._obj].load(std::memory_order_acquire)) == nullptr)
+                        std::this_thread::yield();
+                    free(ptr, op._size);
+                }
+            }
+            });
+    }
+
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    size_t peakRSS = ReadStatusKB("VmHWM:") - baseRSS;
+
+    printf("%-8s 线程: %zu  操作: %zu  耗时: %lld ms  峰值RSS: %zu KB  峰值存活: %zu KB  碎片率: %.2f\n",
+        name, replay._threads.size(), replay._nops,
+        (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count(),
+        peakRSS, replay._peakLive / 1024,
+        replay._peakLive ? (double)peakRSS * 1024 / replay._peakLive : 0.0);
+}
+
+// 在子进程里回放，峰值RSS只统计这一次回放
+template <class Alloc, class Free>
+static void RunInChild(const char* name, const Replay& replay, Alloc alloc, Free free)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        RunReplay(name, replay, alloc, free);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* tracePath = nullptr;
+    const char* histPath = nullptr;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--histogram" && i + 1 < argc)
+            histPath = argv[++i];
+        else
+            tracePath = argv[i];
+    }
+
+    if (tracePath == nullptr)
+    {
+        fprintf(stderr, "usage: %s <trace> [--histogram out.txt]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<TraceRecord> records;
+    if (!LoadTrace(tracePath, records))
+    {
+        fprintf(stderr, "cannot read trace: %s\n", tracePath);
+        return 1;
+    }
+
+    Replay replay;
+    BuildReplay(records, replay);
+    records.clear();
+    records.shrink_to_fit();
+
+    if (histPath)
+    {
+        WriteHistogram(histPath, replay);
+        printf("直方图已写入 %s\n", histPath);
+    }
+
+    RunInChild("pool", replay,
+        [](size_t size) { return ConcurrentAlloc(size); },
+        [](void* ptr, size_t size) { ConcurrentFree(ptr, size); });
+
+    RunInChild("glibc", replay,
+        [](size_t size) { return malloc(size); },
+        [](void* ptr, size_t) { free(ptr); });
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdlib>
+
+#include "Common.hpp"
+
+// 运行时可调的参数：以前写死在代码里，想试一个别的值就要重新编译、重新部署
+// 两种改法：
+//     HCMALLOC_THREAD_CACHE_MAX_BYTES=8M ./server     // 环境变量，第一次用到分配器时读一次，可以带K/M/G
+//     hc_set_property("thread_cache_max_bytes", 8 << 20);   // 运行中随时改，见ConcurrentAlloc.hpp
+// 名字（环境变量是HCMALLOC_加上名字的大写）、默认值和范围：
+//     thread_cache_max_bytes      4MB     64KB..1GB   每个线程最多缓存多少字节
+//     batch_min                   2       1..4096     ThreadCache和CentralCache之间一批最少多少块
+//     batch_max                   512     1..4096     一批最多多少块（比batch_min小时以它为准）
+//     slow_start_step             3       1..4096     链表空了、还没到一批时_maxSize每次加多少
+//     scavenge_period             4096    1..2^30     每个线程每多少次释放回收一次闲置的缓存，越小还得越快
+//     page_cache_max_free_bytes   0       0..2^62     默认的PageCache最多留多少字节空闲的页，多的还给系统；0表示不限
+//
+// 改了以后已经在用的缓存不会马上变：ThreadCache在下一次走慢路径时换上新的上限，
+// 链表多出来的部分按原来的规则慢慢还回去；已经切好的span保持原来的大小。所以任何时候改都是安全的
+// MAX_BYTES、NPAGES、PAGE_SHIFT决定了大小类表和页号映射的形状，只能编译时改
+
+class HcTuning
+{
+public:
+    std::atomic<size_t> _threadCacheMaxBytes{ 4 * 1024 * 1024 };
+    std::atomic<size_t> _batchMin{ 2 };
+    std::atomic<size_t> _batchMax{ 512 };
+    std::atomic<size_t> _slowStartStep{ 3 };
+    std::atomic<size_t> _scavengePeriod{ 4096 };
+    std::atomic<size_t> _pageCacheMaxFreeBytes{ 0 };
+
+    // 每改一次加一，ThreadCache在慢路径上看到它变了就重新读一遍上面的值
+    std::atomic<size_t> _generation{ 0 };
+
+    struct Property
+    {
+        const char* _name;
+        std::atomic<size_t> HcTuning::* _field;
+        size_t _min;
+        size_t _max;
+    };
+
+    static constexpr Property _sProperties[] = {
+        { "thread_cache_max_bytes", &HcTuning::_threadCacheMaxBytes, 64 * 1024, (size_t)1 << 30 },
+        { "batch_min", &HcTuning::_batchMin, 1, 4096 },
+        { "batch_max", &HcTuning::_batchMax, 1, 4096 },
+        { "slow_start_step", &HcTuning::_slowStartStep, 1, 4096 },
+        { "scavenge_period", &HcTuning::_scavengePeriod, 1, (size_t)1 << 30 },
+        { "page_cache_max_free_bytes", &HcTuning::_pageCacheMaxFreeBytes, 0, (size_t)1 << 62 },
+    };
+
+    constexpr HcTuning() = default;
+    HcTuning(const HcTuning&) = delete;
+
+    static constexpr HcTuning* GetInstance()
+    {
+        return &_sInst;
+    }
+
+    static const Property* Find(const char* name)
+    {
+        for (const Property& prop : _sProperties)
+        {
+            if (strcmp(prop._name, name) == 0)
+                return &prop;
+        }
+        return nullptr;
+    }
+
+    // 超出范围返回false，不改
+    bool Set(const Property& prop, size_t value)
+    {
+        if (value < prop._min || value > prop._max)
+            return false;
+        (this->*prop._field).store(value, std::memory_order_relaxed);
+        _generation.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Get(const Property& prop) const
+    {
+        return (this->*prop._field).load(std::memory_order_relaxed);
+    }
+
+    // 第一次用到分配器时读环境变量（创建ThreadCache、向系统申请页的时候）
+    // 只有getenv和解析数字，不申请内存，main之前、持有_pageMtx时调用都可以
+    void LoadEnvironment()
+    {
+        if (_envState.load(std::memory_order_acquire) == ENV_LOADED)
+            return;
+
+        int expected = ENV_NONE;
+        if (!_envState.compare_exchange_strong(expected, ENV_LOADING, std::memory_order_acquire))
+        {
+            // 别的线程正在读，等它读完，保证返回以后看到的是环境变量里的值
+            while (_envState.load(std::memory_order_acquire) != ENV_LOADED)
+                std::this_thread::yield();
+            return;
+        }
+
+        for (const Property& prop : _sProperties)
+        {
+            char env[64] = "HCMALLOC_";
+            size_t len = strlen(env);
+            for (const char* p = prop._name; *p && len + 1 < sizeof(env); ++p)
+                env[len++] = (*p >= 'a' && *p <= 'z') ? (char)(*p - 'a' + 'A') : *p;
+            env[len] = '\0';
+
+            size_t value = 0;
+            const char* text = getenv(env);
+            // 写错了的值不理，保持默认值
+            if (text && ParseSize(text, &value))
+                Set(prop, value);
+        }
+        _envState.store(ENV_LOADED, std::memory_order_release);
+    }
+
+    size_t Generation() const
+    {
+        return _generation.load(std::memory_order_acquire);
+    }
+
+    // 按现在的批次上下限算的SizeClass::NumMoveSize、NumMovePage
+    size_t NumMoveSize(size_t size) const
+    {
+        return SizeClass::NumMoveSize(size, _batchMin.load(std::memory_order_relaxed), _batchMax.load(std::memory_order_relaxed));
+    }
+
+    size_t NumMovePage(size_t size) const
+    {
+        return SizeClass::NumMovePage(size, _batchMin.load(std::memory_order_relaxed), _batchMax.load(std::memory_order_relaxed));
+    }
+
+    // "123"、"64K"、"8M"、"1G"，后面不能再有别的字符
+    static bool ParseSize(const char* text, size_t* value)
+    {
+        char* end = nullptr;
+        unsigned long long num = strtoull(text, &end, 10);
+        if (end == text)
+            return false;
+
+        int shift = 0;
+        switch (*end)
+        {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        default: break;
+        }
+        if (*end != '\0' || num > (SIZE_MAX >> shift))
+            return false;
+
+        *value = (size_t)num << shift;
+        return true;
+    }
+
+private:
+    static const int ENV_NONE = 0;
+    static const int ENV_LOADING = 1;
+    static const int ENV_LOADED = 2;
+    std::atomic<int> _envState{ ENV_NONE };
+
+    static HcTuning _sInst;     // 常量初始化，定义在HcMalloc.cc
+};
@@ -1,6 +1,23 @@
 #pragma once
 
+#include <iostream>
+#include <filesystem>
+#include <sys/wait.h>
+#include <elf.h>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <condition_variable>
+
 #include "ConcurrentAlloc.hpp"
+#include "ConcurrentArena.hpp"
+#include "HcHeap.hpp"
+#include "ShmPool.hpp"
+#include "Warmup.hpp"
+#include "HcBuffer.hpp"
+
+using std::cout;
+using std::endl;
 
 
 // void Alloc1()
@@ -52,4 +69,1001 @@ void TLStest()
     // std::thread t2(Alloc2);
     // t2.join();
     t1.join();
-}
\ No newline at end of file
+}
+
+// 同一个线程上_spanPages不同的arena共用一个span缓存，拿到的span不能比要的小
+static void ArenaCheckSpan(void* ptr, size_t bytes)
+{
+    Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+    char* end = (char*)(span->_pageId << PAGE_SHIFT) + ((size_t)span->_n << PAGE_SHIFT);
+    assert((char*)ptr + bytes <= end);
+    memset(ptr, 0, bytes);
+}
+
+void ArenaTest()
+{
+    // 新线程，span缓存是空的
+    std::thread t([]() {
+        {
+            ConcurrentArena small(16);
+            ArenaCheckSpan(small.Allocate(100), 100);
+        }
+        // 缓存里是16页的span，32页的arena不能拿它
+        {
+            ConcurrentArena big(32);
+            ArenaCheckSpan(big.Allocate(200 * 1024), 200 * 1024);
+        }
+        // 两种都在缓存里，各拿各的
+        for (int i = 0; i < 4; ++i)
+        {
+            ConcurrentArena small(16);
+            ConcurrentArena big(32);
+            ArenaCheckSpan(small.Allocate(120 * 1024), 120 * 1024);
+            ArenaCheckSpan(big.Allocate(250 * 1024), 250 * 1024);
+        }
+        });
+    t.join();
+
+    // 缓存按字节封顶；堆碰到软上限以后，下一次用到缓存时先整个还掉
+    std::thread([]() {
+        ArenaSpanCache* cache = ArenaSpanCache::GetInstance();
+        for (int i = 0; i < 2; ++i)
+        {
+            ConcurrentArena arena(64);
+            for (int j = 0; j < 3; ++j)
+                ArenaCheckSpan(arena.Allocate(400 * 1024), 400 * 1024);
+        }
+        assert(cache->Bytes() > 0 && cache->Bytes() <= ARENA_CACHE_BYTES);
+
+        PageCache::GetInstance()->SetHeapLimit(1, 0);
+        PageCache::GetInstance()->SetHeapLimit(0, 0);
+        {
+            ConcurrentArena arena(16);
+            ArenaCheckSpan(arena.Allocate(100), 100);
+        }
+        assert(cache->Bytes() == (16 << PAGE_SHIFT));
+        }).join();
+    cout << "ArenaTest: 不同页数的arena共用span缓存正常" << endl;
+}
+
+#ifdef HC_GUARDED_SAMPLING
+// 采样保护：在子进程里制造越界写和释放后使用，子进程应该被SIGSEGV杀掉
+// 每次都抽样（rate为1时间隔在[1,2]之间，先连续申请几次保证拿到保护区里的对象）
+static void* GuardedAllocOne(size_t size)
+{
+    GuardedPool::GetInstance()->SetSampleRate(1);
+    // 本线程在关闭采样时申请过的话（例如main之前），计数器还停在关闭时的间隔上
+    tlsGuardedCountdown = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        void* ptr = ConcurrentAlloc(size);
+        if (GuardedPool::GetInstance()->Contains(ptr))
+            return ptr;
+        ConcurrentFree(ptr);
+    }
+    assert(false);
+    return nullptr;
+}
+
+static bool DiesWithSegv(void (*fn)())
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        fn();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+void GuardedTest()
+{
+    // 正常的申请释放不受影响
+    char* ptr = (char*)GuardedAllocOne(24);
+    memset(ptr, 0, 24);
+    ConcurrentFree(ptr);
+    ptr = (char*)GuardedAllocOne(24);
+    ConcurrentFree(ptr, 24);
+    // 关掉采样以后，之前抽到的对象带大小释放也要认得出来
+    ptr = (char*)GuardedAllocOne(24);
+    GuardedPool::GetInstance()->SetSampleRate(0);
+    ConcurrentFree(ptr, 24);
+    ConcurrentFree<24>(GuardedAllocOne(24));
+    GuardedPool::GetInstance()->SetSampleRate(0);
+
+    bool overflow = DiesWithSegv([]() {
+        char* p = (char*)GuardedAllocOne(24);
+        p[24] = 1;
+        });
+    bool useAfterFree = DiesWithSegv([]() {
+        char* p = (char*)GuardedAllocOne(24);
+        ConcurrentFree(p);
+        p[0] = 1;
+        });
+
+    cout << "GuardedTest overflow: " << (overflow ? "caught" : "MISSED") << endl;
+    cout << "GuardedTest use-after-free: " << (useAfterFree ? "caught" : "MISSED") << endl;
+    assert(overflow && useAfterFree);
+}
+#endif
+
+// 堆上限：申请到硬上限为止，hc_malloc返回nullptr，ConcurrentAlloc调用new_handler或者抛bad_alloc；
+// 还回一部分以后又能申请，全部还回以后向系统申请的内存回到软上限以下
+static std::vector<void*>* heapLimitBlocks = nullptr;
+
+static void HeapLimitNewHandler()
+{
+    // 还掉一半，之后ConcurrentAlloc重试就能成功
+    size_t half = heapLimitBlocks->size() / 2;
+    for (size_t i = 0; i < half; ++i)
+    {
+        hc_free(heapLimitBlocks->back());
+        heapLimitBlocks->pop_back();
+    }
+    std::set_new_handler(nullptr);
+}
+
+void HeapLimitTest()
+{
+    const size_t soft = 16 * 1024 * 1024;
+    const size_t hard = 32 * 1024 * 1024;
+    const size_t sizes[] = { 24, 1000, 40 * 1024, 600 * 1024 };
+    PageCache* pageCache = PageCache::GetInstance();
+
+    // 在一个新线程里跑，和别的测试的ThreadCache分开
+    std::thread t([&]() {
+        pageCache->SetHeapLimit(soft, hard);
+
+        std::vector<void*> blocks;
+        heapLimitBlocks = &blocks;
+        size_t k = 0;
+        while (void* ptr = hc_malloc(sizes[k++ % 4]))
+        {
+            memset(ptr, 1, 24);
+            blocks.push_back(ptr);
+        }
+        size_t filled = blocks.size();
+        assert(pageCache->MappedBytes() <= hard);
+        assert(pageCache->MappedBytes() > soft);
+
+        // 没有new_handler时抛std::bad_alloc
+        bool thrown = false;
+        try
+        {
+            ConcurrentAlloc(600 * 1024);
+        }
+        catch (const std::bad_alloc&)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+
+        // new_handler还掉一半以后重试成功
+        std::set_new_handler(HeapLimitNewHandler);
+        void* ptr = ConcurrentAlloc(600 * 1024);
+        assert(ptr != nullptr);
+        assert(blocks.size() < filled);
+        ConcurrentFree(ptr);
+
+        for (void* p : blocks)
+        {
+            hc_free(p);
+        }
+        blocks.clear();
+        GetThreadCache()->ReleaseAll();
+        size_t mapped = pageCache->MappedBytes();
+        assert(mapped <= soft);
+
+        // 恢复以后又能申请到硬上限附近
+        k = 0;
+        while (void* p = hc_malloc(sizes[k++ % 4]))
+        {
+            blocks.push_back(p);
+        }
+        assert(blocks.size() * 2 > filled);
+        for (void* p : blocks)
+        {
+            hc_free(p);
+        }
+        GetThreadCache()->ReleaseAll();
+
+        cout << "HeapLimitTest: 填满" << filled << "块, 全部释放后向系统申请的内存 "
+            << mapped / 1024 << " KB" << endl;
+        pageCache->SetHeapLimit(0, 0);
+        heapLimitBlocks = nullptr;
+        });
+    t.join();
+}
+
+// main之前申请内存：这个全局对象和分配器的状态不在同一个翻译单元里，构造顺序没有保证，
+// 分配器的状态都是常量初始化的，所以不管谁先构造都能用
+struct EarlyAlloc
+{
+    void* _small = nullptr;
+    void* _fixed = nullptr;
+    void* _large = nullptr;
+
+    EarlyAlloc()
+    {
+        _small = ConcurrentAlloc(100);
+        _fixed = ConcurrentAlloc<64>();
+        _large = ConcurrentAlloc(600 * 1024);
+        memset(_small, 1, 100);
+        memset(_fixed, 2, 64);
+        memset(_large, 3, 600 * 1024);
+    }
+};
+
+static EarlyAlloc earlyAlloc;
+
+void EarlyAllocTest()
+{
+    assert(earlyAlloc._small && earlyAlloc._fixed && earlyAlloc._large);
+    assert(((char*)earlyAlloc._small)[99] == 1);
+    assert(((char*)earlyAlloc._fixed)[63] == 2);
+    assert(((char*)earlyAlloc._large)[600 * 1024 - 1] == 3);
+    assert(PageCache::GetInstance()->MapObjectToSizeClass(earlyAlloc._small) == SizeClass::Index(100) + 1);
+
+    ConcurrentFree(earlyAlloc._small);
+    ConcurrentFree<64>(earlyAlloc._fixed);
+    ConcurrentFree(earlyAlloc._large);
+    cout << "EarlyAllocTest: main之前申请的内存正常" << endl;
+}
+
+// 独立的堆：堆里的对象不在默认堆的页号映射里；带着没释放的对象直接销毁；
+// 同一个线程在销毁前后用同一个槽位的两个堆，第二个堆拿到的一定是自己的内存，不会是上一个堆的ThreadCache里留下的
+void HeapTest()
+{
+    const size_t sizes[] = { 8, 100, 1000, 40 * 1024, 1200 * 1024 };
+
+    HcHeap* heap = hc_heap_create();
+    assert(heap != nullptr);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([heap, &sizes, t]() {
+            std::vector<void*> v;
+            for (size_t i = 0; i < 1000; ++i)
+            {
+                size_t size = sizes[(i + t) % 5];
+                void* p = hc_heap_alloc(heap, size);
+                assert(p != nullptr);
+                memset(p, (int)t, std::min<size_t>(size, 4096));
+#ifndef HC_SEGMENTS
+                // 按段查的时候只能查默认的堆自己的对象
+                assert(PageCache::GetInstance()->MapObjectToSizeClass(p) == 0);
+#endif
+                v.push_back(p);
+            }
+            // 释放一半，剩下的留给hc_heap_destroy
+            for (size_t i = 0; i < v.size(); i += 2)
+            {
+                hc_heap_free(heap, v[i]);
+            }
+            });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    // 当前线程也在这个堆上缓存一些对象
+    void* kept = hc_heap_alloc(heap, 100);
+    hc_heap_free(heap, kept);
+    size_t mapped = heap->GetPageCache()->MappedBytes();
+    assert(mapped > 0);
+    hc_heap_destroy(heap);
+
+    // 空出来的槽位给新的堆用，当前线程手里的ThreadCache已经作废
+    HcHeap* heap2 = hc_heap_create();
+    assert(heap2 != nullptr && heap2->Slot() == 0);
+    void* p = hc_heap_alloc(heap2, 100);
+    assert(heap2->GetPageCache()->MapObjectToSizeClass(p) == SizeClass::Index(100) + 1);
+    hc_heap_free(heap2, p);
+
+    // 堆的个数有上限
+    std::vector<HcHeap*> heaps;
+    while (HcHeap* h = hc_heap_create())
+    {
+        heaps.push_back(h);
+    }
+    assert(heaps.size() == HC_MAX_HEAPS - 1);
+    for (HcHeap* h : heaps)
+    {
+        hc_heap_destroy(h);
+    }
+    hc_heap_destroy(heap2);
+
+    cout << "HeapTest: 销毁前堆里有 " << mapped / 1024 << " KB" << endl;
+}
+
+// 页从文件映射来的堆：写进去的数据在MADV_PAGEOUT写回文件、回收以后还能读回来；
+// 还回来的大块在文件里打洞后切成小span接着用；销毁时文件关掉
+static void FileHeapTestOne(const char* dir)
+{
+    HcHeapOptions options;
+    options._fileBacked = true;
+    options._dir = dir;
+    options._extentBytes = 4 << 20;
+    HcHeap* heap = hc_heap_create(&options);
+    assert(heap != nullptr);
+
+    std::vector<size_t*> nodes;
+    for (size_t i = 0; i < 100000; ++i)
+    {
+        size_t* p = (size_t*)hc_heap_alloc(heap, 48);
+        p[0] = i;
+        nodes.push_back(p);
+    }
+    char* big = (char*)hc_heap_alloc(heap, 3 << 20);
+    memset(big, 7, 3 << 20);
+
+    assert(hc_heap_sync(heap, nodes[0]) == 0);
+    assert(hc_heap_sync(heap, nullptr, true) == 0);
+    assert(hc_heap_advise(heap, nodes[0], HC_ADVICE_COLD) == 0);
+    hc_heap_advise(heap, big, HC_ADVICE_PAGEOUT);   // 老内核不支持MADV_PAGEOUT，不检查返回值
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        assert(nodes[i][0] == i);
+    }
+    assert(big[(3 << 20) - 1] == 7);
+
+    // 大块还回来以后，它的页被切成小span给后面的小对象用
+    size_t mapped = heap->GetPageCache()->MappedBytes();
+    hc_heap_free(heap, big);
+    for (size_t i = 0; i < 2000; ++i)
+    {
+        size_t* p = (size_t*)hc_heap_alloc(heap, 1000);
+        p[0] = i;
+        nodes.push_back(p);
+    }
+    assert(heap->GetPageCache()->MappedBytes() == mapped);
+
+    // 反复申请释放大块：还回来的大块整块留着，下一次直接用，文件不再变长
+    char* block = (char*)hc_heap_alloc(heap, 2 << 20);
+    hc_heap_free(heap, block);
+    mapped = heap->GetPageCache()->MappedBytes();
+    for (size_t i = 0; i < 500; ++i)
+    {
+        size_t bytes = (i % 2 ? 2 << 20 : 1536 << 10);
+        block = (char*)hc_heap_alloc(heap, bytes);
+        memset(block, (int)i, bytes);
+        hc_heap_free(heap, block);
+    }
+    assert(heap->GetPageCache()->MappedBytes() == mapped);
+
+    hc_heap_destroy(heap);
+}
+
+// 文件变长时上一段剩下的尾巴还能用；不到128页的span还回来合并够大以后在文件里打洞
+static void FileHeapReuseTest(const char* dir)
+{
+    HcHeapOptions options;
+    options._fileBacked = true;
+    options._dir = dir;
+    options._extentBytes = 4 << 20;
+    HcHeap* heap = hc_heap_create(&options);
+    assert(heap != nullptr);
+    FileBacking* file = heap->GetFileBacking();
+
+    // 第一段4MB切掉3MB剩1MB；3.5MB的时候文件长一段，剩下的1MB挂起来，之后1MB的申请用它
+    void* a = hc_heap_alloc(heap, 1536 << 10);
+    void* b = hc_heap_alloc(heap, 1536 << 10);
+    void* c = hc_heap_alloc(heap, 3584 << 10);
+    size_t fileBytes = file->FileBytes();
+    void* d = hc_heap_alloc(heap, 1 << 20);
+    assert(file->FileBytes() == fileBytes);
+    for (void* p : { a, b, c, d })
+        hc_heap_free(heap, p);
+    hc_heap_destroy(heap);
+
+    heap = hc_heap_create(&options);
+    assert(heap != nullptr);
+    file = heap->GetFileBacking();
+    std::vector<void*> blocks;
+    for (size_t i = 0; i < 20; ++i)
+    {
+        blocks.push_back(hc_heap_alloc(heap, 300 << 10));
+        memset(blocks.back(), 1, 300 << 10);
+    }
+    size_t before = file->AllocatedBytes();
+    for (void* p : blocks)
+        hc_heap_free(heap, p);
+    size_t after = file->AllocatedBytes();
+    assert(before >= 20 * (300 << 10) && after < before / 4);
+    hc_heap_destroy(heap);
+}
+
+void FileHeapTest()
+{
+    size_t fds = 0;
+    for (auto& entry : std::filesystem::directory_iterator("/proc/self/fd"))
+    {
+        (void)entry;
+        ++fds;
+    }
+
+    FileHeapTestOne("/tmp");
+    FileHeapTestOne(nullptr);
+    FileHeapReuseTest("/tmp");
+    FileHeapReuseTest(nullptr);
+
+    size_t fdsAfter = 0;
+    for (auto& entry : std::filesystem::directory_iterator("/proc/self/fd"))
+    {
+        (void)entry;
+        ++fdsAfter;
+    }
+    assert(fdsAfter == fds);
+    cout << "FileHeapTest: 文件和memfd做后备的堆正常" << endl;
+}
+
+static size_t ShmTestSize(size_t i)
+{
+    return i % 100 == 0 ? 300 * 1024 : 8 + i * 37 % 5000;
+}
+
+// 子进程按名字打开池子申请、写好内容，父进程按偏移读出来再释放
+void ShmTest()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/hcmalloc-test-%d", (int)getpid());
+    ShmPool* pool = hc_shm_create(name, (size_t)64 << 20);
+    assert(pool);
+    assert(hc_shm_create(name, (size_t)64 << 20) == nullptr);
+
+    // 用别的大小类表编译的程序打不开：把段里的指纹改掉试试
+    {
+        int fd = shm_open(name, O_RDWR, 0);
+        assert(fd >= 0);
+        ShmHeader* hdr = (ShmHeader*)mmap(nullptr, sizeof(ShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        assert(hdr != MAP_FAILED);
+        hdr->_classHash ^= 1;
+        assert(hc_shm_open(name) == nullptr);
+        hdr->_classHash ^= 1;
+        munmap(hdr, sizeof(ShmHeader));
+    }
+
+    const size_t N = 2000;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        ShmPool* child = hc_shm_open(name);
+        if (child == nullptr)
+            _exit(1);
+        uint64_t* offsets = (uint64_t*)hc_shm_alloc(child, N * sizeof(uint64_t));
+        for (size_t i = 0; i < N; ++i)
+        {
+            void* p = hc_shm_alloc(child, ShmTestSize(i));
+            if (p == nullptr)
+                _exit(2);
+            memset(p, (int)(i & 0xFF), ShmTestSize(i));
+            offsets[i] = hc_shm_offset(child, p);
+        }
+        child->SetRoot(hc_shm_offset(child, offsets));
+        hc_shm_close(child);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    uint64_t* offsets = (uint64_t*)hc_shm_ptr(pool, pool->Root());
+    assert(offsets);
+    for (size_t i = 0; i < N; ++i)
+    {
+        unsigned char* p = (unsigned char*)hc_shm_ptr(pool, offsets[i]);
+        assert(p[0] == (i & 0xFF) && p[ShmTestSize(i) - 1] == (i & 0xFF));
+        hc_shm_free(pool, p);
+    }
+    hc_shm_free(pool, offsets);
+    pool->ReleaseThreadCache();
+    assert(pool->UsedPages() == 0);
+
+    // 空闲的页全部合并回去了，能再切出一整块；段的大小是固定的
+    void* big = hc_shm_alloc(pool, (size_t)60 << 20);
+    assert(big);
+    assert(hc_shm_alloc(pool, (size_t)8 << 20) == nullptr);
+    hc_shm_free(pool, big);
+
+    hc_shm_close(pool);
+    assert(hc_shm_unlink(name) == 0);
+    assert(hc_shm_open(name) == nullptr);
+    cout << "ShmTest: 共享内存池跨进程申请释放正常" << endl;
+}
+
+// 读自己的可执行文件，在.note.stapsdt里找到每个探针的note
+void ProbesTest()
+{
+#if HC_PROBES_ENABLED && defined(__LP64__)
+    std::ifstream in("/proc/self/exe", std::ios::binary);
+    std::vector<char> image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    assert(image.size() > sizeof(Elf64_Ehdr));
+
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)image.data();
+    const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(image.data() + ehdr->e_shoff);
+    const char* shstrtab = image.data() + shdrs[ehdr->e_shstrndx].sh_offset;
+
+    std::set<std::string> names;
+    for (size_t i = 0; i < ehdr->e_shnum; ++i)
+    {
+        if (strcmp(shstrtab + shdrs[i].sh_name, ".note.stapsdt") != 0)
+            continue;
+
+        // 每条note：头、"stapsdt"、三个地址、provider、name、参数，各自按4字节对齐
+        const char* p = image.data() + shdrs[i].sh_offset;
+        const char* end = p + shdrs[i].sh_size;
+        while (p < end)
+        {
+            const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*)p;
+            const char* owner = p + sizeof(Elf64_Nhdr);
+            const char* desc = owner + SizeClass::_RoundUp(nhdr->n_namesz, 4);
+            if (nhdr->n_type == 3 && strcmp(owner, "stapsdt") == 0)
+            {
+                const char* provider = desc + 3 * sizeof(uint64_t);
+                const char* name = provider + strlen(provider) + 1;
+                if (strcmp(provider, "hcmalloc") == 0)
+                    names.insert(name);
+            }
+            p = desc + SizeClass::_RoundUp(nhdr->n_descsz, 4);
+        }
+    }
+
+    const char* expected[] = { "tc_fetch", "tc_list_too_long", "cc_refill", "pc_sys_alloc",
+        "pc_coalesce", "large_alloc", "large_free" };
+    for (const char* name : expected)
+    {
+        if (names.count(name) == 0)
+            cout << "ProbesTest: 没有找到探针 " << name << endl;
+        assert(names.count(name) == 1);
+    }
+    cout << "ProbesTest: " << names.size() << "个USDT探针都在" << endl;
+#else
+    cout << "ProbesTest: 没有编进探针，跳过" << endl;
+#endif
+}
+
+static void FillPattern(void* ptr, size_t bytes, unsigned seed)
+{
+    for (size_t i = 0; i < bytes; i += 4096)
+        ((unsigned char*)ptr)[i] = (unsigned char)(seed + i / 4096);
+}
+
+static bool CheckPattern(void* ptr, size_t bytes, unsigned seed)
+{
+    for (size_t i = 0; i < bytes; i += 4096)
+    {
+        if (((unsigned char*)ptr)[i] != (unsigned char)(seed + i / 4096))
+            return false;
+    }
+    return true;
+}
+
+// 小对象、中间大小（拷贝）、超过128页（mremap）之间来回变大变小，内容要保留
+void ReallocTest()
+{
+    const size_t sizes[] = { 8, 13, 100, 5000, 200 * 1024, 300 * 1024, 2 << 20, 64 << 20, 3 << 20, 1100 * 1024, 600 * 1024, 40, 0 };
+    void* p = hc_realloc(nullptr, 1);
+    size_t prev = 1;
+    FillPattern(p, prev, 0);
+    for (size_t i = 0; sizes[i] != 0; ++i)
+    {
+        p = hc_realloc(p, sizes[i]);
+        assert(p != nullptr);
+        assert(CheckPattern(p, std::min(prev, sizes[i]), (unsigned)i));
+        if (sizes[i] > MAX_BYTES)
+        {
+            // 挪过地址的大块也要按页对齐，页号映射跟着改
+            assert(((uintptr_t)p & (((size_t)1 << PAGE_SHIFT) - 1)) == 0);
+            assert(PageCache::GetInstance()->MapObjectToSpan(p)->_pageId == (PAGE_ID)p >> PAGE_SHIFT);
+        }
+        FillPattern(p, sizes[i], (unsigned)i + 1);
+        prev = sizes[i];
+    }
+
+    // 两个大块交替变长，互相挡住原地变长的空间，逼着mremap挪地址
+    void* a = hc_malloc(2 << 20);
+    void* b = hc_malloc(2 << 20);
+    FillPattern(a, 2 << 20, 7);
+    FillPattern(b, 2 << 20, 9);
+    for (size_t bytes = 4 << 20; bytes <= (64 << 20); bytes *= 2)
+    {
+        a = hc_realloc(a, bytes);
+        b = hc_realloc(b, bytes);
+        assert(CheckPattern(a, 2 << 20, 7) && CheckPattern(b, 2 << 20, 9));
+    }
+    hc_free(a);
+    hc_free(b);
+
+    assert(hc_realloc(p, 0) == nullptr);
+    cout << "ReallocTest: hc_realloc保留内容，大块用mremap" << endl;
+}
+
+// ConcurrentAllocIsolated的块独占缓存行；打开hc_set_thread_affine以后两个线程交替拿新切的块也不共用缓存行
+// 在子进程里测，CentralCache里没有前面的测试还回来的块
+void ThreadAffineTest()
+{
+    for (size_t size : { 1, 16, 40, 64, 100, 1000, 5000 })
+    {
+        void* p = ConcurrentAllocIsolated(size);
+        assert((uintptr_t)p % CACHE_LINE_SIZE == 0);
+        assert(SizeClass::RoundUp(SizeClass::AlignedSize(size, CACHE_LINE_SIZE)) % CACHE_LINE_SIZE == 0);
+        ConcurrentFreeIsolated(p, size);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        hc_set_thread_affine(true);
+        const size_t N = 200;
+        std::vector<void*> objs[2] = { std::vector<void*>(N), std::vector<void*>(N) };
+        std::atomic<size_t> turn{ 0 };
+        auto worker = [&](size_t k) {
+            for (size_t i = 0; i < N; ++i)
+            {
+                while (turn.load() % 2 != k)
+                    std::this_thread::yield();
+                objs[k][i] = ConcurrentAlloc(40);
+                ++turn;
+            }
+        };
+        std::thread t0(worker, 0), t1(worker, 1);
+        t0.join();
+        t1.join();
+
+        std::unordered_map<uintptr_t, size_t> owner;
+        for (size_t k = 0; k < 2; ++k)
+        {
+            for (void* p : objs[k])
+            {
+                // 40字节的块可能跨两行
+                for (uintptr_t line : { (uintptr_t)p / CACHE_LINE_SIZE, ((uintptr_t)p + 39) / CACHE_LINE_SIZE })
+                {
+                    auto it = owner.emplace(line, k).first;
+                    if (it->second != k)
+                        _exit(1);
+                }
+            }
+        }
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    cout << "ThreadAffineTest: 独占缓存行正常" << endl;
+}
+
+// 预热以后CentralCache和当前线程的链表里已经有块了，profile存成文件再读回来不变
+// 在子进程里测，CentralCache里没有前面的测试留下的span
+void WarmupTest()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        const size_t size = 48;
+        const size_t index = SizeClass::Index(size);
+        HcWarmupProfile profile;
+        profile._pageBytes = 4 << 20;
+        profile._central[index] = 10000;
+        profile._thread[index] = 300;
+        // 子进程的主线程带着父进程的ThreadCache，线程的部分在新线程里测
+        int result = 0;
+        HcWarmupProfile captured;
+        std::thread([&]() {
+            hc_warmup(profile);
+            if (PageCache::GetInstance()->FreeBytes() < (4 << 20))
+                result = 1;
+            else if (CentralCache::GetInstance()->Capacity(size) < 10000)
+                result = 2;
+            ThreadCache* tc = GetThreadCache();
+            if (tc->CachedBytes() != 300 * SizeClass::ClassSize(index) || tc->ListMaxSize(index) < 300)
+                result = 3;
+
+            // 预热的块直接从链表里拿，不用再去CentralCache
+            std::vector<void*> objs;
+            for (size_t i = 0; i < 300; ++i)
+                objs.push_back(ConcurrentAlloc(size));
+            if (result == 0 && tc->CachedBytes() != 0)
+                result = 4;
+            for (void* p : objs)
+                ConcurrentFree(p);
+
+            // 线程退出时缓存还回去，用完的span会还给PageCache，所以在退出前取
+            hc_warmup_capture(&captured);
+            if (result == 0 && (captured._central[index] < 10000 || captured._thread[index] < 300))
+                result = 5;
+        }).join();
+        if (result != 0)
+            _exit(result);
+
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/hcmalloc-warmup-%d.txt", (int)getpid());
+        HcWarmupProfile loaded;
+        if (!hc_warmup_save(captured, path) || !hc_warmup_load(&loaded, path))
+            _exit(6);
+        unlink(path);
+        if (loaded._pageBytes != captured._pageBytes
+            || memcmp(loaded._central, captured._central, sizeof(loaded._central)) != 0
+            || memcmp(loaded._thread, captured._thread, sizeof(loaded._thread)) != 0)
+            _exit(7);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        cout << "WarmupTest: 子进程失败 " << WEXITSTATUS(status) << endl;
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    cout << "WarmupTest: 预热和profile读写正常" << endl;
+}
+
+void TuningTest()
+{
+    size_t value = 0;
+    assert(HcTuning::ParseSize("123", &value) && value == 123);
+    assert(HcTuning::ParseSize("64K", &value) && value == 64 << 10);
+    assert(HcTuning::ParseSize("8m", &value) && value == 8 << 20);
+    assert(!HcTuning::ParseSize("", &value) && !HcTuning::ParseSize("12x", &value) && !HcTuning::ParseSize("M", &value));
+
+    // 环境变量：用一个新的HcTuning读，写错了的保持默认值
+    setenv("HCMALLOC_BATCH_MAX", "64", 1);
+    setenv("HCMALLOC_THREAD_CACHE_MAX_BYTES", "8M", 1);
+    setenv("HCMALLOC_SLOW_START_STEP", "abc", 1);
+    setenv("HCMALLOC_SCAVENGE_PERIOD", "0", 1);
+    {
+        HcTuning tuning;
+        tuning.LoadEnvironment();
+        assert(tuning._batchMax.load() == 64);
+        assert(tuning._threadCacheMaxBytes.load() == 8 << 20);
+        assert(tuning._slowStartStep.load() == 3);
+        assert(tuning._scavengePeriod.load() == 4096);
+        assert(tuning.NumMoveSize(8) == 64 && tuning.NumMoveSize(MAX_BYTES) == 2);
+    }
+    unsetenv("HCMALLOC_BATCH_MAX");
+    unsetenv("HCMALLOC_THREAD_CACHE_MAX_BYTES");
+    unsetenv("HCMALLOC_SLOW_START_STEP");
+    unsetenv("HCMALLOC_SCAVENGE_PERIOD");
+
+    assert(hc_set_property("no_such_property", 1) == -1);
+    assert(hc_get_property("no_such_property", &value) == -1);
+    assert(hc_set_property("batch_max", 0) == -1);
+    assert(hc_set_property("mapped_bytes", 0) == -1);
+    assert(hc_get_property("batch_max", &value) == 0 && value == 512);
+
+    // 运行中改参数，在子进程里改，不影响后面的测试
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (hc_set_property("batch_max", 8) != 0 || hc_set_property("thread_cache_max_bytes", 64 << 10) != 0
+            || hc_set_property("page_cache_max_free_bytes", 1 << 20) != 0)
+            _exit(1);
+        if (hc_get_property("page_cache_free_bytes", &value) != 0 || value > (1 << 20))
+            _exit(2);
+
+        int result = 0;
+        std::thread([&]() {
+            // 批次最多8块，_maxSize最多两批
+            const size_t size = 16;
+            std::vector<void*> objs;
+            for (int round = 0; round < 10; ++round)
+            {
+                for (size_t i = 0; i < 1000; ++i)
+                    objs.push_back(ConcurrentAlloc(size));
+                for (void* p : objs)
+                    ConcurrentFree(p);
+                objs.clear();
+            }
+            if (GetThreadCache()->ListMaxSize(SizeClass::Index(size)) > 16)
+                result = 3;
+
+            // 线程缓存不超过64KB再多一批
+            for (size_t i = 0; i < 1000; ++i)
+                objs.push_back(ConcurrentAlloc(1024));
+            for (void* p : objs)
+                ConcurrentFree(p);
+            objs.clear();
+            size_t cached = 0;
+            hc_get_property("thread_cache_bytes", &cached);
+            if (result == 0 && cached > (64 << 10) + 8 * 1024)
+                result = 4;
+
+            // 大块还回来，PageCache里最多留1MB空闲的页
+            for (size_t i = 0; i < 100; ++i)
+                objs.push_back(ConcurrentAlloc(200 << 10));
+            for (void* p : objs)
+                ConcurrentFree(p);
+            GetThreadCache()->ReleaseAll();
+        }).join();
+        if (result != 0)
+            _exit(result);
+        if (hc_get_property("page_cache_free_bytes", &value) != 0 || value > (1 << 20))
+            _exit(5);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        cout << "TuningTest: 子进程失败 " << WEXITSTATUS(status) << endl;
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    cout << "TuningTest: 运行时参数和环境变量正常" << endl;
+}
+
+void UsableSizeTest()
+{
+    assert(hc_usable_size(nullptr) == 0);
+    assert(hc_nallocx(0, 0) == hc_nallocx(1, 0));
+    assert(hc_nallocx(100, HC_MALLOCX_ALIGN(16 << 10)) == 0);
+
+    // hc_nallocx和实际申请到的一致，usable size以内都能写，按usable size带大小释放
+    size_t sizes[] = { 1, 7, 8, 9, 100, 129, 1000, 1025, 5000, 9000, 70000, MAX_BYTES, MAX_BYTES + 1, 300 << 10, 2 << 20 };
+    for (size_t size : sizes)
+    {
+        for (size_t lg = 0; lg <= PAGE_SHIFT; lg += 3)
+        {
+            int flags = lg ? HC_MALLOCX_LG_ALIGN(lg) : 0;
+            size_t usable = hc_nallocx(size, flags);
+            assert(usable >= size && usable % ((size_t)1 << lg) == 0);
+
+            void* p = lg ? ConcurrentAllocAligned(size, (size_t)1 << lg) : hc_malloc(size);
+            assert(((uintptr_t)p & (((size_t)1 << lg) - 1)) == 0);
+            assert(hc_usable_size(p) == usable);
+            memset(p, 0x5a, usable);
+            hc_sdallocx(p, lg % 2 ? usable : size, flags);
+        }
+    }
+
+    // 释放的块回到了申请时的大小类：同一个线程马上再申请同样大小拿回的还是它
+    void* p = hc_malloc(100);
+    size_t usable = hc_usable_size(p);
+    hc_sdallocx(p, usable, 0);
+    assert(hc_malloc(100) == p);
+    hc_free(p);
+
+    // HcBuffer的容量正好是大小类，追加的内容不丢
+    HcBuffer buf;
+    std::string expect;
+    for (size_t i = 0; i < 20000; ++i)
+    {
+        char c = (char)('a' + i % 26);
+        size_t n = 1 + i % 37;
+        std::string chunk(n, c);
+        assert(buf.Append(chunk.data(), n));
+        expect += chunk;
+        assert(buf.Capacity() == hc_usable_size(buf.Data()) && buf.Capacity() == hc_nallocx(buf.Capacity(), 0));
+    }
+    assert(buf.Size() == expect.size() && memcmp(buf.Data(), expect.data(), expect.size()) == 0);
+    char* tail = buf.Prepare(16);
+    memcpy(tail, "0123456789abcdef", 16);
+    buf.Commit(16);
+    HcBuffer moved(std::move(buf));
+    assert(buf.Data() == nullptr && moved.Size() == expect.size() + 16);
+    assert(memcmp(moved.Data() + expect.size(), "0123456789abcdef", 16) == 0);
+    cout << "UsableSizeTest: 大小查询和HcBuffer正常" << endl;
+}
+
+// 突发之后闲置的线程：别的线程定期回收时替它把ThreadCache还掉（要两次扫描之间一次慢路径都没走过，并且睡着），
+// RequestReleaseAll马上还掉
+void ReclaimIdleTest()
+{
+#ifndef HC_IDLE_RECLAIM
+    cout << "ReclaimIdleTest: 没有打开跨线程回收，跳过" << endl;
+#else
+
+    size_t period = 0;
+    assert(hc_get_property("scavenge_period", &period) == 0);
+    assert(hc_set_property("scavenge_period", 64) == 0);
+
+    for (int round = 0; round < 2; ++round)
+    {
+        // 闲置的线程要睡在系统调用里才会被回收，这里让它在条件变量上等
+        std::mutex mtx;
+        std::condition_variable cv;
+        int stage = 0;
+        size_t before = 0;
+        size_t after = 0;
+        std::thread t([&]() {
+            std::vector<void*> v;
+            for (size_t i = 0; i < 2000; ++i)
+                v.push_back(ConcurrentAlloc(64 + i % 512));
+            for (void* p : v)
+                ConcurrentFree(p);
+            before = GetThreadCache()->CachedBytes();
+            std::unique_lock<std::mutex> lock(mtx);
+            stage = 1;
+            cv.notify_all();
+            cv.wait(lock, [&]() { return stage == 2; });
+            lock.unlock();
+            after = GetThreadCache()->CachedBytes();
+            });
+
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]() { return stage == 1; });
+        }
+        // 等它真的睡下去
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        if (round == 0)
+        {
+            // 本线程的回收计数还停在原来的间隔上，多释放几轮
+            for (size_t i = 0; i < 10000; ++i)
+                ConcurrentFree(ConcurrentAlloc(32));
+        }
+        else
+        {
+            ThreadCache::RequestReleaseAll();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stage = 2;
+        }
+        cv.notify_all();
+        t.join();
+        assert(before > 0 && after == 0);
+    }
+
+    assert(hc_set_property("scavenge_period", period) == 0);
+    cout << "ReclaimIdleTest: 闲置线程的ThreadCache被别的线程还掉" << endl;
+#endif
+}
+
+// 4GB以上的大块：span的页数是uint32_t，换算成字节时不能在32位里溢出，否则释放后向系统申请的字节数对不上
+void HugeSpanTest()
+{
+    size_t before = PageCache::GetInstance()->MappedBytes();
+    size_t bytes = ((size_t)4 << 30) + ((size_t)1 << PAGE_SHIFT);
+    void* big = hc_malloc(bytes);
+    assert(big != nullptr);
+    assert(PageCache::GetInstance()->MappedBytes() >= before + bytes);
+    assert(hc_usable_size(big) >= bytes);
+    hc_free(big);
+    assert(PageCache::GetInstance()->MappedBytes() == before);
+    cout << "HugeSpanTest: 4GB以上的大块释放后计数正确" << endl;
+}
+
+// 按段管理页(HC_SEGMENTS)：超过一段的大块后面几段没有段头，查这几段里的页要找到这个大块；
+// 快到硬上限时一整段申请不下来，退回只申请段头加k页
+void SegmentTest()
+{
+#ifndef HC_SEGMENTS
+    cout << "SegmentTest: 没有打开HC_SEGMENTS，跳过" << endl;
+#else
+    PageCache* pageCache = PageCache::GetInstance();
+
+    size_t bytes = 10 * 1024 * 1024;
+    char* big = (char*)hc_malloc(bytes);
+    assert(big != nullptr);
+    // 后面几段的开头是用户数据，按段头读会读到这些字节
+    memset(big, 0xAB, bytes);
+    Span* span = pageCache->MapObjectToSpan(big);
+    assert(span->_n >= bytes >> PAGE_SHIFT);
+    char* second = (char*)(((uintptr_t)big + SEGMENT_SIZE - 1) & ~(uintptr_t)(SEGMENT_SIZE - 1));
+    assert(pageCache->MapObjectToSpan(second) == span);
+    assert(pageCache->MapObjectToSpan(second + 100 * 1024) == span);
+    assert(pageCache->MapObjectToSpan(big + bytes - 1) == span);
+    assert(hc_usable_size(big) >= bytes);
+    hc_free(big);
+
+    std::thread t([&]() {
+        {
+            std::lock_guard<HcMutex> lock(pageCache->_pageMtx);
+            pageCache->ReleaseFreeSpans();
+        }
+        size_t mapped = pageCache->MappedBytes();
+        pageCache->SetHeapLimit(0, mapped + ((size_t)64 << PAGE_SHIFT));
+
+        // 300KB直接找PageCache要38页：一整段超过硬上限，段头加38页不超过
+        void* ptr = hc_malloc(300 * 1024);
+        assert(ptr != nullptr);
+        assert(pageCache->MappedBytes() == mapped + ((size_t)39 << PAGE_SHIFT));
+        memset(ptr, 1, 300 * 1024);
+        hc_free(ptr);
+
+        pageCache->SetHeapLimit(0, 0);
+        });
+    t.join();
+    cout << "SegmentTest: 超过一段的大块能按页查到，整段申请不下来时只申请段头加k页" << endl;
+#endif
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdio>
+
+#include "ConcurrentAlloc.hpp"
+
+// 预热：刚启动的进程每个线程的ThreadCache都是空的，每个桶第一次都要去PageCache、再去系统要内存（还要缺页），
+// 开始接流量的头几秒延迟会有尖刺。按一份profile提前把这些都准备好：
+//     HcWarmupProfile profile;
+//     hc_warmup_load(&profile, "warmup.txt");
+//     hc_warmup(profile);                  // 启动时调用一次：PageCache、CentralCache，再加当前线程
+//     hc_warmup_thread(profile);           // 每个工作线程开始干活前各调用一次
+// profile可以手写，也可以从一个跑热了的进程里取出来：
+//     hc_warmup_capture(&profile);         // 每个工作线程退出前各调用一次，结果合并到一起
+//     hc_warmup_save(profile, "warmup.txt");
+// 预热的内存和正常申请的一样：线程缓存会按原来的规则慢慢还回去，空闲的页超过软上限也会还给系统
+
+struct HcWarmupProfile
+{
+    size_t _pageBytes = 0;              // 预热完以后PageCache里至少还有这么多空闲页
+    size_t _central[NFREELIST] = {};    // 每个大小类CentralCache里挂着的span至少能分出多少块
+    size_t _thread[NFREELIST] = {};     // 每个线程的FreeList里预先放多少块
+};
+
+// 只预热当前线程的ThreadCache
+inline void hc_warmup_thread(const HcWarmupProfile& profile)
+{
+    ThreadCache* tc = GetThreadCache();
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        if (profile._thread[i] > 0)
+            tc->Prefill(i, profile._thread[i]);
+    }
+}
+
+// 给CentralCache挂上span，预热当前线程，最后让PageCache里还剩下_pageBytes的空闲页
+inline void hc_warmup(const HcWarmupProfile& profile)
+{
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        if (profile._central[i] > 0)
+            CentralCache::GetInstance()->Reserve(SizeClass::ClassSize(i), profile._central[i]);
+    }
+    hc_warmup_thread(profile);
+    if (profile._pageBytes > 0)
+        PageCache::GetInstance()->Reserve(profile._pageBytes);
+}
+
+// 按现在的状态填profile：PageCache和CentralCache的部分直接覆盖，
+// 线程的部分和profile里已有的取大的，所以每个线程各调用一次就能得到所有线程里最大的
+inline void hc_warmup_capture(HcWarmupProfile* profile)
+{
+    profile->_pageBytes = PageCache::GetInstance()->FreeBytes();
+    ThreadCache* tc = GetThreadCache();
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        profile->_central[i] = CentralCache::GetInstance()->Capacity(SizeClass::ClassSize(i));
+        // _maxSize从1开始，没用过的大小类不记
+        size_t maxSize = tc->ListMaxSize(i);
+        if (maxSize > 1)
+            profile->_thread[i] = std::max(profile->_thread[i], maxSize);
+    }
+}
+
+// 文本格式，可以手改：一行一个大小类，按块大小记（换了大小类表也能用，落到哪个类算哪个）
+//     # hcmalloc warmup profile
+//     pages <字节数>
+//     <块大小> <CentralCache块数> <每线程块数>
+inline bool hc_warmup_save(const HcWarmupProfile& profile, const char* path)
+{
+    FILE* fp = fopen(path, "w");
+    if (fp == nullptr)
+        return false;
+    fprintf(fp, "# hcmalloc warmup profile\n");
+    fprintf(fp, "pages %zu\n", profile._pageBytes);
+    for (size_t i = 0; i < NFREELIST; ++i)
+    {
+        if (profile._central[i] > 0 || profile._thread[i] > 0)
+            fprintf(fp, "%zu %zu %zu\n", SizeClass::ClassSize(i), profile._central[i], profile._thread[i]);
+    }
+    return fclose(fp) == 0;
+}
+
+// 读进来的数合并到profile里（取大的），文件打不开或者格式不对时返回false
+inline bool hc_warmup_load(HcWarmupProfile* profile, const char* path)
+{
+    FILE* fp = fopen(path, "r");
+    if (fp == nullptr)
+        return false;
+
+    bool ok = true;
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        size_t size = 0, central = 0, thread = 0;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "pages %zu", &size) == 1)
+        {
+            profile->_pageBytes = std::max(profile->_pageBytes, size);
+        }
+        else if (sscanf(line, "%zu %zu %zu", &size, &central, &thread) == 3 && size > 0 && size <= MAX_BYTES)
+        {
+            size_t index = SizeClass::Index(size);
+            profile->_central[index] = std::max(profile->_central[index], central);
+            profile->_thread[index] = std::max(profile->_thread[index], thread);
+        }
+        else
+        {
+            ok = false;
+            break;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
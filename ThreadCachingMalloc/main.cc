@@ -2,7 +2,25 @@
 
 int main()
 {
+    EarlyAllocTest();
     TLStest();
+    ArenaTest();
+#ifdef HC_GUARDED_SAMPLING
+    GuardedTest();
+#endif
+    HeapLimitTest();
+    HeapTest();
+    FileHeapTest();
+    ShmTest();
+    ProbesTest();
+    ReallocTest();
+    ThreadAffineTest();
+    WarmupTest();
+    TuningTest();
+    UsableSizeTest();
+    ReclaimIdleTest();
+    HugeSpanTest();
+    SegmentTest();
 
     return 0;
 }
\ No newline at end of file